@@ -25,16 +25,49 @@
 #define HIGH 1
 #define LOW 0
 
+// Lines, for SetLines
+#define LINE_MCLR 1
+#define LINE_VDD 2
+#define LINE_CLOCK 4
+#define LINE_DATA 8
+#define LINE_LVP 16
+
+// A programmer on one port.  Each has its own lines, so several can be
+// driven at once from different threads.
+struct io_port;
+
+// Load the OS support for the ports.  Called once, before OpenPort.
 int InitIo(int debug);
-void SetMclr(int level);
-void SetVdd(int level);
-void SetClock(int level);
-void SetData(int level);
-void SetLvp(int level);
+
+// Open a port.  What the name means depends on the backend (for the
+// parallel port, it is the base address, such as 0x378).  NULL opens the
+// default port.  Returns NULL if the port can't be opened.
+struct io_port *OpenPort(const char *name);
+void ClosePort(struct io_port *port);
+
+void SetMclr(struct io_port *port, int level);
+void SetVdd(struct io_port *port, int level);
+void SetClock(struct io_port *port, int level);
+void SetData(struct io_port *port, int level);
+void SetLvp(struct io_port *port, int level);
+
+// Set each of the lines in mask (LINE_ bits) HIGH if its bit in levels is
+// set, or LOW if it isn't, all at once where the hardware allows.
+void SetLines(struct io_port *port, int mask, int levels);
 
 // Note: you must set data HIGH before reading data
-int ReadData(void);
+int ReadData(struct io_port *port);
 void Delay(int microseconds);
 
+// Call func once for each of the count args, all at the same time, each on
+// its own thread at the highest priority the OS gives, so the bit timing of
+// one port isn't held up by the others.  Returns once they have all
+// finished, or -1 if the threads can't be started.
+int RunConcurrently(void (*func)(void *arg), void **args, int count);
+
+// Microseconds since an arbitrary starting point, for measuring how long
+// things take
+long GetMicroseconds(void);
+
 #endif
 
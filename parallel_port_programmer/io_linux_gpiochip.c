@@ -0,0 +1,478 @@
+//
+// Copyright 2005-2012 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// The programming lines on the GPIOs of a Linux GPIO character device
+// (/dev/gpiochipN), such as those of a single board computer.  Each port
+// holds all of its lines in one line request, so SetLines changes several of
+// them with one ioctl.
+//
+// The port name is the chip, optionally followed by the lines to use:
+//   gpiochip0:pgd=17,pgc=27,vdd=22,vpp=23,lvp=24,in=25,invert=vdd+pgd
+// A chip without a '/' is in /dev.  Lines are offsets on the chip, and those
+// not given are the ones above.  in is the data input; with in=none, PGD is
+// driven open drain with a pull-up and read back on its own line.  invert
+// lists the lines that are active low (or none), by default the ones the
+// parallel port driver board inverts: VDD and the data output, except with
+// in=none.  An open drain PGD can't be inverted, since releasing it to read
+// would then pull it low.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "io.h"
+
+#define DEFAULT_CHIP "gpiochip0"
+#define CONSUMER "pic programmer"
+#define MAX_NAME 256
+#define MAX_THREADS 64
+#define MIN_SLEEP 1000		// Microseconds.  Shorter delays spin.
+
+// Lines of a port, in the order of the LINE_ bits, so line i of the request
+// is LINE_ bit (1 << i).  PIN_IN is only requested if there is one.
+enum {
+	PIN_MCLR,
+	PIN_VDD,
+	PIN_CLOCK,
+	PIN_DATA,
+	PIN_LVP,
+	PIN_IN,
+	PIN_COUNT
+};
+
+#define OUTPUT_PINS ((1 << PIN_IN) - 1)
+
+static const char *pin_names[PIN_COUNT] = {
+	"vpp", "vdd", "pgc", "pgd", "lvp", "in"
+};
+
+static const int default_offsets[PIN_COUNT] = { 23, 22, 27, 17, 24, 25 };
+
+#define DEFAULT_INVERTED ((1 << PIN_VDD) | (1 << PIN_DATA))
+
+struct io_port {
+	int fd;			// The line request
+	int data_in;	// Line that ReadData reads: PIN_IN, or PIN_DATA if open drain
+};
+
+struct thread_start {
+	void (*func)(void *arg);
+	void *arg;
+};
+
+static int debug = 0;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int start_state;		// 0 while threads are being created, 1 to run, -1 to give up
+static int priority_warned = 0;
+
+int InitIo(int debug_output)
+{
+	debug = debug_output;
+	return 0;
+}
+
+static int FindPin(const char *name)
+{
+	int i;
+
+	for (i = 0; i < PIN_COUNT; i++) {
+		if (strcmp(pin_names[i], name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+// Parse the options after the chip name.  Returns -1 if there is a bad one.
+static int ParseOptions(char *options, int *offsets, int *inverted)
+{
+	char *option;
+	char *option_save;
+	char *value;
+	char *end;
+	char *name;
+	char *name_save;
+	int pin;
+
+	for (option = strtok_r(options, ",", &option_save); option != NULL;
+		option = strtok_r(NULL, ",", &option_save)) {
+		value = strchr(option, '=');
+		if (value == NULL)
+			return -1;
+
+		*value++ = '\0';
+		if (strcmp(option, "invert") == 0) {
+			*inverted = 0;
+			if (strcmp(value, "none") == 0)
+				continue;
+
+			for (name = strtok_r(value, "+", &name_save); name != NULL;
+				name = strtok_r(NULL, "+", &name_save)) {
+				pin = FindPin(name);
+				if (pin < 0)
+					return -1;
+
+				*inverted |= 1 << pin;
+			}
+
+			continue;
+		}
+
+		pin = FindPin(option);
+		if (pin < 0)
+			return -1;
+
+		if (pin == PIN_IN && strcmp(value, "none") == 0) {
+			offsets[pin] = -1;
+			continue;
+		}
+
+		offsets[pin] = strtoul(value, &end, 0);
+		if (*end != '\0' || *value == '\0')
+			return -1;
+	}
+
+	return 0;
+}
+
+// Give a set of lines their own flags, sharing an attribute with lines that
+// have the same ones
+static void SetLineFlags(struct gpio_v2_line_config *config, int pin,
+	unsigned long long flags)
+{
+	unsigned int i;
+
+	if (flags == config->flags)
+		return;
+
+	for (i = 0; i < config->num_attrs; i++) {
+		if (config->attrs[i].attr.id == GPIO_V2_LINE_ATTR_ID_FLAGS
+			&& config->attrs[i].attr.flags == flags)
+			break;
+	}
+
+	if (i == config->num_attrs) {
+		config->attrs[i].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+		config->attrs[i].attr.flags = flags;
+		config->num_attrs++;
+	}
+
+	config->attrs[i].mask |= 1ULL << pin;
+}
+
+// The name is the chip and the lines on it (see above)
+struct io_port *OpenPort(const char *name)
+{
+	struct gpio_v2_line_request request;
+	struct gpio_v2_line_config_attribute *values;
+	struct io_port *port;
+	char buffer[MAX_NAME];
+	char path[MAX_NAME + 8];
+	char *options;
+	int offsets[PIN_COUNT];
+	int inverted = -1;
+	unsigned long long flags;
+	int chip;
+	int i;
+
+	if (name == NULL)
+		name = DEFAULT_CHIP;
+
+	if (strlen(name) >= sizeof(buffer)) {
+		printf("bad port %s\n", name);
+		return NULL;
+	}
+
+	strcpy(buffer, name);
+	memcpy(offsets, default_offsets, sizeof(offsets));
+	options = strchr(buffer, ':');
+	if (options != NULL) {
+		*options++ = '\0';
+		if (ParseOptions(options, offsets, &inverted) < 0) {
+			printf("bad port %s\n", name);
+			return NULL;
+		}
+	}
+
+	if (inverted < 0) {
+		inverted = DEFAULT_INVERTED;
+		if (offsets[PIN_IN] < 0)
+			inverted &= ~(1 << PIN_DATA);
+	}
+
+	if (offsets[PIN_IN] < 0 && (inverted & (1 << PIN_DATA))) {
+		printf("%s: pgd can't be inverted with in=none\n", name);
+		return NULL;
+	}
+
+	snprintf(path, sizeof(path), "%s%s", strchr(buffer, '/') ? "" : "/dev/", buffer);
+	chip = open(path, O_RDWR | O_CLOEXEC);
+	if (chip < 0) {
+		printf("error opening %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	port = calloc(1, sizeof(struct io_port));
+	if (port == NULL) {
+		close(chip);
+		return NULL;
+	}
+
+	memset(&request, 0, sizeof(request));
+	strncpy(request.consumer, CONSUMER, sizeof(request.consumer) - 1);
+	request.num_lines = offsets[PIN_IN] >= 0 ? PIN_COUNT : PIN_IN;
+	for (i = 0; i < (int) request.num_lines; i++)
+		request.offsets[i] = offsets[i];
+
+	request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	for (i = 0; i < (int) request.num_lines; i++) {
+		flags = i == PIN_IN ? GPIO_V2_LINE_FLAG_INPUT : GPIO_V2_LINE_FLAG_OUTPUT;
+		if (i == PIN_DATA && offsets[PIN_IN] < 0)
+			flags |= GPIO_V2_LINE_FLAG_OPEN_DRAIN | GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+
+		if (inverted & (1 << i))
+			flags |= GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+
+		SetLineFlags(&request.config, i, flags);
+	}
+
+	// Every output starts LOW, so the target is off
+	values = &request.config.attrs[request.config.num_attrs++];
+	values->attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	values->attr.values = 0;
+	values->mask = OUTPUT_PINS;
+
+	if (ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
+		printf("error requesting lines on %s: %s\n", path, strerror(errno));
+		close(chip);
+		free(port);
+		return NULL;
+	}
+
+	close(chip);
+	port->fd = request.fd;
+	port->data_in = offsets[PIN_IN] >= 0 ? PIN_IN : PIN_DATA;
+
+	return port;
+}
+
+void ClosePort(struct io_port *port)
+{
+	close(port->fd);
+	free(port);
+}
+
+static void *ThreadMain(void *param)
+{
+	struct thread_start *start = param;
+	int state;
+
+	pthread_mutex_lock(&start_lock);
+	while (start_state == 0)
+		pthread_cond_wait(&start_cond, &start_lock);
+
+	state = start_state;
+	pthread_mutex_unlock(&start_lock);
+
+	if (state > 0)
+		start->func(start->arg);
+
+	return NULL;
+}
+
+// Real time scheduling needs root or CAP_SYS_NICE.  Without it, the thread
+// still runs, at normal priority.
+static int StartThread(pthread_t *thread, struct thread_start *start)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	int result;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+	result = pthread_create(thread, &attr, ThreadMain, start);
+	pthread_attr_destroy(&attr);
+	if (result == EPERM) {
+		if (!priority_warned) {
+			printf("can't use real time priority, bit timing may be uneven\n");
+			priority_warned = 1;
+		}
+
+		result = pthread_create(thread, NULL, ThreadMain, start);
+	}
+
+	return result;
+}
+
+static void SetStartState(int state)
+{
+	pthread_mutex_lock(&start_lock);
+	start_state = state;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&start_lock);
+}
+
+// The threads wait for each other to be created, so none begins until all of
+// them exist and have their priority.
+int RunConcurrently(void (*func)(void *arg), void **args, int count)
+{
+	pthread_t threads[MAX_THREADS];
+	struct thread_start starts[MAX_THREADS];
+	int i;
+
+	if (count > MAX_THREADS)
+		return -1;
+
+	start_state = 0;
+	for (i = 0; i < count; i++) {
+		starts[i].func = func;
+		starts[i].arg = args[i];
+		if (StartThread(&threads[i], &starts[i]) != 0) {
+			printf("error creating thread\n");
+
+			// None of them have run yet
+			SetStartState(-1);
+			while (--i >= 0)
+				pthread_join(threads[i], NULL);
+
+			return -1;
+		}
+	}
+
+	SetStartState(1);
+	for (i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+
+	return 0;
+}
+
+long GetMicroseconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// Only differences are meaningful, so it doesn't matter if this wraps
+	return (long) ((unsigned long) now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+// Sleeping can take much longer than asked for, so short delays spin on the
+// clock.  They yield while they do, so other ports' threads at the same real
+// time priority still get to run on a single core.
+void Delay(int microseconds)
+{
+	struct timespec wait;
+	unsigned long start;
+
+	if (debug)
+		printf("Delay %d\n", microseconds);
+
+	if (microseconds >= MIN_SLEEP) {
+		wait.tv_sec = microseconds / 1000000;
+		wait.tv_nsec = (microseconds % 1000000) * 1000L;
+		while (nanosleep(&wait, &wait) < 0 && errno == EINTR)
+			;
+
+		return;
+	}
+
+	start = GetMicroseconds();
+	while ((unsigned long) GetMicroseconds() - start < (unsigned long) microseconds)
+		sched_yield();
+}
+
+static void WriteLines(struct io_port *port, int mask, int levels)
+{
+	struct gpio_v2_line_values values;
+
+	values.mask = mask & OUTPUT_PINS;
+	values.bits = levels & mask & OUTPUT_PINS;
+	if (ioctl(port->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+		printf("error setting lines: %s\n", strerror(errno));
+}
+
+// The LINE_ bits are the lines' bits in the request, and the inverting ones
+// are active low, so levels go straight to the ioctl.
+void SetLines(struct io_port *port, int mask, int levels)
+{
+	if (debug)
+		printf("Lines %02x = %02x\n", mask, levels);
+
+	WriteLines(port, mask, levels);
+}
+
+static void SetLine(struct io_port *port, int line, const char *name, int level)
+{
+	if (debug)
+		printf("%s %s\n", name, level == HIGH ? "HIGH" : "LOW");
+
+	WriteLines(port, line, level == HIGH ? line : 0);
+}
+
+void SetMclr(struct io_port *port, int level)
+{
+	SetLine(port, LINE_MCLR, "VPP", level);
+}
+
+void SetVdd(struct io_port *port, int level)
+{
+	SetLine(port, LINE_VDD, "VDD", level);
+}
+
+void SetClock(struct io_port *port, int level)
+{
+	SetLine(port, LINE_CLOCK, "Clock", level);
+}
+
+void SetData(struct io_port *port, int level)
+{
+	SetLine(port, LINE_DATA, "Data", level);
+}
+
+void SetLvp(struct io_port *port, int level)
+{
+	SetLine(port, LINE_LVP, "LVP", level);
+}
+
+int ReadData(struct io_port *port)
+{
+	struct gpio_v2_line_values values;
+	int value;
+
+	values.mask = 1ULL << port->data_in;
+	values.bits = 0;
+	if (ioctl(port->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+		printf("error reading data: %s\n", strerror(errno));
+
+	value = (values.bits & values.mask) != 0;
+	if (debug)
+		printf("Read %s\n", value == HIGH ? "HIGH" : "LOW");
+
+	return value;
+}
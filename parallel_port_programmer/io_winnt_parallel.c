@@ -15,12 +15,13 @@
 // 
 
 #include <windows.h>
+#include <stdlib.h>
 #include "io.h"
 
 #define LPT1_BASE 0x278
-#define LPT_DATA LPT1_BASE
-#define LPT_STATUS (LPT1_BASE + 1)
-#define LPT_CONTROL (LPT1_BASE + 2)
+#define LPT_DATA(port) ((port)->base)
+#define LPT_STATUS(port) ((port)->base + 1)
+#define LPT_CONTROL(port) ((port)->base + 2)
 
 #define BIT_PGD  1
 #define BIT_PGC 2
@@ -31,8 +32,17 @@
 static unsigned char _stdcall (*DlPortReadPortUchar)(unsigned long Port);
 static void _stdcall (*DlPortWritePortUchar)(unsigned long Port, unsigned char Value);
 
+struct io_port {
+	unsigned long base;
+	unsigned char set_bits;	// Last value written to the data register
+};
+
+struct thread_start {
+	void (*func)(void *arg);
+	void *arg;
+};
+
 static HANDLE hDlPortIoLibrary;
-static unsigned char set_bits;
 static int debug = 0;
 
 // Load the DlPortIO library and find the addresses to functions to read
@@ -57,10 +67,86 @@ int InitIo(int debug_output)
 		return -1;
 	}
 
+	debug = debug_output;
+
+	return 0;
+}
+
+// The name is the base address of the port's registers
+struct io_port *OpenPort(const char *name)
+{
+	struct io_port *port;
+	char *end;
+
+	port = calloc(1, sizeof(struct io_port));
+	if (port == NULL)
+		return NULL;
+
+	port->base = LPT1_BASE;
+	if (name != NULL) {
+		port->base = strtoul(name, &end, 0);
+		if (*end != '\0' || port->base == 0) {
+			printf("bad port address %s\n", name);
+			free(port);
+			return NULL;
+		}
+	}
+
 	// Enable LPT port
-	DlPortWritePortUchar(LPT_CONTROL, 1);
+	DlPortWritePortUchar(LPT_CONTROL(port), 1);
 
-	debug = debug_output;
+	return port;
+}
+
+void ClosePort(struct io_port *port)
+{
+	free(port);
+}
+
+static DWORD WINAPI ThreadMain(LPVOID param)
+{
+	struct thread_start *start = param;
+
+	start->func(start->arg);
+	return 0;
+}
+
+// The threads are started suspended, so none begins until all of them
+// exist and have their priority.
+int RunConcurrently(void (*func)(void *arg), void **args, int count)
+{
+	HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+	struct thread_start starts[MAXIMUM_WAIT_OBJECTS];
+	int i;
+
+	if (count > MAXIMUM_WAIT_OBJECTS)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		starts[i].func = func;
+		starts[i].arg = args[i];
+		threads[i] = CreateThread(NULL, 0, ThreadMain, &starts[i], CREATE_SUSPENDED, NULL);
+		if (threads[i] == NULL) {
+			printf("error creating thread\n");
+
+			// None of them have run yet
+			while (--i >= 0) {
+				TerminateThread(threads[i], 0);
+				CloseHandle(threads[i]);
+			}
+
+			return -1;
+		}
+
+		SetThreadPriority(threads[i], THREAD_PRIORITY_TIME_CRITICAL);
+	}
+
+	for (i = 0; i < count; i++)
+		ResumeThread(threads[i]);
+
+	WaitForMultipleObjects(count, threads, TRUE, INFINITE);
+	for (i = 0; i < count; i++)
+		CloseHandle(threads[i]);
 
 	return 0;
 }
@@ -85,69 +171,83 @@ void Delay(int microseconds)
 		Sleep(microseconds / 1000);
 }
 
+long GetMicroseconds(void)
+{
+	LARGE_INTEGER count;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+
+	// Split up so the multiply can't overflow.  Only differences are
+	// meaningful, so it doesn't matter if the result wraps.
+	return (long) (count.QuadPart / frequency.QuadPart * 1000000
+		+ count.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
+
 // VPP (_MCLR)  control is attached to D3.  It is an non-inverting input
 // VPP is high when D3 is low
-void SetMclr(int level)
+void SetMclr(struct io_port *port, int level)
 {
 	if (debug)
 		printf("VPP %s\n", level ? "HIGH" : "LOW");
 
 	if (level == HIGH)
-		set_bits |= BIT_VPP;
+		port->set_bits |= BIT_VPP;
 	else
-		set_bits &= ~BIT_VPP;
+		port->set_bits &= ~BIT_VPP;
 
-	DlPortWritePortUchar(LPT_DATA, set_bits);
+	DlPortWritePortUchar(LPT_DATA(port), port->set_bits);
 }
 
 // VDD is attached to D2.  it is an inverting input
-void SetVdd(int level)
+void SetVdd(struct io_port *port, int level)
 {
 	if (debug)
 		printf("VDD %s\n", level ? "HIGH" : "LOW");
 
 	if (level == LOW)
-		set_bits |= BIT_VDD;
+		port->set_bits |= BIT_VDD;
 	else
-		set_bits &= ~BIT_VDD;
+		port->set_bits &= ~BIT_VDD;
 
-	DlPortWritePortUchar(LPT_DATA, set_bits);
+	DlPortWritePortUchar(LPT_DATA(port), port->set_bits);
 }
 
 // Clock is attached to D1.  It is non-inverting.
-void SetClock(int level)
+void SetClock(struct io_port *port, int level)
 {
 	if (debug)
 		printf("Clock %s\n", level == HIGH ? "HIGH" : "LOW");
 
 	if (level == HIGH)
-		set_bits |= BIT_PGC;
+		port->set_bits |= BIT_PGC;
 	else
-		set_bits &= ~BIT_PGC;
+		port->set_bits &= ~BIT_PGC;
 
-	DlPortWritePortUchar(LPT_DATA, set_bits);
+	DlPortWritePortUchar(LPT_DATA(port), port->set_bits);
 }
 
 // Data output is attached to D0.  It is inverting.
-void SetData(int level)
+void SetData(struct io_port *port, int level)
 {
 	if (debug)
 		printf("Data %s\n", level == HIGH ? "HIGH" : "LOW");
 
 	if (level == LOW)
-		set_bits |= BIT_PGD;
+		port->set_bits |= BIT_PGD;
 	else
-		set_bits &= ~BIT_PGD;
+		port->set_bits &= ~BIT_PGD;
 
-	DlPortWritePortUchar(LPT_DATA, set_bits);
+	DlPortWritePortUchar(LPT_DATA(port), port->set_bits);
 }
 
 // Data input is attached to ACK.  It is non-inverting.
-int ReadData(void)
+int ReadData(struct io_port *port)
 {
 	int value;
 
-	value = ((DlPortReadPortUchar(LPT_STATUS) & 0x40) != 0);
+	value = ((DlPortReadPortUchar(LPT_STATUS(port)) & 0x40) != 0);
 
 	if (debug)
 		printf("Read %s\n", value == HIGH ? "HIGH" : "LOW");
@@ -156,16 +256,47 @@ int ReadData(void)
 }
 
 // Low voltage programming is attached to D4.  It is non-inverting.
-void SetLvp(int level)
+void SetLvp(struct io_port *port, int level)
 {
 	if (debug)
 		printf("LVP %s\n", level == HIGH ? "HIGH" : "LOW");
 
 	if (level == HIGH)
-		set_bits |= BIT_LVP;
+		port->set_bits |= BIT_LVP;
 	else
-		set_bits &= ~BIT_LVP;
+		port->set_bits &= ~BIT_LVP;
 
-	DlPortWritePortUchar(LPT_DATA, set_bits);
+	DlPortWritePortUchar(LPT_DATA(port), port->set_bits);
 }
 
+// All of the lines are in the data register, so they change with one write
+void SetLines(struct io_port *port, int mask, int levels)
+{
+	static const struct {
+		int line;
+		unsigned char bit;
+		int inverting;
+	} lines[] = {
+		{ LINE_MCLR, BIT_VPP, 0 },
+		{ LINE_VDD, BIT_VDD, 1 },
+		{ LINE_CLOCK, BIT_PGC, 0 },
+		{ LINE_DATA, BIT_PGD, 1 },
+		{ LINE_LVP, BIT_LVP, 0 }
+	};
+	unsigned int i;
+
+	if (debug)
+		printf("Lines %02x = %02x\n", mask, levels);
+
+	for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+		if ((mask & lines[i].line) == 0)
+			continue;
+
+		if (((levels & lines[i].line) != 0) != lines[i].inverting)
+			port->set_bits |= lines[i].bit;
+		else
+			port->set_bits &= ~lines[i].bit;
+	}
+
+	DlPortWritePortUchar(LPT_DATA(port), port->set_bits);
+}
@@ -18,15 +18,24 @@
 // Based on DS41196E "PIC16F627A/628A/648A EEPROM Memory Programming Specification" 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "io.h"
 
 #define DEVICE_TYPE_F84A 0
 
 #define MAX_PROGRAM_SIZE 0x2000
+#define PROGRAM_MEMORY_SIZE 0x1000	// PIC16F648A, the largest part, for unknown device IDs
 #define PROGRESS_BAR_WIDTH 50
+#define CONFIG_MEMORY_WORDS 8		// 0x2000 (ID locations) to 0x2007 (config word)
+#define CONFIG_MEMORY_OFFSET 0x4000	// Byte offset of 0x2000 in the hex file
+#define DATA_MEMORY_SIZE 256		// Data EEPROM bytes on the PIC16F648A, the largest part
+#define DATA_MEMORY_OFFSET 0x4200	// Byte offset of data EEPROM (0x2100) in the hex file
+#define HEX_BUFFER_SIZE (DATA_MEMORY_OFFSET + DATA_MEMORY_SIZE * 2)
 
 // Commands
 #define CMD_LOAD_DATA_PROGRAM 0x02
+#define CMD_LOAD_DATA_DATA 0x03
 #define CMD_INCREMENT_ADDR 0x06
 #if DEVICE_TYPE_F84A
 	#define CMD_BEGIN_PROGRAM_ONLY_CYCLE 0x18
@@ -36,6 +45,8 @@
 #define CMD_BULK_ERASE_PROGRAM 0x09
 #define CMD_LOAD_DATA_CONFIG  0x00
 #define CMD_READ_PROGRAM_MEMORY 0x04
+#define CMD_READ_DATA_MEMORY 0x05
+#define CMD_BULK_ERASE_DATA 0x0b
 
 // Timings (in microseconds)
 #define TPPDP 10 		// 5 us minimum
@@ -50,11 +61,46 @@
 #define TDPROG 10000	// 6 ms minimum
 #define TERA 10000 		// 6 ms minimum 
 
-// For debugging
-static int pc = 0;
-static int program_word =  0;
+// How long the target is first held powered down when entering programming
+// mode.  This doubles each time the target doesn't answer, up to
+// MAX_ENTRY_ATTEMPTS times.
+#define DISCHARGE_TIME 10000
+#define MAX_ENTRY_ATTEMPTS 6
 
-static int config_word = 0;
+// Most ports a run programs at once
+#define MAX_PORTS 8
+
+// The hex file, parsed once and shared by all of the targets
+struct image {
+	unsigned short instructions[MAX_PROGRAM_SIZE];
+	int count;
+	unsigned short config_codes[CONFIG_MEMORY_WORDS];
+	int config_word;
+	unsigned char eeprom[DATA_MEMORY_SIZE];
+	int eeprom_count;
+};
+
+// A target on one port.  Everything that changes while programming it is
+// kept here, so each target can be programmed on its own thread.
+struct target {
+	const char *name;		// Port name, or NULL for the default port
+	char prefix[40];		// Put before messages, to tell the targets apart
+	struct io_port *port;
+	const struct image *image;
+	int discharge_time;
+	int data_size;			// Bytes of data EEPROM on the part found
+	int result;				// 0 if it was programmed or matches, 1 if not
+
+	// For debugging
+	int pc;
+	int program_word;
+};
+
+static int discharge_time = DISCHARGE_TIME;
+static int blank_check = 0;
+static int verify_only = 0;
+static int report_all = 0;
+static int show_progress = 1;	// Bars from several targets would be mixed up
 
 // debug levels
 // 0 - no debug output
@@ -62,53 +108,95 @@ static int config_word = 0;
 // 2 - display logic level changes and delays
 static int debug_level = 0;
 
-static void Initiate84HighVoltageProgrammingMode(void);
-static void Initiate628HighVoltageProgrammingMode(void);
-static void InitiateLowVoltageProgrammingMode(void);
-static void WriteBits(int c, int count);
-static int ReadBits(int count);
-static void LoadDataForProgramMemory(int instruction);
-static void IncrementAddress(void);
-static void BeginProgramOnlyCycle(void);
-static void BulkEraseProgramMemory(void);
-static void LoadDataForConfigurationMemory(int value);
-static int LoadDataFromProgramMemory(void);
+static void Initiate84HighVoltageProgrammingMode(struct target *t);
+static void Initiate628HighVoltageProgrammingMode(struct target *t);
+static void InitiateLowVoltageProgrammingMode(struct target *t);
+static int EnterProgrammingMode(struct target *t);
+static void ResetAddress(struct target *t);
+static int ReadDeviceId(struct target *t);
+static int ProgramMemorySize(int device_id);
+static int DataMemorySize(int device_id);
+static void WriteBits(struct target *t, int c, int count);
+static int ReadBits(struct target *t, int count);
+static void LoadDataForProgramMemory(struct target *t, int instruction);
+static void IncrementAddress(struct target *t);
+static void BeginProgramOnlyCycle(struct target *t);
+static void BulkEraseProgramMemory(struct target *t);
+static void LoadDataForConfigurationMemory(struct target *t, int value);
+static int LoadDataFromProgramMemory(struct target *t);
+static void LoadDataForDataMemory(struct target *t, int value);
+static int LoadDataFromDataMemory(struct target *t);
+static void BeginDataProgramOnlyCycle(struct target *t);
+static void BulkEraseDataMemory(struct target *t);
 static void DrawProgressBar(int current, int max, const char *prefix);
-static int WriteProgram(const unsigned short *codes, int count, int erase, int verify);
-static void DetermineDeviceType(void);
-static int TestProgrammerCircuit(void);
+static int WriteProgram(struct target *t, const struct image *image, int erase, int verify);
+static int WriteDataMemory(struct target *t, const unsigned char *eeprom, int count, int address, int verify);
+static int BlankCheck(struct target *t, int count);
+static int VerifyDataMemory(struct target *t, const unsigned char *eeprom, int count, int address,
+	int report_all);
+static int VerifyProgram(struct target *t, const struct image *image, int report_all);
+static void ProgramTarget(void *arg);
+static void PowerDown(struct target *t);
+static void DetermineDeviceType(struct target *t);
+static int TestProgrammerCircuit(struct target *t);
 static int ReadHexFile(const char *filename, char *array, int *outMaxAddress);
-static void DebugReadBits(void);
+static int ReadBinaryFile(FILE *f, char *array, int *outMaxAddress);
+static void DebugReadBits(struct target *t);
 
 int main(int argc, const char *argv[])
 {
-	unsigned char data[MAX_PROGRAM_SIZE * 2 + 16];
+	unsigned char data[HEX_BUFFER_SIZE];
 	int maxAddress;
-	unsigned short instructions[MAX_PROGRAM_SIZE];
+	static struct image image;
+	struct target targets[MAX_PORTS];
+	void *args[MAX_PORTS];
+	int target_count = 0;
+	int failures = 0;
 	int i;
+	const char *filename = NULL;
+
+	memset(targets, 0, sizeof(targets));
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-b") == 0)
+			blank_check = 1;
+		else if (strcmp(argv[i], "-v") == 0)
+			verify_only = 1;
+		else if (strcmp(argv[i], "-a") == 0)
+			report_all = 1;
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			discharge_time = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc && target_count < MAX_PORTS)
+			targets[target_count++].name = argv[++i];
+		else if (filename == NULL)
+			filename = argv[i];
+		else
+			break;
+	}
 
-	if (argc != 2) {
-		printf("enter a filename\n");
+	if (filename == NULL || i < argc || discharge_time <= 0) {
+		printf("usage: programmer [-b] [-d <discharge us>] [-p <port>]... <file.hex|file.bin>\n");
+		printf("       programmer -v [-a] [-d <discharge us>] [-p <port>]... <file.hex|file.bin>\n");
 		return 1;
 	}
 
+	if (target_count == 0)
+		target_count = 1;	// The default port
+
 	if (InitIo(debug_level == 2) < 0) {
 		printf("error opening parallel port\n");
 		return 1;
 	}
 
 	if (debug_level > 0)
-		printf("Loading %s\n", argv[1]);
+		printf("Loading %s\n", filename);
 
 	memset(data, 0xff, sizeof(data));
-	if (ReadHexFile(argv[1], data, &maxAddress) < 0)
+	if (ReadHexFile(filename, data, &maxAddress) < 0)
 		return 1;
 
 	if (debug_level > 0)
 		printf("%d instructions\n", maxAddress / 2);
 
-	InitiateLowVoltageProgrammingMode();
-
 	// The address corresponds to the byte offset in the file, not the actual
 	// program address (because the PC address 14 bit data words).  Divide
 	// the address encoded in this file by two to get the actual PC.
@@ -119,83 +207,265 @@ int main(int argc, const char *argv[])
 	// file
 	// 
 	// Padding get performed by LoadDataForProgramMemory
-	for (i = 0; i < maxAddress / 2; i++)
-		instructions[i] = (data[i * 2 + 1] << 8) | data[i * 2];
+	image.count = maxAddress / 2;
+	for (i = 0; i < image.count; i++)
+		image.instructions[i] = (data[i * 2 + 1] << 8) | data[i * 2];
 
-	config_word = (data[0x400f] << 8) | data[0x400e];
+	image.config_word = (data[0x400f] << 8) | data[0x400e];
 	
 	if (debug_level > 0)
-		printf("config_word = %04x\n", config_word);
+		printf("config_word = %04x\n", image.config_word);
+
+	for (i = 0; i < CONFIG_MEMORY_WORDS; i++) {
+		image.config_codes[i] = (data[CONFIG_MEMORY_OFFSET + i * 2 + 1] << 8)
+			| data[CONFIG_MEMORY_OFFSET + i * 2];
+	}
+
+	// Each EEPROM byte is stored in the low byte of a word in the file.
+	// Trailing erased bytes are dropped.
+	for (i = 0; i < DATA_MEMORY_SIZE; i++) {
+		image.eeprom[i] = data[DATA_MEMORY_OFFSET + i * 2];
+		if (image.eeprom[i] != 0xff)
+			image.eeprom_count = i + 1;
+	}
+
+	if (!verify_only) {
+		printf("program is %d instructions\n", image.count);	
+		if (image.eeprom_count > 0)
+			printf("%d bytes of EEPROM data\n", image.eeprom_count);
+	}
+
+	show_progress = target_count == 1;
+	for (i = 0; i < target_count; i++) {
+		targets[i].port = OpenPort(targets[i].name);
+		if (targets[i].port == NULL) {
+			printf("error opening parallel port %s\n",
+				targets[i].name != NULL ? targets[i].name : "");
+			return 1;
+		}
+
+		if (target_count > 1)
+			snprintf(targets[i].prefix, sizeof(targets[i].prefix), "%s: ", targets[i].name);
+
+		targets[i].image = &image;
+		targets[i].discharge_time = discharge_time;
+		args[i] = &targets[i];
+	}
 
-	printf("program is %d instructions\n", maxAddress / 2);	
-	if (WriteProgram(instructions, maxAddress / 2, 1, 1) < 0)
+	// Each target is programmed on its own thread, so a run takes about as
+	// long as one target
+	if (RunConcurrently(ProgramTarget, args, target_count) < 0)
 		return 1;
 
-	/* Turn the chip off */
-	SetLvp(LOW);
-	SetClock(LOW);
-	SetData(LOW);
-	SetMclr(LOW);
-	SetVdd(LOW);
+	for (i = 0; i < target_count; i++) {
+		if (target_count > 1) {
+			printf("%s%s\n", targets[i].prefix, targets[i].result == 0 ? "OK"
+				: verify_only ? "DIFFERS" : "FAILED");
+		}
 
-	printf("\n\nChip Successfully Programmed\n");
+		failures += targets[i].result;
+		ClosePort(targets[i].port);
+	}
 
-	return 0;
+	return failures > 0 ? 1 : 0;
+}
+
+// Program or verify one target, setting its result.  Run on a thread of
+// its own.
+static void ProgramTarget(void *arg)
+{
+	struct target *t = arg;
+	int mismatches;
+	int erase = 1;
+	int first_used;
+	int device_id;
+
+	t->result = 1;
+	device_id = EnterProgrammingMode(t);
+	if (device_id < 0)
+		return;
+
+	// Data memory is addressed by the low bits of the PC, so EEPROM data
+	// past the end of a smaller part would wrap around onto its start
+	t->data_size = DataMemorySize(device_id);
+	if (t->image->eeprom_count > t->data_size) {
+		printf("%sfile has %d bytes of EEPROM data, the part only has %d\n", t->prefix,
+			t->image->eeprom_count, t->data_size);
+		PowerDown(t);
+		return;
+	}
+
+	if (blank_check) {
+		// Skip the bulk erase on parts that are already blank
+		first_used = BlankCheck(t, ProgramMemorySize(device_id));
+		if (first_used < 0) {
+			printf("\n%sdevice is blank, skipping erase\n", t->prefix);
+			erase = 0;
+		} else
+			printf("\n%sfirst used word is %04x, erasing\n", t->prefix, first_used);
+
+		// Re-entering programming mode is the only way to reset the PC
+		ResetAddress(t);
+	}
+
+	if (verify_only) {
+		mismatches = VerifyProgram(t, t->image, report_all);
+		PowerDown(t);
+		if (mismatches > 0) {
+			printf("\n\n%s%d words differ from the file\n", t->prefix, mismatches);
+			return;
+		}
+
+		printf("\n\n%sChip matches the file\n", t->prefix);
+		t->result = 0;
+		return;
+	}
+
+	if (WriteProgram(t, t->image, erase, 1) < 0)
+		return;
+
+	PowerDown(t);
+	printf("\n\n%sChip Successfully Programmed\n", t->prefix);
+	t->result = 0;
+}
+
+/* Turn the chip off */
+static void PowerDown(struct target *t)
+{
+	SetLines(t->port, LINE_LVP | LINE_CLOCK | LINE_DATA | LINE_MCLR | LINE_VDD, 0);
 }
 
-static void Initiate84HighVoltageProgrammingMode(void)
+static void Initiate84HighVoltageProgrammingMode(struct target *t)
 {
-	SetClock(LOW);
-	SetData(LOW);
-	SetMclr(LOW);
-	SetVdd(LOW);
-	Delay(1000000);
-	SetVdd(HIGH);
+	SetLines(t->port, LINE_CLOCK | LINE_DATA | LINE_MCLR | LINE_VDD, 0);
+	Delay(t->discharge_time);
+	SetVdd(t->port, HIGH);
 	Delay(TPPDP);
-	SetMclr(HIGH);
+	SetMclr(t->port, HIGH);
 	Delay(THLD0);
 }
 
-static void Initiate628HighVoltageProgrammingMode(void)
+static void Initiate628HighVoltageProgrammingMode(struct target *t)
 {
-	SetClock(LOW);
-	SetData(LOW);
-	SetMclr(LOW);
-	SetVdd(LOW);
-	Delay(1000000);
-	SetMclr(HIGH);
+	SetLines(t->port, LINE_CLOCK | LINE_DATA | LINE_MCLR | LINE_VDD, 0);
+	Delay(t->discharge_time);
+	SetMclr(t->port, HIGH);
 	Delay(TPPDP);
-	SetVdd(HIGH);
+	SetVdd(t->port, HIGH);
 	Delay(THLD0);
 }
 
-static void InitiateLowVoltageProgrammingMode(void)
+static void InitiateLowVoltageProgrammingMode(struct target *t)
 {
-	SetClock(LOW);
-	SetData(LOW);
-	SetMclr(LOW);
-	SetVdd(LOW);
-	Delay(100000);
-	SetVdd(HIGH);
+	SetLines(t->port, LINE_CLOCK | LINE_DATA | LINE_MCLR | LINE_VDD, 0);
+	Delay(t->discharge_time);
+	SetVdd(t->port, HIGH);
 	Delay(THLD0);
-	SetLvp(HIGH);
+	SetLvp(t->port, HIGH);
 	Delay(1);
-	SetMclr(HIGH);	// MCLR
+	SetMclr(t->port, HIGH);	// MCLR
 	Delay(TPPDP);
 }
 
+// Power the target down only as long as it takes to reset, rather than a
+// fixed time, by checking that it answers with a device ID after entering
+// programming mode.  Each time it doesn't, the discharge time is doubled.
+// The time taken is reported, so DISCHARGE_TIME can be tuned for a fixture
+// with -d.  On success, returns the device ID and leaves the address at 0.
+static int EnterProgrammingMode(struct target *t)
+{
+	long start = GetMicroseconds();
+	int attempt;
+	int device_id;
+
+	for (attempt = 0; attempt < MAX_ENTRY_ATTEMPTS; attempt++) {
+		InitiateLowVoltageProgrammingMode(t);
+		device_id = ReadDeviceId(t);
+
+		// A target that isn't listening leaves the data line floating high,
+		// or it may be held low.
+		if (device_id != 0x3fff && device_id != 0) {
+			printf("%sentered programming mode in %ld us (%d retries, discharge %d us), device ID %04x\n",
+				t->prefix, GetMicroseconds() - start, attempt, t->discharge_time, device_id);
+			ResetAddress(t);
+			return device_id;
+		}
+
+		t->discharge_time *= 2;
+	}
+
+	printf("%starget did not enter programming mode after %d attempts\n", t->prefix,
+		MAX_ENTRY_ATTEMPTS);
+	return -1;
+}
+
+// Leave and re-enter programming mode without powering the target down.
+// This resets the address to 0.
+static void ResetAddress(struct target *t)
+{
+	SetMclr(t->port, LOW);
+	Delay(THLD0);
+	SetMclr(t->port, HIGH);
+	Delay(TPPDP);
+}
+
+// Read the device ID word at 0x2006.  This leaves the address there.
+static int ReadDeviceId(struct target *t)
+{
+	int i;
+
+	LoadDataForConfigurationMemory(t, 0x7fff);
+	for (i = 0; i < 6; i++)
+		IncrementAddress(t);
+
+	return LoadDataFromProgramMemory(t);
+}
+
+// Words of program memory on the part with this device ID.  Checking past
+// the end of a smaller part would find words that aren't erased.
+static int ProgramMemorySize(int device_id)
+{
+	switch (device_id >> 5) {
+		case 0x2b:	// PIC16F84A
+		case 0x82:	// PIC16F627A
+			return 0x400;
+
+		case 0x83:	// PIC16F628A
+			return 0x800;
+
+		default:
+			return PROGRAM_MEMORY_SIZE;
+	}
+}
+
+// Bytes of data EEPROM on the part with this device ID
+static int DataMemorySize(int device_id)
+{
+	switch (device_id >> 5) {
+		case 0x2b:	// PIC16F84A
+			return 64;
+
+		case 0x82:	// PIC16F627A
+		case 0x83:	// PIC16F628A
+			return 128;
+
+		default:
+			return DATA_MEMORY_SIZE;
+	}
+}
+
 // Bit bang data to the microcontroller
 // "The programming module operates on simple command sequences entered in serial fashion with the
 // data being latched on the falling edge of the clock pulse. The sequences are entered serially, via the clock
 // and data lines, which are Schmitt Trigger inputs in this mode. The general form for all command sequences
 // consists of a 6-bit command and conditionally a 16-bit data word. Both command and data word are clocked
 // LSb first."
-static void WriteBits(int c, int count)
+static void WriteBits(struct target *t, int c, int count)
 {
 	int bit;
 
 	if (debug_level > 1) {
-		printf("WriteBits(%d) ", count);
+		printf("WriteBits(t, %d) ", count);
 
 		for (bit = 0; bit < count; bit++) {
 			printf("%c", (c & (1 << bit)) != 0 ? '1' : '0');
@@ -207,10 +477,11 @@ static void WriteBits(int c, int count)
 	}
 
 	for (bit = 0; bit < count; bit++) {
-		SetClock(HIGH);
-		SetData((c & (1 << bit)) != 0 ? HIGH : LOW);
+		// The target latches data on the falling edge
+		SetLines(t->port, LINE_CLOCK | LINE_DATA,
+			LINE_CLOCK | ((c & (1 << bit)) != 0 ? LINE_DATA : 0));
 		Delay(TSET1);
-		SetClock(LOW);
+		SetClock(t->port, LOW);
 		Delay(THLD1);
 	}
 }
@@ -218,47 +489,47 @@ static void WriteBits(int c, int count)
 // Read some number of bits serially from program data (RB7)
 // return 1 if the line is high (+5v)
 // return 0 if the line is low (0v)
-static int ReadBits(int count)
+static int ReadBits(struct target *t, int count)
 {
 	int bit;
 	int word = 0;
 
-	SetData(HIGH);
+	SetData(t->port, HIGH);
 	for (bit = 0; bit < count; bit++) {
-		SetClock(HIGH);
+		SetClock(t->port, HIGH);
 		Delay(TDLY3);
-		word = word | (ReadData() << bit);
-		SetClock(LOW);
+		word = word | (ReadData(t->port) << bit);
+		SetClock(t->port, LOW);
 		Delay(THLD1);
 	}
 
 	return word;
 }
 
-static void DebugReadBits(void)
+static void DebugReadBits(struct target *t)
 {
 	int bit;
 	int current_state = -1;
 	int next_state = -1;
 	int spin;
 
-	WriteBits(CMD_READ_PROGRAM_MEMORY, 6);
-	SetData(HIGH);
+	WriteBits(t, CMD_READ_PROGRAM_MEMORY, 6);
+	SetData(t->port, HIGH);
 
 	for (bit = 0; bit < 16; bit++) {
-		SetClock(HIGH);
+		SetClock(t->port, HIGH);
 		
 		for (spin = 0; spin < 10000; spin++) {
-			next_state = ReadData();
+			next_state = ReadData(t->port);
 			if (next_state != current_state) {
 				printf("%d ", next_state);
 				current_state = next_state;
 			}
 		}
 
-		SetClock(LOW);
+		SetClock(t->port, LOW);
 		for (spin = 0; spin < 10000; spin++) {
-			next_state = ReadData();
+			next_state = ReadData(t->port);
 			if (next_state != current_state) {
 				printf("%d ", next_state);
 				current_state = next_state;
@@ -270,28 +541,28 @@ static void DebugReadBits(void)
 // Load data for program memory 
 // Receives a 14 bit word and readies it to be programmed at the PC location.
 // 0, data(14), 0
-static void LoadDataForProgramMemory(int instruction)
+static void LoadDataForProgramMemory(struct target *t, int instruction)
 {
 	if (debug_level > 0) {
-		printf("LoadDataForProgramMemory(%04x)\n", instruction);
-		program_word = instruction;
+		printf("LoadDataForProgramMemory(t, %04x)\n", instruction);
+		t->program_word = instruction;
 	}
 
-	WriteBits(CMD_LOAD_DATA_PROGRAM, 6);
+	WriteBits(t, CMD_LOAD_DATA_PROGRAM, 6);
 	Delay(TDLY2);
-	WriteBits((instruction & 0x3fff) << 1, 16);
+	WriteBits(t, (instruction & 0x3fff) << 1, 16);
 }
 
 // Increment Address
 // The PC is incremented when this command is received
-static void IncrementAddress(void)
+static void IncrementAddress(struct target *t)
 {
 	if (debug_level > 0) {
 		printf("IncrementAddress\n");
-		pc++;
+		t->pc++;
 	}
 
-	WriteBits(CMD_INCREMENT_ADDR, 6);
+	WriteBits(t, CMD_INCREMENT_ADDR, 6);
 	Delay(TDLY2);
 }
 
@@ -299,24 +570,24 @@ static void IncrementAddress(void)
 // Programs the previously loaded word into the appropriate memory
 // (User program, Data, or Configuration Memory).  A load command
 // must be given before every program command.
-static void BeginProgramOnlyCycle(void)
+static void BeginProgramOnlyCycle(struct target *t)
 {
 	if (debug_level > 0) {
 		printf("BeginProgramOnlyCycle\n");
-		printf("%04x <= %04x\n", pc, program_word);
+		printf("%04x <= %04x\n", t->pc, t->program_word);
 	}
 	
-	WriteBits(CMD_BEGIN_PROGRAM_ONLY_CYCLE, 6);
+	WriteBits(t, CMD_BEGIN_PROGRAM_ONLY_CYCLE, 6);
 	Delay(TPROG);
 }
 
 // Bulk erase program memory
-static void BulkEraseProgramMemory(void)
+static void BulkEraseProgramMemory(struct target *t)
 {
 	if (debug_level > 0) 
 		printf("BulkEraseProgramMemory\n");
 
-	WriteBits(CMD_BULK_ERASE_PROGRAM, 6);
+	WriteBits(t, CMD_BULK_ERASE_PROGRAM, 6);
 	Delay(TERA);
 }
 
@@ -325,36 +596,90 @@ static void BulkEraseProgramMemory(void)
 // and loads the data for the first ID location.  Once it is set to the configuration
 // region, only exiting and re-entering Program/Verify mode will reset PC 
 // to the user memory space.
-static void LoadDataForConfigurationMemory(int value)
+static void LoadDataForConfigurationMemory(struct target *t, int value)
 {
 	if (debug_level > 0) {
-		printf("LoadDataForConfigurationMemory(%04x)\n", value);
-		program_word =  value;
-		pc  = 0x2000;
+		printf("LoadDataForConfigurationMemory(t, %04x)\n", value);
+		t->program_word =  value;
+		t->pc  = 0x2000;
 	}
 	
-	WriteBits(CMD_LOAD_DATA_CONFIG, 6);
+	WriteBits(t, CMD_LOAD_DATA_CONFIG, 6);
 	Delay(TDLY2);
-	WriteBits((value & 0x3fff) << 1, 16);
+	WriteBits(t, (value & 0x3fff) << 1, 16);
 }
 
-static int LoadDataFromProgramMemory(void)
+static int LoadDataFromProgramMemory(struct target *t)
 {
 	int word;
 
 	if (debug_level > 0)
-		printf("LoadDataFromProgramMemory()\n");
+		printf("LoadDataFromProgramMemory(t)\n");
 
-	WriteBits(CMD_READ_PROGRAM_MEMORY, 6);
+	WriteBits(t, CMD_READ_PROGRAM_MEMORY, 6);
 	Delay(TDLY2);
-	word = ReadBits(16);
+	word = ReadBits(t, 16);
 
 	return (word >> 1) & 0x3fff;
 }
 
+// Load data for data memory
+// Receives a byte and readies it to be programmed into the data EEPROM byte
+// selected by the low bits of the PC.
+// 0, data(8), 0(7)
+static void LoadDataForDataMemory(struct target *t, int value)
+{
+	if (debug_level > 0) {
+		printf("LoadDataForDataMemory(t, %02x)\n", value);
+		t->program_word = value;
+	}
+
+	WriteBits(t, CMD_LOAD_DATA_DATA, 6);
+	Delay(TDLY2);
+	WriteBits(t, (value & 0xff) << 1, 16);
+}
+
+static int LoadDataFromDataMemory(struct target *t)
+{
+	int word;
+
+	if (debug_level > 0)
+		printf("LoadDataFromDataMemory(t)\n");
+
+	WriteBits(t, CMD_READ_DATA_MEMORY, 6);
+	Delay(TDLY2);
+	word = ReadBits(t, 16);
+
+	return (word >> 1) & 0xff;
+}
+
+// Begin programming only cycle, data memory
+// The same command as for program memory, but an EEPROM write takes
+// longer to finish.
+static void BeginDataProgramOnlyCycle(struct target *t)
+{
+	if (debug_level > 0) {
+		printf("BeginDataProgramOnlyCycle\n");
+		printf("EEPROM %02x <= %02x\n", t->pc & (t->data_size - 1), t->program_word);
+	}
+
+	WriteBits(t, CMD_BEGIN_PROGRAM_ONLY_CYCLE, 6);
+	Delay(TDPROG);
+}
+
+// Bulk erase data memory
+static void BulkEraseDataMemory(struct target *t)
+{
+	if (debug_level > 0) 
+		printf("BulkEraseDataMemory\n");
+
+	WriteBits(t, CMD_BULK_ERASE_DATA, 6);
+	Delay(TERA);
+}
+
 static void DrawProgressBar(int current, int max, const char *prefix)
 {
-	if (debug_level == 0) {
+	if (debug_level == 0 && show_progress) {
 		int i;
 		int dotCount;
 
@@ -377,74 +702,224 @@ static void DrawProgressBar(int current, int max, const char *prefix)
 // Each program word is stored in the hex file as 2 bytes, LSB justified
 // little endian.
 // Returns -1 if there is an error, 0 otherwise
-static int WriteProgram(const unsigned short *codes, int count, int erase, int verify)
+static int WriteProgram(struct target *t, const struct image *image, int erase, int verify)
 {
+	const unsigned short *codes = image->instructions;
+	int count = image->count;
 	int i;
 	int readback;
 
 	if (erase) {
-		LoadDataForProgramMemory(0x3fff);	/* data to store in memory locations */
-		BulkEraseProgramMemory();
+		LoadDataForProgramMemory(t, 0x3fff);	/* data to store in memory locations */
+		BulkEraseProgramMemory(t);
 	}
 
 	for (i = 0; i < count; i++) {
 		if (codes[i] != 0xffff) {
-			LoadDataForProgramMemory(codes[i]);
-			BeginProgramOnlyCycle();
+			LoadDataForProgramMemory(t, codes[i]);
+			BeginProgramOnlyCycle(t);
 			if (verify) {
-				readback = LoadDataFromProgramMemory();
+				readback = LoadDataFromProgramMemory(t);
 				if (readback < 0)
 					return -1;	/* an error occured during readback */
 				
 				if (readback != codes[i]) {
-					fprintf(stderr, "\n\nVerify failed PC %04x wrote %04x read %04x\n",
-						i, codes[i], readback);
+					fprintf(stderr, "\n\n%sVerify failed PC %04x wrote %04x read %04x\n",
+						t->prefix, i, codes[i], readback);
 					return -1;
 				}
 			}
 		}
 		
-		IncrementAddress();
+		IncrementAddress(t);
 		DrawProgressBar(i, count - 1, "Programming");
 	}
 
-	if (erase) {
-		/* Rewrite the configuration word */
-	 	LoadDataForConfigurationMemory(0);	/* now we're at 0x2000 */
+	// The data EEPROM has to be written before the PC moves to configuration
+	// memory, since only leaving programming mode brings it back.
+	if (image->eeprom_count > 0
+		&& WriteDataMemory(t, image->eeprom, image->eeprom_count, count, verify) < 0)
+		return -1;
+
+	/* Rewrite the configuration word */
+ 	LoadDataForConfigurationMemory(t, 0);	/* now we're at 0x2000 */
+
+	/* Skip ahead to 2007h */
+	for (i = 0; i < 7; i++)
+		IncrementAddress(t);
+
+	// Note: it seems like this should be LoadDataForConfigurationMemory,
+	// However, that does not work.  The datasheet is a little vague about
+	// this.
+	LoadDataForProgramMemory(t, image->config_word);
+	BeginProgramOnlyCycle(t);
+
+	readback = LoadDataFromProgramMemory(t);
+	if (readback != image->config_word) {
+		printf("%sfailed to write config word %04x != %04x\n", t->prefix,
+			image->config_word, readback);
+	}
+
+	return 0;
+ }
+
+// Erase the data EEPROM and write count bytes to it.  Data memory is
+// addressed by the low bits of the PC, which is at address, so it is
+// incremented up to each byte.  Erased (0xff) bytes are skipped.
+// Returns -1 if there is an error, 0 otherwise
+static int WriteDataMemory(struct target *t, const unsigned char *eeprom, int count, int address, int verify)
+{
+	int i;
+	int readback;
 
-		/* Skip ahead to 2007h */
-		for (i = 0; i < 7; i++)
-			IncrementAddress();
+	LoadDataForDataMemory(t, 0xff);
+	BulkEraseDataMemory(t);
 
-		// Note: it seems like this should be LoadDataForConfigurationMemory,
-		// However, that does not work.  The datasheet is a little vague about
-		// this.
-		LoadDataForProgramMemory(config_word);
-		BeginProgramOnlyCycle();
+	for (i = 0; i < count; i++) {
+		if (eeprom[i] != 0xff) {
+			while ((address & (t->data_size - 1)) != i) {
+				IncrementAddress(t);
+				address++;
+			}
 
-		readback = LoadDataFromProgramMemory();
-		if (readback != config_word)
-			printf("failed to write config word %04x != %04x\n", config_word, readback);
+			LoadDataForDataMemory(t, eeprom[i]);
+			BeginDataProgramOnlyCycle(t);
+			if (verify) {
+				readback = LoadDataFromDataMemory(t);
+				if (readback != eeprom[i]) {
+					fprintf(stderr, "\n\n%sVerify failed EEPROM %02x wrote %02x read %02x\n",
+						t->prefix, i, eeprom[i], readback);
+					return -1;
+				}
+			}
+		}
+
+		DrawProgressBar(i + 1, count, "EEPROM     ");
 	}
 
 	return 0;
- }
+}
+
+// Check that count words of program memory, starting at the current address,
+// are erased.  The PC is left past the last word checked.
+// Returns the address of the first word that isn't erased, or -1 if they all are
+static int BlankCheck(struct target *t, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (LoadDataFromProgramMemory(t) != 0x3fff)
+			return i;
+
+		IncrementAddress(t);
+		DrawProgressBar(i, count - 1, "Blank check");
+	}
+
+	return -1;
+}
+
+// Compare count bytes of data EEPROM with the file, moving the PC, which is at
+// address, up to each byte that isn't erased (0xff) in the file.
+// Returns the number of bytes that differ
+static int VerifyDataMemory(struct target *t, const unsigned char *eeprom, int count, int address,
+	int report_all)
+{
+	int mismatches = 0;
+	int readback;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (eeprom[i] != 0xff) {
+			while ((address & (t->data_size - 1)) != i) {
+				IncrementAddress(t);
+				address++;
+			}
+
+			readback = LoadDataFromDataMemory(t);
+			if (readback != eeprom[i]) {
+				fprintf(stderr, "\n\n%sVerify failed EEPROM %02x expected %02x read %02x\n",
+					t->prefix, i, eeprom[i], readback);
+				if (++mismatches == 1 && !report_all)
+					return mismatches;
+			}
+		}
+
+		DrawProgressBar(i + 1, count, "EEPROM     ");
+	}
 
-static void DetermineDeviceType(void)
+	return mismatches;
+}
+
+// Compare program memory from the current address, then the data EEPROM, ID
+// locations, device ID and configuration word, with the file without writing
+// anything.
+// Words the file doesn't set (0xffff) are skipped.  Stops at the first word
+// that differs, unless report_all is set.
+// Returns the number of words that differ
+static int VerifyProgram(struct target *t, const struct image *image, int report_all)
+{
+	const unsigned short *codes = image->instructions;
+	const unsigned short *config_codes = image->config_codes;
+	int count = image->count;
+	int mismatches = 0;
+	int readback;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (codes[i] != 0xffff) {
+			readback = LoadDataFromProgramMemory(t);
+			if (readback != codes[i]) {
+				fprintf(stderr, "\n\n%sVerify failed PC %04x expected %04x read %04x\n",
+					t->prefix, i, codes[i], readback);
+				if (++mismatches == 1 && !report_all)
+					return mismatches;
+			}
+		}
+
+		IncrementAddress(t);
+		DrawProgressBar(i, count - 1, "Verifying");
+	}
+
+	if (image->eeprom_count > 0) {
+		mismatches += VerifyDataMemory(t, image->eeprom, image->eeprom_count, count,
+			report_all);
+		if (mismatches > 0 && !report_all)
+			return mismatches;
+	}
+
+	LoadDataForConfigurationMemory(t, 0x7fff);	/* now we're at 0x2000 */
+	for (i = 0; i < CONFIG_MEMORY_WORDS; i++) {
+		if (config_codes[i] != 0xffff) {
+			readback = LoadDataFromProgramMemory(t);
+			if (readback != config_codes[i]) {
+				fprintf(stderr, "\n\n%sVerify failed PC %04x expected %04x read %04x\n",
+					t->prefix, 0x2000 + i, config_codes[i], readback);
+				if (++mismatches == 1 && !report_all)
+					return mismatches;
+			}
+		}
+
+		IncrementAddress(t);
+	}
+
+	return mismatches;
+}
+
+static void DetermineDeviceType(struct target *t)
 {
 	int address;
 	int device_id;
 
-	LoadDataForConfigurationMemory(0x7fff);
+	LoadDataForConfigurationMemory(t, 0x7fff);
 
 	/* Increment to 2006h */
 	for (address = 0; address < 7; address++) {
 		printf("%04x => %04x\n", address + 0x2000,
-			LoadDataFromProgramMemory());
-		IncrementAddress();
+			LoadDataFromProgramMemory(t));
+		IncrementAddress(t);
 	}
 
-	device_id = LoadDataFromProgramMemory();
+	device_id = LoadDataFromProgramMemory(t);
 	if (device_id < 0) {
 		printf("Cannot read device ID word\n");
 		return;
@@ -472,14 +947,14 @@ static void DetermineDeviceType(void)
 	}
 }
 
-static int TestProgrammerCircuit(void)
+static int TestProgrammerCircuit(struct target *t)
 {
-	SetData(LOW);
-	if (ReadData() != LOW)
+	SetData(t->port, LOW);
+	if (ReadData(t->port) != LOW)
 		return 0;
 
-	SetData(HIGH);
-	if (ReadData() != HIGH)
+	SetData(t->port, HIGH);
+	if (ReadData(t->port) != HIGH)
 		return 0;
 
 	return 1;
@@ -496,6 +971,10 @@ static int TestProgrammerCircuit(void)
 // d is the data for the line
 // e is the checksum, the 2's complement sum of of the other bytes in the line 
 //
+// A file that doesn't start with a record header (a colon and eight hex
+// digits) is read as a raw binary instead.  Checking the digits keeps a
+// binary whose first byte happens to be 0x3a from being taken for hex.
+//
 static int ReadHexFile(const char *filename, char *array, int *outMaxAddress)
 {
 	FILE *f;
@@ -510,13 +989,23 @@ static int ReadHexFile(const char *filename, char *array, int *outMaxAddress)
 	int line;
 	int result = 0;
 	
-	f = fopen(filename, "r");
+	f = fopen(filename, "rb");
 	if (f == NULL) {
 		perror("error opening file");
-		return;
+		return -1;
 	}
 
 	*outMaxAddress = 0;
+
+	i = fread(data, 1, 9, f);
+	data[9] = '\0';
+	if (i < 9 || data[0] != ':' || strspn(data + 1, "0123456789abcdefABCDEF") < 8) {
+		result = ReadBinaryFile(f, array, outMaxAddress);
+		fclose(f);
+		return result;
+	}
+
+	rewind(f);
 	
 	for (line = 1; ; line++) {
 		if (fscanf(f, ":%02x%04x%02x", &dataLength, &address, &recordType) < 0) {
@@ -537,7 +1026,8 @@ static int ReadHexFile(const char *filename, char *array, int *outMaxAddress)
 				goto done;
 			}
 
-			array[address + i] = (char) datum;
+			if (address + i < HEX_BUFFER_SIZE)
+				array[address + i] = (char) datum;
 			computedChecksum += datum;
 		}
 			
@@ -568,3 +1058,34 @@ done:
 	return result;
 }
 
+//
+// A raw binary has the same layout as the addresses in a hex file: each
+// program word is two bytes, little endian, starting at address zero.  It is
+// read straight into the array.  Erased words (0xffff) past the end of the
+// program, which fill the gap before the configuration word, don't count as
+// instructions.
+//
+static int ReadBinaryFile(FILE *f, char *array, int *outMaxAddress)
+{
+	unsigned char *bytes = (unsigned char*) array;
+	int length;
+	int i;
+
+	rewind(f);
+	length = fread(array, 1, HEX_BUFFER_SIZE, f);
+	if (ferror(f)) {
+		perror("error reading file");
+		return -1;
+	}
+
+	for (i = 0; i + 1 < length && i < 0x4000; i += 2) {
+		if (bytes[i] != 0xff || bytes[i + 1] != 0xff)
+			*outMaxAddress = i + 2;
+	}
+
+	if (debug_level > 0)
+		printf("read %d bytes\n", length);
+
+	return 0;
+}
+
@@ -15,54 +15,117 @@
 // 
 
 #include <stdio.h>
+#include <string.h>
 #include "io.h"
 
+#define BENCHMARK_EDGES 100000
+
+static void ReportRate(const char *what, long start)
+{
+	long elapsed = GetMicroseconds() - start;
+
+	printf("%s: %d in %ld us, %.0f per second\n", what, BENCHMARK_EDGES,
+		elapsed, elapsed > 0 ? BENCHMARK_EDGES * 1000000.0 / elapsed : 0.0);
+}
+
+// How fast the backend can move the lines, for comparing one with another.
+// The target stays powered down.
+static void Benchmark(struct io_port *port)
+{
+	long start;
+	int i;
+
+	SetMclr(port, LOW);
+	SetVdd(port, LOW);
+
+	start = GetMicroseconds();
+	for (i = 0; i < BENCHMARK_EDGES; i++)
+		SetClock(port, (i & 1) ? LOW : HIGH);
+
+	ReportRate("clock edges", start);
+
+	start = GetMicroseconds();
+	for (i = 0; i < BENCHMARK_EDGES; i++)
+		SetLines(port, LINE_CLOCK | LINE_DATA, (i & 1) ? 0 : LINE_CLOCK | LINE_DATA);
+
+	ReportRate("clock and data edges", start);
+
+	start = GetMicroseconds();
+	for (i = 0; i < BENCHMARK_EDGES; i++)
+		ReadData(port);
+
+	ReportRate("data reads", start);
+
+	SetLines(port, LINE_CLOCK | LINE_DATA, 0);
+}
+
 int main(int argc, const char *argv[])
 {
-	if (InitIo(1) < 0)
+	struct io_port *port;
+	int benchmark = 0;
+
+	// -b measures the edge rate instead of stepping through the lines
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		benchmark = 1;
+		argc--;
+		argv++;
+	}
+
+	if (InitIo(!benchmark) < 0)
 		return -1;
 
-	SetMclr(LOW);
-	SetVdd(LOW);
-	SetClock(LOW);
-	SetData(LOW);
-	SetLvp(LOW);
+	// Optionally the port to test, otherwise the default one
+	port = OpenPort(argc > 1 ? argv[1] : NULL);
+	if (port == NULL)
+		return -1;
+
+	if (benchmark) {
+		Benchmark(port);
+		ClosePort(port);
+		return 0;
+	}
+
+	SetMclr(port, LOW);
+	SetVdd(port, LOW);
+	SetClock(port, LOW);
+	SetData(port, LOW);
+	SetLvp(port, LOW);
 
 	printf("all lines low\n");
 	getc(stdin);
 
-	SetVdd(HIGH);
+	SetVdd(port, HIGH);
 	printf("VDD high\n");
 	getc(stdin);
 
-	SetLvp(HIGH);
+	SetLvp(port, HIGH);
 	printf("LVP high VDD high\n");
 	getc(stdin);
 	
-	SetMclr(HIGH);
+	SetMclr(port, HIGH);
 	printf("MCLR high\n");
 	getc(stdin);
 
-	SetClock(HIGH);
+	SetClock(port, HIGH);
 	printf("VPP high VDD high CLOCK high\n");
 	getc(stdin);
 
-	SetData(HIGH);
+	SetData(port, HIGH);
 	printf("VPP high VDD high CLOCK high DATA high\n");
 	getc(stdin);
 
-	SetClock(LOW);
+	SetClock(port, LOW);
 	printf("VPP high VDD high CLOCK low DATA high\n");
 	getc(stdin);
 
-	SetData(HIGH);
+	SetData(port, HIGH);
 	printf("set data high\n");
 	getc(stdin);
-	printf("data = %s\n", ReadData() ? "HIGH" : "LOW");
+	printf("data = %s\n", ReadData(port) ? "HIGH" : "LOW");
 
 	printf("set data low\n");	
 	getc(stdin);
-	printf("data = %s\n", ReadData() ? "HIGH" : "LOW");
+	printf("data = %s\n", ReadData(port) ? "HIGH" : "LOW");
 
 	return 0;
 }
@@ -0,0 +1,179 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "image.h"
+#include "protocol.h"
+#include "batch.h"
+
+#define MAX_LINE_LENGTH 512
+#define MAX_PATCHES 32
+
+struct patch
+{
+	int address;			// Word address
+	int original_word;		// Template contents, to revert to
+};
+
+static long now_ms()
+{
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+static void set_word(struct image *image, int address, int value)
+{
+	image->data[address * 2] = value & 0xff;
+	image->data[address * 2 + 1] = (value >> 8) & 0xff;
+}
+
+static void revert_patches(struct image *image, const struct patch *patches, int count)
+{
+	// Backwards, in case a line patched the same word twice
+	while (count-- > 0)
+		set_word(image, patches[count].address, patches[count].original_word);
+}
+
+///
+/// Apply the patches in a line (after the serial number) to the image.  Only
+/// the patched words change, so nothing needs to be parsed or copied again.
+/// @returns
+///   - The number of patches applied
+///   - -1 if the line is malformed, in which case the image is unchanged
+///
+static int apply_patches(struct image *image, char *list, struct patch *patches)
+{
+	char *field;
+	char *end;
+	int address;
+	int value;
+	int count = 0;
+
+	for (field = strtok(list, ","); field != NULL; field = strtok(NULL, ","))
+	{
+		address = strtol(field, &end, 16);
+		if (*end != '=' || end == field)
+			break;
+
+		value = strtol(end + 1, &end, 16);
+		if (*end != '\0' || value < 0 || value > 0x3fff)
+			break;
+
+		if (!(address >= 0 && address < MAX_PROGRAM_SIZE)
+			&& !(address >= ID_LOCATIONS_OFFSET / 2
+			&& address < ID_LOCATIONS_OFFSET / 2 + ID_LOCATION_COUNT))
+			break;
+
+		if (count == MAX_PATCHES)
+			break;
+
+		patches[count].address = address;
+		patches[count].original_word = image_word(image, address);
+		set_word(image, address, value);
+		count++;
+	}
+
+	if (field != NULL)
+	{
+		revert_patches(image, patches, count);
+		return -1;
+	}
+
+	return count;
+}
+
+int run_batch(struct image *image, FILE *patches, FILE *log,
+	const struct program_options *options)
+{
+	char line[MAX_LINE_LENGTH];
+	struct patch applied[MAX_PATCHES];
+	char *serial;
+	char *list;
+	int patch_count;
+	int template_count = image->instruction_count;
+	int failures = 0;
+	int i;
+	long start;
+	int result;
+
+	fprintf(log, "serial,result,ms\n");
+	fflush(log);
+
+	while (fgets(line, sizeof(line), patches) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		start = now_ms();
+		serial = line;
+		list = strchr(line, ',');
+		if (list != NULL)
+			*list++ = '\0';
+		else
+			list = line + strlen(line);
+
+		patch_count = apply_patches(image, list, applied);
+		if (patch_count < 0)
+		{
+			fprintf(log, "%s,BADPATCH,0\n", serial);
+			fflush(log);
+			failures++;
+			continue;
+		}
+
+		// A patch past the end of the template's program extends it
+		for (i = 0; i < patch_count; i++)
+		{
+			if (applied[i].address < MAX_PROGRAM_SIZE
+				&& applied[i].address >= image->instruction_count)
+				image->instruction_count = applied[i].address + 1;
+		}
+
+		result = program_image(image, options);
+
+		revert_patches(image, applied, patch_count);
+		image->instruction_count = template_count;
+
+		fprintf(log, "%s,%s,%ld\n", serial, result ? "OK" : "FAIL", now_ms() - start);
+		fflush(log);
+
+		if (!result)
+		{
+			failures++;
+
+			// Make sure the programmer is still there and listening before
+			// going on to the next unit.
+			if (!check_protocol_version())
+				break;
+		}
+	}
+
+	return failures;
+}
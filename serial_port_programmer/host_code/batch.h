@@ -0,0 +1,49 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// Production batch programming.  A template image is loaded once, and each
+// unit's patches (serial numbers, calibration constants) are applied to it in
+// place before the unit is programmed, then reverted.
+//
+
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <stdio.h>
+#include "image.h"
+#include "protocol.h"
+
+/// Program one unit for each line read from patches.  Each line is
+///
+///   <serial>,<word address>=<value>,...
+///
+/// with the address and value in hex, for example
+/// "SN0042,2000=0004,2001=0002,07f0=3412".  Program memory and the ID
+/// locations (0x2000-0x2003) can be patched.  Blank lines and lines starting
+/// with '#' are ignored.  A line is only read once the previous unit is done,
+/// so a fixture controller or barcode scanner on stdin can pace the batch.
+///
+/// For each unit, a line is written to log:
+///
+///   <serial>,OK|FAIL|BADPATCH,<milliseconds>
+///
+/// The serial port must already be open and selected.
+/// @returns the number of units that were not programmed
+int run_batch(struct image *image, FILE *patches, FILE *log,
+	const struct program_options *options);
+
+#endif
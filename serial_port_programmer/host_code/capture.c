@@ -0,0 +1,97 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "metrics.h"
+
+static FILE *capture_file = NULL;
+static unsigned long long last_record_time;
+
+int capture_open(const char *path)
+{
+	capture_file = fopen(path, "wb");
+	if (capture_file == NULL)
+	{
+		perror("error creating capture file");
+		return -1;
+	}
+
+	fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_file);
+	fputc(CAPTURE_VERSION, capture_file);
+	last_record_time = (unsigned long long) (metrics_now() * 1000000);
+	atexit(capture_close);
+
+	return 0;
+}
+
+void capture_close()
+{
+	if (capture_file == NULL)
+		return;
+
+	fclose(capture_file);
+	capture_file = NULL;
+}
+
+static void write_record(int type, int value)
+{
+	unsigned long long now = (unsigned long long) (metrics_now() * 1000000);
+	unsigned long long delta = now - last_record_time;
+
+	last_record_time = now;
+	while (delta >= 0x80)
+	{
+		fputc((delta & 0x7f) | 0x80, capture_file);
+		delta >>= 7;
+	}
+
+	fputc(delta, capture_file);
+	fputc(type, capture_file);
+	fputc(value & 0xff, capture_file);
+}
+
+void capture_write(char c, int result)
+{
+	if (capture_file != NULL)
+		write_record(result == 0 ? CAPTURE_WRITE : CAPTURE_WRITE_ERROR, c);
+}
+
+void capture_read(int result)
+{
+	if (capture_file == NULL)
+		return;
+
+	if (result >= 0)
+		write_record(CAPTURE_READ, result);
+	else if (result == -2)
+		write_record(CAPTURE_TIMEOUT, 0);
+	else
+		write_record(CAPTURE_READ_ERROR, 0);
+
+	// Keep what has been recorded if the host crashes or is killed, which is
+	// when the capture is most likely to be wanted.
+	if (result < 0)
+		fflush(capture_file);
+}
+
+void capture_select(int handle)
+{
+	if (capture_file != NULL)
+		write_record(CAPTURE_OPEN, handle);
+}
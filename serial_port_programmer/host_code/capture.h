@@ -0,0 +1,55 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+//
+// Recording of the bytes exchanged with the programmer, for replaying with
+// serial_replay.c.
+//
+// A capture file starts with the 4 byte magic "PCAP" and a version byte.
+// Each record after that is the time since the previous record in
+// microseconds, as a variable length integer (7 bits per byte, least
+// significant first, top bit set on all but the last byte), then a type
+// byte and a value byte.
+//
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#define CAPTURE_MAGIC "PCAP"
+#define CAPTURE_VERSION 1
+
+// Record types
+#define CAPTURE_WRITE 'W'			// Value is the byte written
+#define CAPTURE_WRITE_ERROR 'w'		// Value is the byte that couldn't be written
+#define CAPTURE_READ 'R'			// Value is the byte read
+#define CAPTURE_TIMEOUT 'T'			// A read timed out
+#define CAPTURE_READ_ERROR 'E'		// A read failed
+#define CAPTURE_OPEN 'O'			// A port was opened or selected; value is the handle
+
+/// Start recording to a file, replacing it if it exists
+/// @returns
+///   - 0 on success
+///   - -1 if the file could not be created
+int capture_open(const char *path);
+
+/// Flush and close the capture file
+void capture_close();
+
+// Called by the serial backends.  These do nothing if no capture is open.
+void capture_write(char c, int result);		// result as returned by write_serial
+void capture_read(int result);				// result as returned by read_serial
+void capture_select(int handle);
+
+#endif
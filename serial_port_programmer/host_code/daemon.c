@@ -0,0 +1,519 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "serial.h"
+#include "image.h"
+#include "protocol.h"
+#include "daemon.h"
+#include "metrics.h"
+#include "discover.h"
+
+#define MAX_CACHED_IMAGES 8
+#define MAX_PORT_NAME 64
+#define MAX_REQUEST_LENGTH 512
+#define HEALTH_CHECK_INTERVAL 5000	// milliseconds
+
+struct cached_image
+{
+	int valid;
+	char path[PATH_MAX];
+	time_t mtime;
+	struct image image;
+};
+
+struct programmer_port
+{
+	int in_use;
+	char name[MAX_PORT_NAME];
+	int handle;
+	struct programmer_capabilities capabilities;
+};
+
+static struct cached_image images[MAX_CACHED_IMAGES];
+static int next_image_slot = 0;
+static struct programmer_port ports[MAX_SERIAL_PORTS];
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void send_response(int client, const char *format, ...)
+{
+	char buffer[MAX_REQUEST_LENGTH];
+	va_list args;
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(buffer, sizeof(buffer) - 1, format, args);
+	va_end(args);
+
+	if (length < 0)
+		return;
+
+	if (length > (int) sizeof(buffer) - 2)
+		length = sizeof(buffer) - 2;
+
+	buffer[length++] = '\n';
+	if (write(client, buffer, length) != length)
+		printf("error sending response to client\n");
+}
+
+///
+/// Find an image in the cache, parsing it if it is not there or the file has
+/// changed since it was loaded.
+/// @returns the image, or NULL if it could not be loaded
+///
+static const struct image *get_image(const char *path)
+{
+	struct stat st;
+	struct cached_image *entry;
+	int i;
+
+	if (stat(path, &st) < 0)
+	{
+		printf("can't stat %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	for (i = 0; i < MAX_CACHED_IMAGES; i++)
+	{
+		entry = &images[i];
+		if (entry->valid && strcmp(entry->path, path) == 0)
+		{
+			if (entry->mtime == st.st_mtime)
+				return &entry->image;
+
+			break;	// Stale, reload into the same slot
+		}
+	}
+
+	if (i == MAX_CACHED_IMAGES)
+	{
+		entry = &images[next_image_slot];
+		next_image_slot = (next_image_slot + 1) % MAX_CACHED_IMAGES;
+	}
+
+	entry->valid = 0;
+	if (strlen(path) >= sizeof(entry->path))
+		return NULL;
+
+	if (load_image(path, &entry->image) < 0)
+		return NULL;
+
+	strcpy(entry->path, path);
+	entry->mtime = st.st_mtime;
+	entry->valid = 1;
+	printf("loaded %s (%d instructions)\n", path, entry->image.instruction_count);
+
+	return &entry->image;
+}
+
+static void drop_port(struct programmer_port *port)
+{
+	printf("closing %s\n", port->name);
+	close_serial(port->handle);
+	port->in_use = 0;
+}
+
+///
+/// Find an open programmer by port name (see resolve_port), opening it and
+/// checking its protocol version if necessary.  The port is selected for I/O on return.
+/// @returns the port, or NULL if it could not be opened
+///
+static struct programmer_port *get_port(const char *name)
+{
+	struct programmer_port *port;
+	const char *path;
+	int i;
+
+	for (i = 0; i < MAX_SERIAL_PORTS; i++)
+	{
+		port = &ports[i];
+		if (port->in_use && strcmp(port->name, name) == 0)
+		{
+			select_serial(port->handle);
+			set_capabilities(&port->capabilities);
+			reset_framing();	// Jobs leave the programmer in raw mode
+			metrics_select_port(name);
+			return port;
+		}
+	}
+
+	if (strlen(name) >= MAX_PORT_NAME)
+		return NULL;
+
+	for (i = 0; i < MAX_SERIAL_PORTS; i++)
+	{
+		if (!ports[i].in_use)
+			break;
+	}
+
+	if (i == MAX_SERIAL_PORTS)
+		return NULL;
+
+	path = resolve_port(name);
+	if (path == NULL)
+		return NULL;
+
+	port = &ports[i];
+	port->handle = open_serial(path);
+	if (port->handle < 0)
+		return NULL;
+
+	metrics_select_port(name);
+	if (!check_protocol_version())
+	{
+		close_serial(port->handle);
+		return NULL;
+	}
+
+	strcpy(port->name, name);
+	port->capabilities = *get_capabilities();
+	port->in_use = 1;
+	printf("opened %s\n", name);
+
+	return port;
+}
+
+///
+/// Re-run the version handshake on an open programmer.  If it doesn't answer
+/// (for example, it has been unplugged), close it so the next job that
+/// uses it will reopen it.
+/// @returns 1 if the programmer is healthy, 0 if it was dropped
+///
+static int check_port(struct programmer_port *port)
+{
+	select_serial(port->handle);
+	metrics_select_port(port->name);
+	if (check_protocol_version())
+	{
+		port->capabilities = *get_capabilities();
+		return 1;
+	}
+
+	drop_port(port);
+	return 0;
+}
+
+static void handle_program_request(int client, char *args)
+{
+	struct timespec start;
+	struct timespec phase_start;
+	struct program_options options;
+	struct programmer_port *port;
+	const struct image *image;
+	const char *port_name;
+	const char *image_path;
+	const char *option;
+	long open_time;
+	long load_time;
+	int verify_only = 0;
+	int result;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	port_name = strtok(args, " \t");
+	image_path = strtok(NULL, " \t");
+	if (port_name == NULL || image_path == NULL)
+	{
+		send_response(client, "FAIL 0 usage: PROGRAM <port> <image> [norun] [framed] [blank] [device=<name>] [gang=<lines>] [verify]");
+		return;
+	}
+
+	options.show_progress = 0;
+	options.run_after = 1;
+	options.framed = 0;
+	options.blank_check = 0;
+	options.profile = NULL;
+	options.gang_targets = 0;
+	while ((option = strtok(NULL, " \t")) != NULL)
+	{
+		if (strcmp(option, "norun") == 0)
+			options.run_after = 0;
+		else if (strcmp(option, "framed") == 0)
+			options.framed = 1;
+		else if (strcmp(option, "blank") == 0)
+			options.blank_check = 1;
+		else if (strcmp(option, "verify") == 0)
+			verify_only = 1;
+		else if (strncmp(option, "device=", 7) == 0)
+		{
+			options.profile = find_device_profile(option + 7);
+			if (options.profile == NULL)
+			{
+				send_response(client, "FAIL 0 unknown device %s", option + 7);
+				return;
+			}
+
+			// Jobs run the midrange command set on a cached midrange image
+			if (options.profile->family != FAMILY_MIDRANGE)
+			{
+				send_response(client, "FAIL 0 pic%s can only be programmed from the command line",
+					options.profile->name);
+				return;
+			}
+		}
+		else if (strncmp(option, "gang=", 5) == 0)
+		{
+			options.gang_targets = parse_gang_targets(option + 5);
+			if (options.gang_targets <= 0)
+			{
+				send_response(client, "FAIL 0 bad gang target list %s", option + 5);
+				return;
+			}
+		}
+		else
+		{
+			send_response(client, "FAIL 0 unknown option %s", option);
+			return;
+		}
+	}
+
+	// Reading back, for a verify or a blank check, only sees the first target
+	if (options.gang_targets != 0 && (verify_only || options.blank_check))
+	{
+		send_response(client, "FAIL 0 gang mode can't verify or blank check the other targets");
+		return;
+	}
+
+	phase_start = start;
+	port = get_port(port_name);
+	open_time = elapsed_ms(&phase_start);
+	if (port == NULL)
+	{
+		send_response(client, "FAIL %ld programmer on %s is not available",
+			elapsed_ms(&start), port_name);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
+	image = get_image(image_path);
+	load_time = elapsed_ms(&phase_start);
+	if (image == NULL)
+	{
+		send_response(client, "FAIL %ld can't load %s", elapsed_ms(&start), image_path);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
+	if (verify_only)
+		result = verify_image(image, &options, 0);
+	else
+		result = program_image(image, &options);
+
+	if (!result)
+	{
+		// Find out if the programmer itself has gone away, so the next
+		// job will try to reopen it.
+		if (!check_port(port))
+		{
+			send_response(client, "FAIL %ld programmer on %s was lost",
+				elapsed_ms(&start), port_name);
+		}
+		else if (options.gang_targets != 0 && !verify_only)
+		{
+			send_response(client, "FAIL %ld programming failed failed_targets=%02x",
+				elapsed_ms(&start), gang_failed_targets());
+		}
+		else
+		{
+			send_response(client, "FAIL %ld %s failed", elapsed_ms(&start),
+				verify_only ? "verify" : "programming");
+		}
+
+		return;
+	}
+
+	send_response(client, "OK %ld open=%ld load=%ld program=%ld", elapsed_ms(&start),
+		open_time, load_time, elapsed_ms(&phase_start));
+}
+
+static void handle_health_request(int client)
+{
+	int i;
+
+	for (i = 0; i < MAX_SERIAL_PORTS; i++)
+	{
+		if (ports[i].in_use)
+		{
+			char name[MAX_PORT_NAME];
+
+			strcpy(name, ports[i].name);
+			send_response(client, "PORT %s %s", name, check_port(&ports[i]) ? "OK" : "LOST");
+		}
+	}
+
+	send_response(client, "END");
+}
+
+static void handle_request(int client, char *line)
+{
+	char *command;
+	char *args;
+
+	command = line;
+	args = strpbrk(line, " \t");
+	if (args != NULL)
+		*args++ = '\0';
+	else
+		args = line + strlen(line);
+
+	if (strcmp(command, "PROGRAM") == 0)
+		handle_program_request(client, args);
+	else if (strcmp(command, "HEALTH") == 0)
+		handle_health_request(client);
+	else if (command[0] != '\0')
+		send_response(client, "FAIL 0 unknown command %s", command);
+}
+
+static void check_all_ports()
+{
+	int i;
+
+	for (i = 0; i < MAX_SERIAL_PORTS; i++)
+	{
+		if (ports[i].in_use && !check_port(&ports[i]))
+			printf("programmer on %s is not responding\n", ports[i].name);
+	}
+}
+
+int run_daemon(const char *socket_path)
+{
+	struct sockaddr_un address;
+	struct pollfd fds[1];
+	char request[MAX_REQUEST_LENGTH];
+	int requestLength = 0;
+	int listenSocket;
+	int client = -1;
+	int result;
+	int got;
+	char *newline;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (strlen(socket_path) >= sizeof(address.sun_path))
+	{
+		printf("socket path is too long\n");
+		return 1;
+	}
+
+	listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket < 0)
+	{
+		perror("socket");
+		return 1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	unlink(socket_path);
+	if (bind(listenSocket, (struct sockaddr*) &address, sizeof(address)) < 0)
+	{
+		perror("bind");
+		close(listenSocket);
+		return 1;
+	}
+
+	if (listen(listenSocket, 4) < 0)
+	{
+		perror("listen");
+		close(listenSocket);
+		return 1;
+	}
+
+	printf("listening on %s\n", socket_path);
+	fflush(stdout);
+
+	for (;;)
+	{
+		// Serve one client at a time.  Others wait in the listen backlog.
+		fds[0].fd = client < 0 ? listenSocket : client;
+		fds[0].events = POLLIN;
+		result = poll(fds, 1, HEALTH_CHECK_INTERVAL);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			break;
+		}
+
+		if (result == 0)
+		{
+			// Idle.  Make sure the programmers are still there.
+			check_all_ports();
+			fflush(stdout);
+			continue;
+		}
+
+		if (client < 0)
+		{
+			client = accept(listenSocket, NULL, NULL);
+			requestLength = 0;
+			continue;
+		}
+
+		got = read(client, request + requestLength, sizeof(request) - requestLength - 1);
+		if (got <= 0)
+		{
+			close(client);
+			client = -1;
+			continue;
+		}
+
+		requestLength += got;
+		request[requestLength] = '\0';
+		while ((newline = strchr(request, '\n')) != NULL)
+		{
+			*newline = '\0';
+			if (newline > request && newline[-1] == '\r')
+				newline[-1] = '\0';
+
+			handle_request(client, request);
+			requestLength -= newline + 1 - request;
+			memmove(request, newline + 1, requestLength + 1);
+		}
+
+		if (requestLength == sizeof(request) - 1)
+		{
+			send_response(client, "FAIL 0 request too long");
+			requestLength = 0;
+		}
+
+		fflush(stdout);
+	}
+
+	close(listenSocket);
+	return 1;
+}
@@ -0,0 +1,47 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// Programming daemon.  Keeps programmers open and handshaken, and program
+// images parsed, between jobs so a production line doesn't pay for port
+// setup, the version probe and hex parsing on every board.
+//
+
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+/// Listen for jobs on a UNIX domain socket.  Each request is a single line:
+///
+///   PROGRAM <port> <image file> [norun] [framed] [blank] [device=<name>]
+///           [gang=<lines>] [verify]
+///       Program the target attached to <port> with <image file>.  <port>
+///       may also be "sn:<USB serial number>" or "auto" (see resolve_port).
+///       Replies
+///       "OK <total ms> open=<ms> load=<ms> program=<ms>" or
+///       "FAIL <total ms> <reason>".  In gang mode, a failure includes
+///       "failed_targets=<hex mask>" (see parse_gang_targets).  With verify,
+///       the target is only compared with the image (see verify_image).
+///       device= only takes midrange parts; PIC18 parts are programmed
+///       from the command line.
+///   HEALTH
+///       Probe every open programmer.  Replies with a "PORT <port> OK|LOST"
+///       line for each, followed by "END"
+///
+/// Only returns if the socket cannot be set up.
+/// @returns 1 on error
+int run_daemon(const char *socket_path);
+
+#endif
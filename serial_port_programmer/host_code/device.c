@@ -0,0 +1,103 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <ctype.h>
+#include "device.h"
+
+// Implemented bits of CONFIG1L (0x300000) to CONFIG7H (0x30000d), from each
+// family's configuration register map.  The rest read back as 0 whatever
+// was written.  The 24K parts have one fewer protection block, and only the
+// 40/44 pin USB parts have ICPRT.
+static const unsigned char config_2455[] =
+	{ 0x3f, 0xcf, 0x3f, 0x1f, 0x00, 0x87, 0xc5, 0x00, 0x07, 0xc0, 0x07, 0xe0, 0x07, 0x40 };
+static const unsigned char config_2550[] =
+	{ 0x3f, 0xcf, 0x3f, 0x1f, 0x00, 0x87, 0xc5, 0x00, 0x0f, 0xc0, 0x0f, 0xe0, 0x0f, 0x40 };
+static const unsigned char config_4455[] =
+	{ 0x3f, 0xcf, 0x3f, 0x1f, 0x00, 0x87, 0xe5, 0x00, 0x07, 0xc0, 0x07, 0xe0, 0x07, 0x40 };
+static const unsigned char config_4550[] =
+	{ 0x3f, 0xcf, 0x3f, 0x1f, 0x00, 0x87, 0xe5, 0x00, 0x0f, 0xc0, 0x0f, 0xe0, 0x0f, 0x40 };
+static const unsigned char config_4620[] =
+	{ 0x00, 0xcf, 0x1f, 0x1f, 0x00, 0x87, 0xc5, 0x00, 0x0f, 0xc0, 0x0f, 0xe0, 0x0f, 0x40 };
+static const unsigned char config_4685[] =
+	{ 0x00, 0xcf, 0x1f, 0x1f, 0x00, 0x86, 0xf5, 0x00, 0x3f, 0xc0, 0x3f, 0xe0, 0x3f, 0x40 };
+
+// Minimum times from each part's programming specification
+static const struct device_profile profiles[] =
+{
+	{ "16f627a", 2500, 6000, FAMILY_MIDRANGE, 0x800, 0, 0, 128, NULL },		// DS41196
+	{ "16f628a", 2500, 6000, FAMILY_MIDRANGE, 0x1000, 0, 0, 128, NULL },
+	{ "16f648a", 2500, 6000, FAMILY_MIDRANGE, 0x2000, 0, 0, 256, NULL },
+	{ "18f2455", 1000, 5000, FAMILY_PIC18, 0x6000, 32, 5000, 0, config_2455 },	// DS39622
+	{ "18f2550", 1000, 5000, FAMILY_PIC18, 0x8000, 32, 5000, 0, config_2550 },
+	{ "18f4455", 1000, 5000, FAMILY_PIC18, 0x6000, 32, 5000, 0, config_4455 },
+	{ "18f4550", 1000, 5000, FAMILY_PIC18, 0x8000, 32, 5000, 0, config_4550 },
+	{ "18f2620", 1000, 5000, FAMILY_PIC18, 0x10000, 64, 5000, 0, config_4620 },
+	{ "18f4620", 1000, 5000, FAMILY_PIC18, 0x10000, 64, 5000, 0, config_4620 },
+	{ "18f2685", 1000, 5000, FAMILY_PIC18, 0x18000, 64, 5000, 0, config_4685 },
+	{ "18f4685", 1000, 5000, FAMILY_PIC18, 0x18000, 64, 5000, 0, config_4685 },
+};
+
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+static int names_match(const char *a, const char *b)
+{
+	while (*a && tolower((unsigned char) *a) == tolower((unsigned char) *b))
+	{
+		a++;
+		b++;
+	}
+
+	return *a == '\0' && *b == '\0';
+}
+
+const struct device_profile *find_device_profile(const char *name)
+{
+	unsigned int i;
+
+	// Allow the "pic" prefix
+	if (tolower((unsigned char) name[0]) == 'p' && tolower((unsigned char) name[1]) == 'i'
+		&& tolower((unsigned char) name[2]) == 'c')
+		name += 3;
+
+	for (i = 0; i < PROFILE_COUNT; i++)
+	{
+		if (names_match(profiles[i].name, name))
+			return &profiles[i];
+	}
+
+	return NULL;
+}
+
+void list_device_profiles()
+{
+	unsigned int i;
+
+	for (i = 0; i < PROFILE_COUNT; i++)
+	{
+		printf("  pic%s (Tprog %d us, Tera %d us", profiles[i].name,
+			profiles[i].program_time, profiles[i].erase_time);
+		if (profiles[i].family == FAMILY_PIC18)
+		{
+			printf(", %d KB, %d byte blocks", profiles[i].program_size / 1024,
+				profiles[i].write_block);
+		}
+		else
+			printf(", %d words", profiles[i].program_size / 2);
+
+		printf(")\n");
+	}
+}
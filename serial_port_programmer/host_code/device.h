@@ -0,0 +1,50 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// Programming parameters for the target devices the programmer supports
+//
+
+#ifndef __DEVICE_H
+#define __DEVICE_H
+
+enum device_family
+{
+	FAMILY_MIDRANGE,	// 14 bit core, programmed a word at a time
+	FAMILY_PIC18		// 16 bit core, programmed a write buffer at a time (see pic18.c)
+};
+
+struct device_profile
+{
+	const char *name;
+	int program_time;	// Tprog, in microseconds
+	int erase_time;		// Tera, in microseconds
+	enum device_family family;
+	int program_size;	// Bytes of program memory, two for each midrange word
+	int write_block;	// Bytes in the write buffer (PIC18 only)
+	int config_time;	// Wait for a configuration byte, in microseconds (PIC18 only)
+	int data_size;		// Bytes of data EEPROM (midrange only)
+	const unsigned char *config_mask;	// Implemented bits of each configuration byte (PIC18 only)
+};
+
+/// Look up a device by name (for example "16f628a"), ignoring case
+/// @returns the profile, or NULL if the device isn't known
+const struct device_profile *find_device_profile(const char *name);
+
+/// Print the names of the known devices
+void list_device_profiles();
+
+#endif
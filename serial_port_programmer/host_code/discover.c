@@ -0,0 +1,409 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "discover.h"
+#include "metrics.h"
+#include "protocol.h"
+
+#define PROBE_TIMEOUT 200	// milliseconds
+#define MAX_CANDIDATES 128
+#define CACHE_FILE_NAME ".programmer_ports"	// In the home directory
+
+static const char *candidate_patterns[] =
+{
+	"/dev/ttyUSB*", "/dev/ttyACM*", "/dev/ttyS*"
+};
+
+static struct discovered_port cache[MAX_DISCOVERED_PORTS];
+static int cache_count;
+static char resolved_path[MAX_PORT_PATH];
+
+///
+/// The cache is $PROGRAMMER_PORT_CACHE, or ~/.programmer_ports.
+/// @returns 0 if there is nowhere to put it
+///
+static int get_cache_path(char *path, int size)
+{
+	const char *dir;
+
+	if (getenv("PROGRAMMER_PORT_CACHE") != NULL)
+	{
+		snprintf(path, size, "%s", getenv("PROGRAMMER_PORT_CACHE"));
+		return 1;
+	}
+
+	dir = getenv("HOME");
+	if (dir == NULL)
+		return 0;
+
+	snprintf(path, size, "%s/%s", dir, CACHE_FILE_NAME);
+	return 1;
+}
+
+///
+/// Load the cache.  Each line is "<serial number> <path> <version>".
+///
+static void read_cache()
+{
+	char path[PATH_MAX];
+	struct discovered_port *entry;
+	FILE *f;
+
+	cache_count = 0;
+	if (!get_cache_path(path, sizeof(path)) || (f = fopen(path, "r")) == NULL)
+		return;
+
+	while (cache_count < MAX_DISCOVERED_PORTS)
+	{
+		entry = &cache[cache_count];
+		if (fscanf(f, "%63s %63s %d", entry->serial_number, entry->path,
+			&entry->version) != 3)
+			break;
+
+		cache_count++;
+	}
+
+	fclose(f);
+}
+
+///
+/// Write the cache back out.  It is replaced atomically, so another instance
+/// starting up at the same time never sees it half written.
+///
+static void write_cache()
+{
+	char path[PATH_MAX];
+	char temp_path[PATH_MAX + 8];
+	FILE *f;
+	int i;
+
+	if (!get_cache_path(path, sizeof(path)))
+		return;
+
+	snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int) getpid());
+	f = fopen(temp_path, "w");
+	if (f == NULL)
+		return;
+
+	for (i = 0; i < cache_count; i++)
+		fprintf(f, "%s %s %d\n", cache[i].serial_number, cache[i].path, cache[i].version);
+
+	fclose(f);
+	if (rename(temp_path, path) != 0)
+		remove(temp_path);
+}
+
+///
+/// Record where a USB adapter was seen.  Entries for adapters that weren't
+/// seen are kept, since they may just have been busy.
+///
+static void update_cache(const struct discovered_port *port)
+{
+	int i;
+
+	if (port->serial_number[0] == '\0')
+		return;
+
+	for (i = 0; i < cache_count; i++)
+	{
+		if (strcmp(cache[i].serial_number, port->serial_number) == 0)
+			break;
+	}
+
+	if (i == MAX_DISCOVERED_PORTS)
+		return;
+
+	cache[i] = *port;
+	if (i == cache_count)
+		cache_count++;
+}
+
+void read_serial_number(const char *path, char *serial_number)
+{
+	char device[PATH_MAX];
+	char file[PATH_MAX + 16];
+	const char *name;
+	char *end;
+	FILE *f;
+	int i;
+
+	serial_number[0] = '\0';
+	name = strrchr(path, '/');
+	snprintf(file, sizeof(file), "/sys/class/tty/%s/device", name != NULL ? name + 1 : path);
+	if (realpath(file, device) == NULL)
+		return;
+
+	// The tty's device is a USB interface.  The serial number belongs to the
+	// USB device above it.
+	while ((end = strrchr(device, '/')) != NULL && end != device)
+	{
+		snprintf(file, sizeof(file), "%s/serial", device);
+		f = fopen(file, "r");
+		if (f != NULL)
+		{
+			if (fgets(serial_number, MAX_SERIAL_NUMBER, f) == NULL)
+				serial_number[0] = '\0';
+
+			fclose(f);
+
+			// It is stored in a whitespace separated file
+			serial_number[strcspn(serial_number, "\r\n")] = '\0';
+			for (i = 0; serial_number[i] != '\0'; i++)
+			{
+				if (serial_number[i] == ' ' || serial_number[i] == '\t')
+					serial_number[i] = '_';
+			}
+
+			return;
+		}
+
+		*end = '\0';
+	}
+}
+
+///
+/// Open a port with the same settings as open_serial, and send it a 'V'
+/// @returns the file descriptor, or -1 if it couldn't be opened
+///
+static int start_probe(const char *path)
+{
+	struct termios portState;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	if (tcgetattr(fd, &portState) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	cfmakeraw(&portState);
+	cfsetispeed(&portState, B9600);
+	cfsetospeed(&portState, B9600);
+	portState.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS | HUPCL);
+	portState.c_cflag |= CLOCAL | CREAD | CS8;
+	portState.c_iflag &= ~(IXON | IXOFF | IXANY);
+	if (tcsetattr(fd, TCSANOW, &portState) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	tcflush(fd, TCIOFLUSH);
+	if (write(fd, "V", 1) != 1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int discover_programmers(struct discovered_port *ports, int max)
+{
+	struct pollfd fds[MAX_CANDIDATES];
+	const char *paths[MAX_CANDIDATES];
+	glob_t candidates;
+	int candidate_count = 0;
+	int waiting = 0;
+	int found = 0;
+	double deadline;
+	int remaining;
+	int result;
+	unsigned char c;
+	size_t i;
+
+	memset(&candidates, 0, sizeof(candidates));
+	for (i = 0; i < sizeof(candidate_patterns) / sizeof(candidate_patterns[0]); i++)
+		glob(candidate_patterns[i], i > 0 ? GLOB_APPEND : 0, NULL, &candidates);
+
+	// Send every port a 'V' before waiting for any of them, so finding them
+	// all takes one timeout rather than one for each port.
+	for (i = 0; i < candidates.gl_pathc && candidate_count < MAX_CANDIDATES; i++)
+	{
+		fds[candidate_count].fd = start_probe(candidates.gl_pathv[i]);
+		if (fds[candidate_count].fd < 0)
+			continue;
+
+		fds[candidate_count].events = POLLIN;
+		paths[candidate_count++] = candidates.gl_pathv[i];
+		waiting++;
+	}
+
+	read_cache();
+	deadline = metrics_now() + PROBE_TIMEOUT / 1000.0;
+	while (waiting > 0 && (remaining = (int) ((deadline - metrics_now()) * 1000)) > 0)
+	{
+		result = poll(fds, candidate_count, remaining);
+		if (result < 0 && errno == EINTR)
+			continue;
+
+		if (result <= 0)
+			break;
+
+		for (i = 0; i < (size_t) candidate_count; i++)
+		{
+			if (fds[i].fd < 0 || fds[i].revents == 0)
+				continue;
+
+			if ((fds[i].revents & POLLIN) && read(fds[i].fd, &c, 1) == 1 && found < max)
+			{
+				snprintf(ports[found].path, MAX_PORT_PATH, "%s", paths[i]);
+				read_serial_number(paths[i], ports[found].serial_number);
+				ports[found].version = c;
+				update_cache(&ports[found]);
+				found++;
+			}
+
+			// Negative descriptors are skipped by poll
+			close(fds[i].fd);
+			fds[i].fd = -1;
+			waiting--;
+		}
+	}
+
+	for (i = 0; i < (size_t) candidate_count; i++)
+	{
+		if (fds[i].fd >= 0)
+			close(fds[i].fd);
+	}
+
+	write_cache();
+	globfree(&candidates);
+
+	return found;
+}
+
+///
+/// Anything that echoes, such as a modem or a loopback, answers 'V' as well,
+/// with the 'V' itself.  Only versions this host understands are programmers.
+///
+static int is_programmer_version(int version)
+{
+	return version >= MIN_PROTOCOL_VERSION && version <= EXPECTED_PROTOCOL_VERSION;
+}
+
+int list_programmers()
+{
+	struct discovered_port ports[MAX_DISCOVERED_PORTS];
+	double start = metrics_now();
+	int programmers = 0;
+	int count;
+	int i;
+
+	count = discover_programmers(ports, MAX_DISCOVERED_PORTS);
+	for (i = 0; i < count; i++)
+	{
+		if (!is_programmer_version(ports[i].version))
+		{
+			printf("%-16s answered 0x%02x, not a programmer this host understands\n",
+				ports[i].path, ports[i].version);
+			continue;
+		}
+
+		printf("%-16s version %-3d %s%s\n", ports[i].path, ports[i].version,
+			ports[i].serial_number[0] != '\0' ? SERIAL_NUMBER_PREFIX : "",
+			ports[i].serial_number);
+		programmers++;
+	}
+
+	printf("found %d programmers in %d ms\n", programmers,
+		(int) ((metrics_now() - start) * 1000));
+	return programmers > 0;
+}
+
+static const char *set_resolved_path(const char *path)
+{
+	snprintf(resolved_path, sizeof(resolved_path), "%s", path);
+	return resolved_path;
+}
+
+const char *resolve_port(const char *name)
+{
+	struct discovered_port ports[MAX_DISCOVERED_PORTS];
+	char serial_number[MAX_SERIAL_NUMBER];
+	int count;
+	int match = -1;
+	int i;
+
+	if (strcmp(name, AUTO_PORT_NAME) == 0)
+	{
+		count = discover_programmers(ports, MAX_DISCOVERED_PORTS);
+		for (i = 0; i < count; i++)
+		{
+			if (!is_programmer_version(ports[i].version))
+				continue;
+
+			if (match >= 0)
+			{
+				printf("More than one programmer is attached (%s and %s)\n",
+					ports[match].path, ports[i].path);
+				return NULL;
+			}
+
+			match = i;
+		}
+
+		if (match < 0)
+		{
+			printf("No programmers found\n");
+			return NULL;
+		}
+
+		return set_resolved_path(ports[match].path);
+	}
+
+	if (strncmp(name, SERIAL_NUMBER_PREFIX, strlen(SERIAL_NUMBER_PREFIX)) != 0)
+		return name;
+
+	name += strlen(SERIAL_NUMBER_PREFIX);
+
+	// Try where the adapter was last seen first.  Checking that it is still
+	// there only needs a look in sysfs, not a probe.
+	read_cache();
+	for (i = 0; i < cache_count; i++)
+	{
+		if (strcmp(cache[i].serial_number, name) == 0)
+		{
+			read_serial_number(cache[i].path, serial_number);
+			if (strcmp(serial_number, name) == 0)
+				return set_resolved_path(cache[i].path);
+		}
+	}
+
+	count = discover_programmers(ports, MAX_DISCOVERED_PORTS);
+	for (i = 0; i < count; i++)
+	{
+		if (strcmp(ports[i].serial_number, name) == 0)
+			return set_resolved_path(ports[i].path);
+	}
+
+	printf("No programmer with serial number %s found\n", name);
+	return NULL;
+}
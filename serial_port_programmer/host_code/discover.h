@@ -0,0 +1,72 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// Finds programmers without knowing which port they are on.  Every candidate
+// tty is opened at once and sent a 'V', and whatever answers before a short
+// deadline is a programmer.  USB adapters are remembered by serial number in
+// a cache file, so a programmer can be named by its adapter, which doesn't
+// change, rather than by a device node, which depends on the order they were
+// plugged in.
+//
+
+#ifndef __DISCOVER_H
+#define __DISCOVER_H
+
+#define MAX_DISCOVERED_PORTS 64
+#define MAX_PORT_PATH 64
+#define MAX_SERIAL_NUMBER 64
+
+// Prefix of a port name that selects a programmer by USB serial number
+#define SERIAL_NUMBER_PREFIX "sn:"
+
+// Port name that selects the only programmer attached
+#define AUTO_PORT_NAME "auto"
+
+struct discovered_port
+{
+	char path[MAX_PORT_PATH];
+	char serial_number[MAX_SERIAL_NUMBER];	// Empty if it isn't a USB device
+	int version;	// Protocol version it answered with
+};
+
+/// Probe /dev/ttyUSB*, /dev/ttyACM* and /dev/ttyS* for programmers, and
+/// update the cache with the ones found.
+/// @returns the number of ports that answered, which are filled in to
+/// ports, up to max.  Anything that echoes answers too, so check the version
+/// before taking one for a programmer.
+int discover_programmers(struct discovered_port *ports, int max);
+
+/// Print the programmers discover_programmers finds
+/// @returns 1 if there were any
+int list_programmers();
+
+/// Turn a port name as given by the user into a device to open.
+/// "sn:<serial number>" is looked up in the cache, and the ports are only
+/// probed if it isn't there or the adapter has moved.  "auto" probes the
+/// ports and picks the only programmer with the version this host
+/// understands.  Anything else is returned as it is.
+/// @returns
+///   - The device path, which is valid until the next call
+///   - NULL if no programmer matches.  This prints an error message.
+const char *resolve_port(const char *name);
+
+/// Look up the serial number of the USB device a tty belongs to in sysfs.
+/// serial_number (MAX_SERIAL_NUMBER bytes) is set to an empty string if it
+/// isn't a USB device.
+void read_serial_number(const char *path, char *serial_number);
+
+#endif
@@ -0,0 +1,293 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "image.h"
+#include "hexstream.h"
+
+#define MAX_LINE_LENGTH 600		// 255 data bytes, as hex, plus the header
+#define RING_POLL_INTERVAL 200	// microseconds
+
+// Values for state
+#define STATE_RUNNING 0
+#define STATE_DONE 1
+#define STATE_ERROR 2
+
+static void ring_wait()
+{
+	struct timespec interval;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = RING_POLL_INTERVAL * 1000;
+	nanosleep(&interval, NULL);
+}
+
+static void put_word(struct hex_stream *stream, int word)
+{
+	unsigned int head = atomic_load_explicit(&stream->head, memory_order_relaxed);
+
+	while (head - atomic_load_explicit(&stream->tail, memory_order_acquire)
+		== HEX_STREAM_RING_SIZE)
+		ring_wait();	// Full, the programmer has to catch up
+
+	stream->ring[head % HEX_STREAM_RING_SIZE] = word;
+	atomic_store_explicit(&stream->head, head + 1, memory_order_release);
+}
+
+///
+/// Accept one byte of a data record.  Program words are little endian, two
+/// bytes per word.
+/// @returns
+///   - 0 on success
+///   - -1 if the address is behind words that were already handed off, or
+///     sets ID locations or data EEPROM
+///
+static int put_byte(struct hex_stream *stream, int address, int value)
+{
+	int word_address;
+
+	if (address >= CONFIG_WORD_OFFSET && address < CONFIG_WORD_OFFSET + 2)
+	{
+		if (address == CONFIG_WORD_OFFSET)
+			stream->config_word = (stream->config_word & 0xff00) | value;
+		else
+			stream->config_word = (stream->config_word & 0xff) | (value << 8);
+
+		return 0;
+	}
+
+	if (address >= MAX_PROGRAM_SIZE * 2)
+	{
+		// These are only programmed from a whole image (see program_image).
+		// Rather than silently give a different chip than without -s, fail.
+		// Erased bytes, and the unused high bytes of EEPROM words, are fine.
+		if (value != 0xff && ((address >= ID_LOCATIONS_OFFSET
+			&& address < ID_LOCATIONS_OFFSET + ID_LOCATION_COUNT * 2)
+			|| (address >= DATA_MEMORY_OFFSET && (address & 1) == 0)))
+		{
+			fprintf(stderr, "%s at %04x can't be streamed, program the file without -s\n",
+				address >= DATA_MEMORY_OFFSET ? "data EEPROM" : "ID location", address);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	word_address = address / 2;
+	if (word_address < stream->next_address)
+	{
+		fprintf(stderr, "address %04x is out of order, a stream must be sorted\n",
+			address);
+		return -1;
+	}
+
+	if (stream->have_word && word_address != stream->current_address)
+	{
+		put_word(stream, stream->current_word);
+		stream->next_address++;
+		stream->have_word = 0;
+	}
+
+	if (!stream->have_word)
+	{
+		while (stream->next_address < word_address)
+		{
+			put_word(stream, 0x3fff);
+			stream->next_address++;
+		}
+
+		stream->current_address = word_address;
+		stream->current_word = 0x3fff;
+		stream->have_word = 1;
+	}
+
+	if (address & 1)
+		stream->current_word = (stream->current_word & 0xff) | (value << 8);
+	else
+		stream->current_word = (stream->current_word & 0xff00) | value;
+
+	return 0;
+}
+
+///
+/// Parse one line of an Intel HEX file.  See read_hex_records for the format.
+/// @returns
+///   - 1 if this was the end of file record
+///   - 0 if there are more records
+///   - -1 if an error occured
+///
+static int parse_line(struct hex_stream *stream, const char *line, int lineNumber)
+{
+	int dataLength;
+	int address;
+	int recordType;
+	int checksum;
+	int computedChecksum;
+	int datum;
+	unsigned long extended;
+	unsigned long full_address;
+	int i;
+
+	if (sscanf(line, ":%02x%04x%02x", &dataLength, &address, &recordType) != 3
+		|| (int) strlen(line) < 11 + dataLength * 2)
+	{
+		fprintf(stderr, "malformed record on line %d\n", lineNumber);
+		return -1;
+	}
+
+	computedChecksum = dataLength + (address >> 8) + (address & 0xff) + recordType;
+	for (i = 0; i < dataLength; i++)
+	{
+		sscanf(line + 9 + i * 2, "%02x", &datum);
+		computedChecksum += datum;
+	}
+
+	sscanf(line + 9 + dataLength * 2, "%02x", &checksum);
+	computedChecksum = (1 + ~(computedChecksum & 0xff)) & 0xff;
+	if (checksum != computedChecksum)
+	{
+		fprintf(stderr, "checksum mismatch on line %d (file %02x computed %02x)\n",
+			lineNumber, checksum, computedChecksum);
+		return -1;
+	}
+
+	if (recordType == 1)
+		return 1;
+
+	if (recordType == 2 || recordType == 4)
+	{
+		extended = 0;
+		for (i = 0; i < dataLength; i++)
+		{
+			sscanf(line + 9 + i * 2, "%02x", &datum);
+			extended = (extended << 8) | datum;
+		}
+
+		stream->base = recordType == 2 ? extended << 4 : extended << 16;
+		return 0;
+	}
+
+	if (recordType != 0)
+		return 0;
+
+	for (i = 0; i < dataLength; i++)
+	{
+		sscanf(line + 9 + i * 2, "%02x", &datum);
+		full_address = stream->base + address + i;
+		if (full_address >= IMAGE_SIZE)
+		{
+			fprintf(stderr, "address %06lx on line %d is past the end of midrange memory\n",
+				full_address, lineNumber);
+			return -1;
+		}
+
+		if (put_byte(stream, (int) full_address, datum) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *parser_thread(void *arg)
+{
+	struct hex_stream *stream = (struct hex_stream*) arg;
+	char line[MAX_LINE_LENGTH];
+	int lineNumber;
+	int result = 0;
+
+	for (lineNumber = 1; ; lineNumber++)
+	{
+		if (fgets(line, sizeof(line), stream->file) == NULL)
+		{
+			fprintf(stderr, "premature end of file\n");
+			result = -1;
+			break;
+		}
+
+		result = parse_line(stream, line, lineNumber);
+		if (result != 0)
+			break;
+	}
+
+	if (result > 0 && stream->have_word)
+		put_word(stream, stream->current_word);
+
+	stream->source.config_word = stream->config_word;
+	atomic_store_explicit(&stream->state, result > 0 ? STATE_DONE : STATE_ERROR,
+		memory_order_release);
+
+	return NULL;
+}
+
+static int next_word(struct word_source *source, int *word, int wait)
+{
+	struct hex_stream *stream = (struct hex_stream*) source;
+	unsigned int tail = atomic_load_explicit(&stream->tail, memory_order_relaxed);
+	int state;
+
+	for (;;)
+	{
+		// Read the state first: if the parser has finished, everything it
+		// put in the ring is visible.
+		state = atomic_load_explicit(&stream->state, memory_order_acquire);
+		if (atomic_load_explicit(&stream->head, memory_order_acquire) != tail)
+		{
+			*word = stream->ring[tail % HEX_STREAM_RING_SIZE];
+			atomic_store_explicit(&stream->tail, tail + 1, memory_order_release);
+			return WORD_SOURCE_OK;
+		}
+
+		if (state == STATE_DONE)
+			return WORD_SOURCE_END;
+
+		if (state == STATE_ERROR)
+			return WORD_SOURCE_ERROR;
+
+		if (!wait)
+			return WORD_SOURCE_EMPTY;
+
+		ring_wait();
+	}
+}
+
+int hex_stream_start(struct hex_stream *stream, FILE *file)
+{
+	stream->source.next_word = next_word;
+	stream->source.config_word = 0x3fff;
+	stream->file = file;
+	atomic_init(&stream->head, 0);
+	atomic_init(&stream->tail, 0);
+	atomic_init(&stream->state, STATE_RUNNING);
+	stream->next_address = 0;
+	stream->have_word = 0;
+	stream->config_word = 0x3fff;
+	stream->base = 0;
+
+	if (pthread_create(&stream->thread, NULL, parser_thread, stream) != 0)
+	{
+		perror("error starting parser thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+void hex_stream_finish(struct hex_stream *stream)
+{
+	pthread_join(stream->thread, NULL);
+}
@@ -0,0 +1,69 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// Incremental Intel HEX parser for streamed programming.  A parser thread
+// reads records as they arrive on a pipe and hands decoded program words to
+// the programming thread through a lock-free single producer, single
+// consumer ring, so the first words are being programmed while the rest of
+// the file is still being written.
+//
+
+#ifndef __HEXSTREAM_H
+#define __HEXSTREAM_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "protocol.h"
+
+#define HEX_STREAM_RING_SIZE 1024	// Must be a power of two
+
+struct hex_stream
+{
+	struct word_source source;	// Must be first
+	FILE *file;
+	pthread_t thread;
+
+	// Written by the parser thread, read by the programming thread.  head is
+	// the next slot the parser fills, tail the next one the programmer takes.
+	unsigned short ring[HEX_STREAM_RING_SIZE];
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_int state;
+
+	// Private to the parser thread
+	int next_address;	// Word address of the next word to put in the ring
+	int current_address;
+	int current_word;
+	int have_word;		// current_word has bytes that aren't in the ring yet
+	int config_word;
+	unsigned long base;	// From the last extended address record
+};
+
+/// Start a thread parsing Intel HEX records from file.  Program words must
+/// appear in increasing address order.  Gaps are filled with blank words.
+/// @returns
+///   - 0 on success
+///   - -1 if the thread could not be started
+int hex_stream_start(struct hex_stream *stream, FILE *file);
+
+/// Wait for the parser thread to exit.  Only call this once the source has
+/// returned WORD_SOURCE_END or WORD_SOURCE_ERROR; otherwise the thread may be
+/// blocked on the file or a full ring.
+void hex_stream_finish(struct hex_stream *stream);
+
+#endif
@@ -0,0 +1,548 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "image.h"
+
+#define ELF_HEADER_SIZE 52
+#define ELF_SECTION_HEADER_SIZE 40
+#define SHT_PROGBITS 1
+#define SHF_ALLOC 2
+
+#define COFF_MAGIC_V1 0x1234
+#define COFF_MAGIC_V2 0x1240
+#define COFF_HEADER_SIZE 20
+#define COFF_SECTION_HEADER_SIZE 40
+#define STYP_TEXT 0x20
+#define STYP_DATA_ROM 0x100
+
+// The contents of an image file, mapped into memory where the system allows
+// it so the loaders below can pick the bytes straight out of it.
+struct mapped_file
+{
+	const unsigned char *data;
+	unsigned long size;
+	int mapped;
+};
+
+///
+/// Read Intel HEX format file
+///
+/// each line is:
+/// :aabbbbccdddddddd...dddee
+/// where a is the length of the line (hex)
+/// b is the address
+/// c is the record type
+///   00 data
+///   01 end of file
+///   02 extended segment address (d is bits 4-19 of the address)
+///   04 extended linear address (d is the upper 16 bits of the address)
+/// d is the data for the line
+/// e is the checksum, the 2's complement sum of of the other bytes in the line
+static int read_hex_stream(FILE *f, hex_store_func store, void *context)
+{
+	int dataLength;
+	int address;
+	int recordType;
+	int checksum;
+	int computedChecksum;
+	int datum;
+	int i;
+	int line;
+	int result = 0;
+	unsigned long base = 0;
+	unsigned long extended = 0;
+
+	for (line = 1; ; line++) {
+		if (fscanf(f, ":%02x%04x%02x", &dataLength, &address, &recordType) < 0) {
+			fprintf(stderr, "premature end of file\n");
+			result = -1;
+			break;
+		}
+
+		computedChecksum = dataLength + (address >> 8) + (address & 0xff) + recordType;
+
+		extended = 0;
+		for (i = 0; i < dataLength; i++) {
+			if (fscanf(f, "%02x", &datum) < 0) {
+				fprintf(stderr, "premature end of file\n");
+				result = -1;
+				goto done;
+			}
+
+			if (recordType == 0)
+				store(context, base + address + i, datum);
+			else
+				extended = (extended << 8) | datum;
+
+			computedChecksum += datum;
+		}
+
+		if (fscanf(f, "%02x\n", &checksum) < 0) {
+			fprintf(stderr, "premature end of file\n");
+			result = -1;
+			break;
+		}
+
+		computedChecksum = (1 + ~(computedChecksum & 0xff)) & 0xff;
+
+		if (checksum != computedChecksum) {
+			fprintf(stderr, "checksum mismatch on line %d (file %02x computed %02x)\n", line, checksum, computedChecksum);
+			result = -1;
+			break;
+		}
+
+		if (recordType == 1)
+			break;
+		else if (recordType == 2)
+			base = extended << 4;
+		else if (recordType == 4)
+			base = extended << 16;
+	}
+
+done:
+	return result;
+}
+
+int read_hex_records(const char *filename, hex_store_func store, void *context)
+{
+	FILE *f;
+	int result;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		perror("error opening file");
+		return -1;
+	}
+
+	result = read_hex_stream(f, store, context);
+	fclose(f);
+
+	return result;
+}
+
+static int map_file(const char *filename, struct mapped_file *file)
+{
+#ifndef _WIN32
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		perror("error opening file");
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0)
+	{
+		perror("error opening file");
+		close(fd);
+		return -1;
+	}
+
+	file->size = st.st_size;
+	file->data = NULL;
+	file->mapped = 0;
+	if (file->size > 0)
+	{
+		data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			file->data = data;
+			file->mapped = 1;
+		}
+	}
+
+	close(fd);
+	if (file->mapped)
+		return 0;
+
+	// Something that can't be mapped, like a pipe or an empty file, falls
+	// through to reading it below.
+#endif
+	{
+		FILE *f;
+		unsigned char *buffer = NULL;
+		unsigned long allocated = 0;
+		size_t got;
+
+		f = fopen(filename, "rb");
+		if (f == NULL)
+		{
+			perror("error opening file");
+			return -1;
+		}
+
+		file->size = 0;
+		file->mapped = 0;
+		do
+		{
+			if (file->size == allocated)
+			{
+				unsigned char *grown;
+
+				allocated = allocated ? allocated * 2 : 0x10000;
+				grown = realloc(buffer, allocated);
+				if (grown == NULL)
+				{
+					fprintf(stderr, "out of memory reading %s\n", filename);
+					free(buffer);
+					fclose(f);
+					return -1;
+				}
+
+				buffer = grown;
+			}
+
+			got = fread(buffer + file->size, 1, allocated - file->size, f);
+			file->size += got;
+		}
+		while (got > 0);
+
+		fclose(f);
+		file->data = buffer;
+	}
+
+	return 0;
+}
+
+static void unmap_file(struct mapped_file *file)
+{
+#ifndef _WIN32
+	if (file->mapped)
+	{
+		munmap((void*) file->data, file->size);
+		return;
+	}
+#endif
+	free((void*) file->data);
+}
+
+static unsigned long read_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long read_le32(const unsigned char *p)
+{
+	return read_le16(p) | (read_le16(p + 2) << 16);
+}
+
+static unsigned long read_elf16(const unsigned char *p, int big_endian)
+{
+	return big_endian ? (unsigned long) ((p[0] << 8) | p[1]) : read_le16(p);
+}
+
+static unsigned long read_elf32(const unsigned char *p, int big_endian)
+{
+	return big_endian ? (read_elf16(p, 1) << 16) | read_elf16(p + 2, 1)
+		: read_le32(p);
+}
+
+// Check that a piece of the file named in one of its headers is inside it
+static int in_file(const struct mapped_file *file, unsigned long offset,
+	unsigned long length)
+{
+	return offset <= file->size && length <= file->size - offset;
+}
+
+static void store_bytes(hex_store_func store, void *context, unsigned long address,
+	const unsigned char *data, unsigned long length)
+{
+	unsigned long i;
+
+	for (i = 0; i < length; i++)
+		store(context, address + i, data[i]);
+}
+
+// An Intel HEX file starts with a record: a colon and then the hex digits of
+// its length, address and type.  Checking all of them keeps a raw binary
+// that happens to start with 0x3a from being taken for one.
+static int is_hex_file(const struct mapped_file *file)
+{
+	unsigned long i;
+
+	if (file->size < 11 || file->data[0] != ':')
+		return 0;
+
+	for (i = 1; i < 9; i++)
+	{
+		if (!strchr("0123456789abcdefABCDEF", file->data[i]) || file->data[i] == '\0')
+			return 0;
+	}
+
+	return 1;
+}
+
+///
+/// Load the allocated sections that have contents (SHT_PROGBITS with
+/// SHF_ALLOC) of a 32 bit ELF file at their addresses.  As in a HEX file,
+/// these are byte addresses.
+///
+static int read_elf_sections(const char *filename, const struct mapped_file *file,
+	hex_store_func store, void *context)
+{
+	const unsigned char *header = file->data;
+	const unsigned char *section;
+	unsigned long section_offset;
+	unsigned long section_size;
+	int section_count;
+	int big_endian;
+	int i;
+
+	if (file->size < ELF_HEADER_SIZE || header[4] != 1 || (header[5] != 1 && header[5] != 2))
+	{
+		fprintf(stderr, "%s: only 32 bit ELF files are supported\n", filename);
+		return -1;
+	}
+
+	big_endian = header[5] == 2;
+	section_offset = read_elf32(header + 0x20, big_endian);
+	section_size = read_elf16(header + 0x2e, big_endian);
+	section_count = read_elf16(header + 0x30, big_endian);
+	if (section_count > 0 && (section_size < ELF_SECTION_HEADER_SIZE
+		|| !in_file(file, section_offset, section_size * section_count)))
+	{
+		fprintf(stderr, "%s: bad section table\n", filename);
+		return -1;
+	}
+
+	for (i = 0; i < section_count; i++)
+	{
+		unsigned long offset;
+		unsigned long length;
+
+		section = file->data + section_offset + i * section_size;
+		if (read_elf32(section + 4, big_endian) != SHT_PROGBITS
+			|| (read_elf32(section + 8, big_endian) & SHF_ALLOC) == 0)
+			continue;
+
+		offset = read_elf32(section + 16, big_endian);
+		length = read_elf32(section + 20, big_endian);
+		if (!in_file(file, offset, length))
+		{
+			fprintf(stderr, "%s: section %d is past the end of the file\n", filename, i);
+			return -1;
+		}
+
+		store_bytes(store, context, read_elf32(section + 12, big_endian),
+			file->data + offset, length);
+	}
+
+	return 0;
+}
+
+///
+/// Load the code and ROM data sections of a Microchip COFF file (as written
+/// by MPLINK or gplink, either version of the format) at their physical
+/// addresses, which are byte addresses like the ones in a HEX file.
+///
+static int read_coff_sections(const char *filename, const struct mapped_file *file,
+	hex_store_func store, void *context)
+{
+	const unsigned char *section;
+	unsigned long section_offset;
+	int section_count;
+	int i;
+
+	section_count = read_le16(file->data + 2);
+	section_offset = COFF_HEADER_SIZE + read_le16(file->data + 16);
+	if (!in_file(file, section_offset, (unsigned long) section_count * COFF_SECTION_HEADER_SIZE))
+	{
+		fprintf(stderr, "%s: bad section table\n", filename);
+		return -1;
+	}
+
+	for (i = 0; i < section_count; i++)
+	{
+		unsigned long offset;
+		unsigned long length;
+
+		section = file->data + section_offset + i * COFF_SECTION_HEADER_SIZE;
+		offset = read_le32(section + 20);
+		length = read_le32(section + 16);
+		if ((read_le32(section + 36) & (STYP_TEXT | STYP_DATA_ROM)) == 0
+			|| offset == 0 || length == 0)
+			continue;
+
+		if (!in_file(file, offset, length))
+		{
+			fprintf(stderr, "%s: section %.8s is past the end of the file\n", filename,
+				section);
+			return -1;
+		}
+
+		store_bytes(store, context, read_le32(section + 8), file->data + offset, length);
+	}
+
+	return 0;
+}
+
+int read_image_records(const char *filename, hex_store_func store, void *context)
+{
+	struct mapped_file file;
+	unsigned long magic;
+	int result;
+
+	if (map_file(filename, &file) < 0)
+		return -1;
+
+	magic = file.size >= COFF_HEADER_SIZE ? read_le16(file.data) : 0;
+	if (is_hex_file(&file))
+	{
+#ifndef _WIN32
+		// Parse the copy already in memory, since a pipe can't be read twice
+		FILE *f = fmemopen((void*) file.data, file.size, "r");
+
+		if (f == NULL)
+		{
+			perror("error reading file");
+			result = -1;
+		}
+		else
+		{
+			result = read_hex_stream(f, store, context);
+			fclose(f);
+		}
+#else
+		result = read_hex_records(filename, store, context);
+#endif
+	}
+	else if (file.size >= 4 && memcmp(file.data, "\x7f" "ELF", 4) == 0)
+		result = read_elf_sections(filename, &file, store, context);
+	else if (magic == COFF_MAGIC_V1 || magic == COFF_MAGIC_V2)
+		result = read_coff_sections(filename, &file, store, context);
+	else
+	{
+		// A raw binary is laid out the same way as the addresses in a HEX
+		// file, starting at zero.  Gaps are filled with erased (0xffff)
+		// words, which are skipped as if the file didn't set them.  One that
+		// sets nothing at all is more likely a mistake than a blank chip.
+		unsigned long address;
+		int stored = 0;
+
+		for (address = 0; address < file.size; address += 2)
+		{
+			if (address + 1 < file.size && file.data[address] == 0xff
+				&& file.data[address + 1] == 0xff)
+				continue;
+
+			store_bytes(store, context, address, file.data + address,
+				address + 1 < file.size ? 2 : 1);
+			stored = 1;
+		}
+
+		result = 0;
+		if (!stored)
+		{
+			fprintf(stderr, "%s is %s\n", filename, file.size == 0 ? "empty"
+				: "not a hex, ELF or COFF file and has no data");
+			result = -1;
+		}
+	}
+
+	unmap_file(&file);
+
+	return result;
+}
+
+struct array_store
+{
+	unsigned char *array;
+	int size;
+	int max_address;
+};
+
+static void store_in_array(void *context, unsigned long address, int value)
+{
+	struct array_store *store = context;
+
+	if (address < (unsigned long) store->size)
+		store->array[address] = (unsigned char) value;
+
+	if (address < 0x4000 && (int) address + 1 > store->max_address)
+		store->max_address = address + 1;
+}
+
+int read_image_file(const char *filename, unsigned char *array, int arraySize,
+	int *outMaxAddress)
+{
+	struct array_store store;
+
+	store.array = array;
+	store.size = arraySize;
+	store.max_address = 0;
+	if (read_image_records(filename, store_in_array, &store) < 0)
+		return -1;
+
+	*outMaxAddress = store.max_address;
+	return 0;
+}
+
+int load_image(const char *filename, struct image *image)
+{
+	int maxAddress;
+
+	memset(image->data, 0xff, sizeof(image->data));
+	if (read_image_file(filename, image->data, sizeof(image->data), &maxAddress) < 0)
+		return -1;
+
+	image->instruction_count = maxAddress / 2;	// Max address is in bytes
+	image->config_word = (image->data[CONFIG_WORD_OFFSET + 1] << 8)
+		| image->data[CONFIG_WORD_OFFSET];
+
+	// Erased bytes are skipped when programming, so trailing ones don't count
+	image->data_size = MAX_DATA_MEMORY_SIZE;
+	while (image->data_size > 0 && image_data_byte(image, image->data_size - 1) == 0xff)
+		image->data_size--;
+
+	return 0;
+}
+
+int image_word(const struct image *image, int address)
+{
+	return (image->data[address * 2 + 1] << 8) | image->data[address * 2];
+}
+
+int image_data_byte(const struct image *image, int address)
+{
+	return image->data[DATA_MEMORY_OFFSET + address * 2];
+}
+
+int image_id_locations(const struct image *image, int *id_words)
+{
+	int present = 0;
+	int i;
+
+	for (i = 0; i < ID_LOCATION_COUNT; i++)
+	{
+		id_words[i] = image_word(image, ID_LOCATIONS_OFFSET / 2 + i);
+		if (id_words[i] != 0xffff)
+			present = 1;
+	}
+
+	return present;
+}
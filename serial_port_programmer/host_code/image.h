@@ -0,0 +1,102 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#ifndef __IMAGE_H
+#define __IMAGE_H
+
+#define MAX_PROGRAM_SIZE 0x2000
+
+// Byte offset of data EEPROM in the hex file (word address 0x2100).  Each
+// byte takes a word, low byte first.
+#define DATA_MEMORY_OFFSET 0x4200
+#define MAX_DATA_MEMORY_SIZE 256	// Bytes, on the PIC16F648A
+
+#define IMAGE_SIZE (DATA_MEMORY_OFFSET + MAX_DATA_MEMORY_SIZE * 2)
+
+// Byte offset of the configuration word in the hex file (word address 0x2007)
+#define CONFIG_WORD_OFFSET 0x400e
+
+// Byte offset of the ID locations in the hex file (word addresses 0x2000-0x2003)
+#define ID_LOCATIONS_OFFSET 0x4000
+#define ID_LOCATION_COUNT 4
+
+///
+/// A program image, as laid out in an Intel HEX file produced by MPASM (or a
+/// raw binary of the same addresses).  Each program word occupies two bytes,
+/// little endian.
+///
+struct image
+{
+	unsigned char data[IMAGE_SIZE];
+	int instruction_count;
+	int config_word;
+	int data_size;		// Data EEPROM bytes, up to the last one that isn't erased
+};
+
+/// Called by read_hex_records and read_image_records with each data byte and
+/// its full address
+typedef void (*hex_store_func)(void *context, unsigned long address, int value);
+
+/// Read an Intel HEX file, including extended address records, and pass
+/// each data byte to store.
+/// @returns
+///   - 0 if the file was read successfully
+///   - -1 if an error occured
+int read_hex_records(const char *filename, hex_store_func store, void *context);
+
+/// Read an image file and pass each data byte to store.  The format is taken
+/// from the contents of the file:
+///   - Intel HEX, read by read_hex_records
+///   - 32 bit ELF, loading allocated sections at their addresses
+///   - Microchip COFF, loading code and ROM data sections at their addresses
+///   - anything else is a raw binary, each byte at its offset in the file,
+///     which must have some data that isn't erased (0xffff)
+/// Binary files are mapped into memory and their bytes handed to store
+/// directly, without a text conversion in between.
+/// @returns
+///   - 0 if the file was read successfully
+///   - -1 if an error occured
+int read_image_records(const char *filename, hex_store_func store, void *context);
+
+/// Read an image file (see read_image_records) into a byte array.  Bytes
+/// outside of the array are ignored.
+/// @returns
+///   - 0 if the file was read successfully
+///   - -1 if an error occured
+int read_image_file(const char *filename, unsigned char *array, int arraySize,
+	int *outMaxAddress);
+
+/// Read an image file and fill in the instruction count and configuration
+/// word of the image.
+/// @returns
+///   - 0 if the file was read successfully
+///   - -1 if an error occured
+int load_image(const char *filename, struct image *image);
+
+/// @returns the 14 bit program word at the given word address
+int image_word(const struct image *image, int address);
+
+/// @returns the data EEPROM byte at the given address (0xff if the file
+/// doesn't set it)
+int image_data_byte(const struct image *image, int address);
+
+/// Copy the ID location words out of the image
+/// @returns
+///   - 1 if the image sets any of the ID locations
+///   - 0 if it doesn't
+int image_id_locations(const struct image *image, int *id_words);
+
+#endif
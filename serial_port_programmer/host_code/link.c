@@ -0,0 +1,390 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include "discover.h"
+#endif
+#include "link.h"
+#include "protocol.h"
+#include "serial.h"
+#include "metrics.h"
+
+#define ROUND_TRIP_PROBES 8
+#define BURST_PROBES 32			// Sent back to back to measure throughput
+#define PROBE_TIMEOUT 500		// milliseconds
+
+// Rates to try above BASE_BAUD_RATE, slowest first.  The programmer's 4 MHz
+// clock can't divide down closely enough to the standard ones above these.
+static const int faster_rates[] = { 19200 };
+
+// Enough words in flight to cover a round trip, plus a couple being
+// programmed, but never fewer than this
+#define MIN_WINDOW 4
+
+// The default timeout already covers the programmer's longest silences (such
+// as a blank check of the whole part), so it is only ever raised, to allow
+// for this many worst case round trips
+#define TIMEOUT_ROUND_TRIPS 10
+#define MAX_TIMEOUT 5000		// milliseconds
+
+// Forget the parameters if there was at least one error per this many bytes
+// sent (and at least RETUNE_MIN_ERRORS), since the link has changed
+#define RETUNE_BYTES_PER_ERROR 1000
+#define RETUNE_MIN_ERRORS 2
+
+#define MAX_LINK_KEY 80
+#define MAX_CACHED_LINKS 64
+#define CACHE_FILE_NAME ".programmer_links"	// In the home directory
+
+struct cached_link
+{
+	char key[MAX_LINK_KEY];
+	struct link_params params;
+};
+
+static struct cached_link cache[MAX_CACHED_LINKS];
+static int cache_count;
+static char link_key[MAX_LINK_KEY];
+static int link_open = 0;
+static int link_baud;
+static unsigned long open_bytes_sent;
+static unsigned long open_errors;
+
+///
+/// The cache is $PROGRAMMER_LINK_CACHE, or ~/.programmer_links.
+/// @returns 0 if there is nowhere to put it
+///
+static int get_cache_path(char *path, int size)
+{
+	const char *dir;
+
+	if (getenv("PROGRAMMER_LINK_CACHE") != NULL)
+	{
+		snprintf(path, size, "%s", getenv("PROGRAMMER_LINK_CACHE"));
+		return 1;
+	}
+
+	dir = getenv("HOME");
+	if (dir == NULL)
+		dir = getenv("USERPROFILE");
+
+	if (dir == NULL)
+		return 0;
+
+	snprintf(path, size, "%s/%s", dir, CACHE_FILE_NAME);
+	return 1;
+}
+
+///
+/// Load the cache.  Each line is "<key> <baud> <window> <timeout>
+/// <round trip> <throughput>".
+///
+static void read_cache()
+{
+	char path[1024];
+	struct cached_link *entry;
+	FILE *f;
+
+	cache_count = 0;
+	if (!get_cache_path(path, sizeof(path)) || (f = fopen(path, "r")) == NULL)
+		return;
+
+	while (cache_count < MAX_CACHED_LINKS)
+	{
+		entry = &cache[cache_count];
+		if (fscanf(f, "%79s %d %d %d %d %d", entry->key, &entry->params.baud,
+			&entry->params.window, &entry->params.timeout, &entry->params.round_trip,
+			&entry->params.throughput) != 6)
+			break;
+
+		cache_count++;
+	}
+
+	fclose(f);
+}
+
+///
+/// Write the cache back out.  It is replaced atomically, so another instance
+/// starting up at the same time never sees it half written.
+///
+static void write_cache()
+{
+	char path[1024];
+	char temp_path[1040];
+	const struct link_params *params;
+	FILE *f;
+	int i;
+
+	if (!get_cache_path(path, sizeof(path)))
+		return;
+
+	snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int) getpid());
+	f = fopen(temp_path, "w");
+	if (f == NULL)
+		return;
+
+	for (i = 0; i < cache_count; i++)
+	{
+		params = &cache[i].params;
+		fprintf(f, "%s %d %d %d %d %d\n", cache[i].key, params->baud, params->window,
+			params->timeout, params->round_trip, params->throughput);
+	}
+
+	fclose(f);
+#ifdef _WIN32
+	remove(path);	// Windows won't rename over a file
+#endif
+	if (rename(temp_path, path) != 0)
+		remove(temp_path);
+}
+
+static int find_cached_link(const char *key)
+{
+	int i;
+
+	for (i = 0; i < cache_count; i++)
+	{
+		if (strcmp(cache[i].key, key) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static void remember_link(const char *key, const struct link_params *params)
+{
+	int i;
+
+	read_cache();
+	i = find_cached_link(key);
+	if (i < 0)
+	{
+		if (cache_count == MAX_CACHED_LINKS)
+			return;
+
+		i = cache_count++;
+	}
+
+	snprintf(cache[i].key, MAX_LINK_KEY, "%s", key);
+	cache[i].params = *params;
+	write_cache();
+}
+
+static void forget_link(const char *key)
+{
+	int i;
+
+	read_cache();
+	i = find_cached_link(key);
+	if (i < 0)
+		return;
+
+	cache[i] = cache[--cache_count];
+	write_cache();
+}
+
+///
+/// Links are remembered by the USB serial number of the adapter, which
+/// stays the same wherever it is plugged in, or otherwise by port name.
+///
+static void get_link_key(const char *port_name, char *key)
+{
+#ifndef _WIN32
+	char serial_number[MAX_SERIAL_NUMBER];
+
+	if (port_name != NULL)
+	{
+		read_serial_number(port_name, serial_number);
+		if (serial_number[0] != '\0')
+		{
+			snprintf(key, MAX_LINK_KEY, "%s%s", SERIAL_NUMBER_PREFIX, serial_number);
+			return;
+		}
+	}
+#endif
+
+	snprintf(key, MAX_LINK_KEY, "%s", port_name != NULL ? port_name : "default");
+}
+
+///
+/// Time 'V' requests one at a time for the round trip, then a burst of them
+/// for the throughput.  Any response but the version counts as a failure.
+///
+static int measure_link(struct link_params *params)
+{
+	int version = get_capabilities()->version;
+	double start;
+	double elapsed;
+	double worst = 0;
+	int i;
+
+	for (i = 0; i < ROUND_TRIP_PROBES; i++)
+	{
+		start = metrics_now();
+		if (!write_octet('V') || read_octet() != version)
+			return 0;
+
+		elapsed = metrics_now() - start;
+		if (elapsed > worst)
+			worst = elapsed;
+	}
+
+	start = metrics_now();
+	for (i = 0; i < BURST_PROBES; i++)
+	{
+		if (!write_octet('V'))
+			return 0;
+	}
+
+	for (i = 0; i < BURST_PROBES; i++)
+	{
+		if (read_octet() != version)
+			return 0;
+	}
+
+	elapsed = metrics_now() - start;
+	params->round_trip = (int) (worst * 1000000);
+	params->throughput = (int) (BURST_PROBES / elapsed);
+	return 1;
+}
+
+int tune_link(struct link_params *params)
+{
+	struct link_params trial;
+	long in_flight;
+	unsigned int i;
+
+	set_serial_timeout(PROBE_TIMEOUT);
+	params->baud = BASE_BAUD_RATE;
+	if (!measure_link(params))
+	{
+		reset_baud_rate();
+		set_serial_timeout(SERIAL_DEFAULT_TIMEOUT);
+		return 0;
+	}
+
+	// Go as fast as is error free and actually faster.  Hubs and adapters
+	// with large latencies may gain nothing.
+	for (i = 0; i < sizeof(faster_rates) / sizeof(faster_rates[0]); i++)
+	{
+		trial.baud = faster_rates[i];
+		if (!(get_capabilities()->features & CAP_BAUD) || trial.baud > get_capabilities()->max_baud)
+			break;
+
+		if (set_baud_rate(trial.baud) && measure_link(&trial)
+			&& trial.throughput > params->throughput)
+		{
+			*params = trial;
+			continue;
+		}
+
+		reset_baud_rate();
+		if (params->baud != BASE_BAUD_RATE && !set_baud_rate(params->baud))
+		{
+			reset_baud_rate();
+			params->baud = BASE_BAUD_RATE;
+		}
+
+		break;
+	}
+
+	// Bytes in flight to keep the link busy for a round trip
+	in_flight = (long) params->throughput * params->round_trip / 1000000;
+	params->window = in_flight / 2 + 2;
+	if (params->window < MIN_WINDOW)
+		params->window = MIN_WINDOW;
+	else if (params->window > RAW_WINDOW_MAX)
+		params->window = RAW_WINDOW_MAX;
+
+	params->timeout = SERIAL_DEFAULT_TIMEOUT + TIMEOUT_ROUND_TRIPS * params->round_trip / 1000;
+	if (params->timeout > MAX_TIMEOUT)
+		params->timeout = MAX_TIMEOUT;
+
+	set_serial_timeout(SERIAL_DEFAULT_TIMEOUT);
+	return 1;
+}
+
+int open_link(const char *port_name, int retune)
+{
+	struct link_params params;
+	int i;
+
+	if (set_serial_baud(BASE_BAUD_RATE) < 0)
+		return 1;	// Can't be tuned
+
+	get_link_key(port_name, link_key);
+	read_cache();
+	i = retune ? -1 : find_cached_link(link_key);
+	if (i >= 0)
+	{
+		params = cache[i].params;
+		if (params.baud != BASE_BAUD_RATE && !set_baud_rate(params.baud))
+		{
+			// The adapter doesn't manage that rate any more
+			forget_link(link_key);
+			reset_baud_rate();
+			return check_protocol_version();
+		}
+	}
+	else if (tune_link(&params))
+	{
+		printf("Link tuned: %d baud, %d words in flight, %d ms timeout (round trip %d.%d ms, %d bytes/s)\n",
+			params.baud, params.window, params.timeout, params.round_trip / 1000,
+			params.round_trip / 100 % 10, params.throughput);
+		remember_link(link_key, &params);
+	}
+	else
+	{
+		printf("Link tuning failed, using the defaults\n");
+		return check_protocol_version();
+	}
+
+	set_raw_window(params.window);
+	set_serial_timeout(params.timeout);
+	link_baud = params.baud;
+	metrics_get_link_counts(&open_bytes_sent, &open_errors);
+	link_open = 1;
+	return 1;
+}
+
+void close_link()
+{
+	unsigned long bytes_sent;
+	unsigned long errors;
+
+	if (!link_open)
+		return;
+
+	link_open = 0;
+	metrics_get_link_counts(&bytes_sent, &errors);
+	errors -= open_errors;
+	bytes_sent -= open_bytes_sent;
+	if (errors >= RETUNE_MIN_ERRORS && errors * RETUNE_BYTES_PER_ERROR > bytes_sent)
+	{
+		printf("%lu errors on the link, it will be tuned again next time\n", errors);
+		forget_link(link_key);
+	}
+
+	if (link_baud != BASE_BAUD_RATE && !set_baud_rate(BASE_BAUD_RATE))
+		reset_baud_rate();
+}
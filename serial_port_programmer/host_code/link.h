@@ -0,0 +1,61 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// Tunes the link to a programmer.  USB adapters, hubs and native UARTs have
+// very different latencies, so rather than one set of parameters for all of
+// them, the round trip time and throughput are measured with a few probes,
+// and the baud rate, program words in flight (see set_raw_window) and
+// timeout are picked to suit.  The result is remembered per adapter, and
+// forgotten, so the link is tuned again, if errors climb while using it.
+//
+
+#ifndef __LINK_H
+#define __LINK_H
+
+struct link_params
+{
+	int baud;
+	int window;			// Program words in flight in raw mode
+	int timeout;		// Serial timeout, in milliseconds
+	int round_trip;		// Worst round trip measured, in microseconds
+	int throughput;		// Bytes per second measured at baud
+};
+
+/// Measure the link to the programmer on the current port, and pick
+/// parameters for it.  The programmer must be in raw mode and at
+/// BASE_BAUD_RATE.  It is left at the baud rate picked.
+/// @returns
+///   - 1 on success
+///   - 0 if the probes failed.  The programmer is put back at
+///     BASE_BAUD_RATE.
+int tune_link(struct link_params *params);
+
+/// Apply the parameters remembered for port_name (NULL for the default
+/// port), tuning the link first if there are none or retune is set.  The
+/// protocol version must already have been checked.  If the port's rate
+/// can't be changed (such as when replaying a capture), nothing is done.
+/// @returns
+///   - 1 on success, including when tuning failed and the defaults are used
+///   - 0 if the programmer stopped responding
+int open_link(const char *port_name, int retune);
+
+/// Put the programmer back at BASE_BAUD_RATE, so other programs find it
+/// there.  If the link had too many errors since open_link, its parameters
+/// are forgotten, so it is tuned again next time.
+void close_link();
+
+#endif
@@ -0,0 +1,118 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include "protocol.h"
+#include "logic.h"
+
+// Pins in the high nibble of each sample
+#define PIN_VPP 0x10
+#define PIN_NVDD 0x20
+#define PIN_CLOCK 0x40
+#define PIN_DATA 0x80
+
+int capture_logic(int operation, int word, int period, struct logic_trace *trace)
+{
+	int count;
+	int c;
+	int i;
+
+	if (period < LOGIC_MIN_PERIOD || period > 255)
+	{
+		printf("Sample period must be %d to 255 us\n", LOGIC_MIN_PERIOD);
+		return 0;
+	}
+
+	if (!require_capability(CAP_CAPTURE, "Logic capture"))
+		return 0;
+
+	if (!write_octet('L') || !write_octet(period) || !write_octet(operation))
+		return 0;
+
+	if (operation == LOGIC_WRITE && !write_short((word << 1) & 0x7ffe))
+		return 0;
+
+	if (!wait_for_ack())
+		return 0;
+
+	count = read_octet();
+	if (count < 1 || count > LOGIC_MAX_SAMPLES)
+	{
+		printf("Bad logic capture sample count %d\n", count);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		c = read_octet();
+		if (c < 0)
+		{
+			printf("Timeout reading logic capture\n");
+			return 0;
+		}
+
+		trace->samples[i] = c;
+	}
+
+	trace->period = period;
+	trace->count = count;
+
+	return 1;
+}
+
+void print_logic_trace(const struct logic_trace *trace)
+{
+	int time = 0;
+	int duration;
+	int state;
+	int idle = 0;
+	int longest_idle = 0;
+	int i;
+
+	printf("    time  duration  VPP nVDD CLOCK DATA\n");
+	i = 0;
+	while (i < trace->count)
+	{
+		// Merge runs of the same state, which are split when they are too
+		// long for one sample.
+		state = trace->samples[i] & 0xf0;
+		duration = 0;
+		while (i < trace->count && (trace->samples[i] & 0xf0) == state)
+			duration += ((trace->samples[i++] & 0x0f) + 1) * trace->period;
+
+		printf("%6d us %6d us   %d    %d    %d     %d\n", time, duration,
+			(state & PIN_VPP) != 0, (state & PIN_NVDD) != 0, (state & PIN_CLOCK) != 0,
+			(state & PIN_DATA) != 0);
+
+		if (state & PIN_CLOCK)
+			idle = 0;
+		else
+		{
+			idle += duration;
+			if (idle > longest_idle)
+				longest_idle = idle;
+		}
+
+		time += duration;
+	}
+
+	// Times are only known to within a sample period
+	printf("longest time with the clock idle: %d-%d us\n",
+		longest_idle > trace->period ? longest_idle - trace->period : 0,
+		longest_idle + trace->period);
+	if (trace->count == LOGIC_MAX_SAMPLES)
+		printf("The capture buffer filled, so the end of the operation may be missing\n");
+}
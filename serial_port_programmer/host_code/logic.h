@@ -0,0 +1,51 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+//
+// Logic capture: the programmer samples its own pins while doing one
+// operation on the target, to show the timing it really produces.
+//
+
+#ifndef __LOGIC_H
+#define __LOGIC_H
+
+#define LOGIC_MAX_SAMPLES 80
+#define LOGIC_MIN_PERIOD 50		// microseconds
+
+// Operations that can be captured
+#define LOGIC_ERASE 'E'
+#define LOGIC_READ 'R'
+#define LOGIC_WRITE 'W'
+
+struct logic_trace
+{
+	int period;		// Microseconds per sample period
+	int count;
+	unsigned char samples[LOGIC_MAX_SAMPLES];	// Run length encoded, see programmer.asm
+};
+
+/// Do an operation on the target while sampling the programmer's pins.  The
+/// programmer must be in raw mode and programming mode.  word is only used
+/// by LOGIC_WRITE, which writes it at the current address.
+/// @returns
+///   - 1 on success
+///   - 0 if an error occured
+int capture_logic(int operation, int word, int period, struct logic_trace *trace);
+
+/// Print the pin states in a trace over time, and the longest time the clock
+/// was idle, which is the longest wait (such as Tprog or Tera) in it.
+void print_logic_trace(const struct logic_trace *trace);
+
+#endif
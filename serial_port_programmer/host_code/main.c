@@ -14,374 +14,443 @@
 // limitations under the License.
 // 
 
-#include "serial.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "serial.h"
+#include "image.h"
+#include "protocol.h"
+#include "device.h"
+#include "batch.h"
+#include "metrics.h"
+#include "capture.h"
+#include "logic.h"
+#include "pic18.h"
+#include "link.h"
+#ifndef _WIN32
+#include "daemon.h"
+#include "hexstream.h"
+#include "discover.h"
+#endif
+
+static struct image program_data;
+static struct pic18_image pic18_program_data;
+#ifndef _WIN32
+static struct hex_stream program_stream_data;
+#endif
+
+// Report whether the target is blank, without programming it
+static int check_target_blank(const struct program_options *options)
+{
+	int first_used;
 
-#define PROGRESS_BAR_WIDTH 60
-#define MAX_PROGRAM_SIZE 0x2000
-#define EXPECTED_PROTOCOL_VERSION 1
+	if (!write_octet('P') || !wait_for_ack())
+		return 0;
 
-/// Write an 8 bit value to the port
-/// @returns
-///   - 1 if the octet was written successfully
-///   - 0 if the octet was not written successfully
-///
-/// This will print an error message if an error occurs
-int write_octet(int value)
-{
-	int result = write_serial(value & 0xff);
-	if (result == -1)
+	if (!check_blank(target_program_words(options), &first_used))
+		return 0;
+
+	if (!write_octet('X') || !wait_for_ack())
+		return 0;
+
+	if (first_used >= 0)
 	{
-		printf("\nCan't write to serial device (OS returned error)\n");
+		printf("Target is not blank, first used word is %04x\n", first_used);
 		return 0;
 	}
-	else if (result == -2)
+
+	printf("Target is blank\n");
+	return 1;
+}
+
+// Sample the programmer's pins while it erases the target, or reads or
+// writes the word at address 0, and print the timing.  spec is "erase",
+// "read" or "write=<hex word>", optionally followed by "@<sample period in
+// us>".
+static int capture_pins(const char *spec, const struct program_options *options)
+{
+	struct logic_trace trace;
+	const char *period;
+	int operation;
+	int word = 0;
+	int result;
+
+	if (strncmp(spec, "erase", 5) == 0)
+		operation = LOGIC_ERASE;
+	else if (strncmp(spec, "read", 4) == 0)
+		operation = LOGIC_READ;
+	else if (strncmp(spec, "write=", 6) == 0)
 	{
-		printf("\nA timeout occured trying to write the the programmer\n");
-		return 0;
+		operation = LOGIC_WRITE;
+		word = strtol(spec + 6, NULL, 16);
 	}
-	else if (result != 0)
+	else
 	{
-		printf("\nreceived unexpected result writing to programmer (bug in serial shim code)\n");
+		printf("unknown operation to capture %s\n", spec);
 		return 0;
 	}
 
-	return 1;
+	period = strchr(spec, '@');
+
+	// Capture with the timing being tuned
+	if (options->profile != NULL && !set_timing(options->profile))
+		return 0;
+
+	if (!write_octet('P') || !wait_for_ack())
+		return 0;
+
+	result = capture_logic(operation, word,
+		period != NULL ? atoi(period + 1) : LOGIC_MIN_PERIOD, &trace);
+
+	if (!write_octet('X') || !wait_for_ack())
+		return 0;
+
+	if (result)
+		print_logic_trace(&trace);
 
+	return result;
 }
 
-/// Write a 16 bit value to the port, in bigendian format
-/// @returns
-///   - 1 if the short was written successfully
-///   - 0 if the short was not written successfully
-///
-/// This will print an error message if an error occurs
-int write_short(int value)
+// PIC18 targets have their own image layout and commands (see pic18.c)
+static int program_pic18_file(const char *filename, const struct program_options *options,
+	int verify_only, int report_all)
 {
-	if (!write_octet(value >> 8))
+	if (load_pic18_image(filename, &pic18_program_data) < 0)
 		return 0;
 
-	return write_octet(value);
+	printf("%d bytes\n", pic18_program_data.program_size);
+
+	if (verify_only)
+		return verify_pic18_image(&pic18_program_data, options, report_all);
+
+	return program_pic18_image(&pic18_program_data, options);
 }
 
-/// @returns
-///   - 1 if the ack was retruned successfully
-///   - 0 if an error occured
-///
-///  This function will print an error message if an error occurs
-int wait_for_ack()
+#ifndef _WIN32
+// Program from a hex file that may still be being written, such as a pipe
+// from a build.  Reads stdin if there is no filename.
+static int stream_program(const char *port_name, const char *filename,
+	const struct program_options *options, int retune)
 {
-	int c = read_serial();
+	FILE *file = stdin;
+	int result;
 
-	if (c == '+')
-		return 1;	// Success
-	else if (c == -1)
-	{
-		printf("\nThe serial device is not communicating\n");
-		return 0;
-	}
-	else if (c == -2)
+	if (filename != NULL)
 	{
-		printf("\nTimeout waiting for programmer response\n");
-		return 0;
-	}
-	else if (c == 'E')
-	{
-		int error = read_serial();
-		if (error == -1)
-		{
-			printf("\nThe serial device is not communicating\n");
-			return 0;
-		}
-		else if (error == -2)
+		file = fopen(filename, "r");
+		if (file == NULL)
 		{
-			printf("\nTimeout waiting for programmer response\n");
-			return 0;
+			perror("error opening file");
+			return 1;
 		}
+	}
 
-		switch (error)
-		{
-			case '1':
-				printf("\nProgrammer has reported an overflow error\n");
-				break;
-
-			case '2':
-				printf("\nProgrammer has reported a framing error\n");
-				break;
-
-			case '3':
-				printf("\nProgrammer has reported that verification has failed\n");
-
-				// Get word that was read back
-				int msb = read_serial();
-				int lsb = read_serial();
+	if (open_serial(port_name) < 0)
+		return 1;
 
-				printf("got 0x%02x%02x\n", msb, lsb);
+	if (!check_protocol_version() || !open_link(port_name, retune))
+		return 1;
 
-				break;
+	atexit(close_link);
+	if (hex_stream_start(&program_stream_data, file) < 0)
+		return 1;
 
-			case '4':
-				printf("\nProgrammer has reported that a command is not understood\n");
-				break;
-		}
+	result = program_stream(&program_stream_data.source, options);
+	if (result)
+		hex_stream_finish(&program_stream_data);
 
-		return 0;
-	}
-	else
-	{
-		printf("\nReceived unrecognized error from programmer: %c\n", c);
-		return 0;
-	}
+	return result ? 0 : 1;
 }
+#endif
 
 ///
-/// Draw an ascii progress bar.
+/// In USB mode, show what the acks actually took, which is what coalescing
+/// and the low latency setting are meant to bring down.
 ///
-static void draw_progress_bar(int current, int max, const char *prefix)
+static void report_ack_latency()
 {
-	int i;
-	int dotCount;
-
-	printf("\r%s [", prefix);
-
-	dotCount = PROGRESS_BAR_WIDTH * current / max;
-
-	for (i = 0; i < dotCount; i++)
-		printf(".");
-
-	for (; i < PROGRESS_BAR_WIDTH; i++)
-		printf(" ");
+	unsigned long count;
+	double total;
 
-	printf("]");
-	fflush(stdout);
+	metrics_get_ack_latency(&count, &total);
+	if (count > 0)
+		printf("%lu acks, %.2f ms each on average\n", count, total * 1000 / count);
 }
 
 ///
-/// Read Intel HEX format file
+/// Print where the programmer's time went since the session started, and
+/// whether the link, the programming waits or the firmware itself took most
+/// of it.
 ///
-/// each line is:
-/// :aabbbbccdddddddd...dddee
-/// where a is the length of the line (hex)
-/// b is the address
-/// c is the record type
-///   00 data
-///   01 end of file
-/// d is the data for the line
-/// e is the checksum, the 2's complement sum of of the other bytes in the line
-static int read_hex_file(const char *filename, char *array, int *outMaxAddress)
+static void report_programmer_profile()
 {
-	FILE *f;
-	int dataLength;
-	int address;
-	int recordType;
-	int checksum;
-	int computedChecksum;
-	int datum;
+	static const char *phase_names[PROGRAMMER_PHASE_COUNT] =
+	{
+		"other firmware work", "waiting for the host", "clocking the target",
+		"sending to the host", "programming waits"
+	};
+	int milliseconds[PROGRAMMER_PHASE_COUNT];
+	int link;
+	int firmware;
+	int total = 0;
 	int i;
-	char data[128];
-	int line;
-	int result = 0;
 
-	f = fopen(filename, "r");
-	if (f == NULL) {
-		perror("error opening file");
+	if (!read_programmer_profile(milliseconds))
+		return;
+
+	for (i = 0; i < PROGRAMMER_PHASE_COUNT; i++)
+		total += milliseconds[i];
+
+	if (total == 0)
 		return;
+
+	printf("Programmer time: %d ms\n", total);
+	for (i = 0; i < PROGRAMMER_PHASE_COUNT; i++)
+	{
+		printf("  %-22s %6d ms %3d%%\n", phase_names[i], milliseconds[i],
+			milliseconds[i] * 100 / total);
 	}
 
-	*outMaxAddress = 0;
+	link = milliseconds[PROGRAMMER_HOST_WAIT] + milliseconds[PROGRAMMER_HOST_SEND];
+	firmware = milliseconds[PROGRAMMER_OTHER] + milliseconds[PROGRAMMER_TARGET];
+	if (link >= firmware && link >= milliseconds[PROGRAMMER_DELAY])
+		printf("Most of it was spent on the link to the host\n");
+	else if (milliseconds[PROGRAMMER_DELAY] >= firmware)
+		printf("Most of it was spent in programming waits\n");
+	else
+		printf("Most of it was spent in the firmware\n");
+}
 
-	for (line = 1; ; line++) {
-		if (fscanf(f, ":%02x%04x%02x", &dataLength, &address, &recordType) < 0) {
-			fprintf(stderr, "premature end of file\n");
-			result = -1;
-			break;
-		}
+static void usage()
+{
+	printf("usage: programmer [-p port] [-u] [-L] [-y] [-t device] [-f] [-b | -g targets] [-m metrics.prom] [-c capture] <image file>\n");
+	printf("       programmer [-p port] [-f] -v [-a] <image file>\n");
+	printf("       programmer [-p port] -b\n");
+	printf("       programmer [-p port] [-t device] -l erase|read|write=<word>[@period]\n");
+	printf("       programmer [-p port] [-t device] [-f] [-b] -n <patches.csv|-> <template image>\n");
+#ifndef _WIN32
+	printf("       programmer [-p port] [-t device] [-f] [-b] -s [file.hex]\n");
+	printf("       programmer [-m metrics.prom] -d <socket path>\n");
+	printf("       programmer -P\n");
+#endif
+	printf("-v compares the target with the file without programming it, -a reports every word that differs\n");
+	printf("Image files may be Intel HEX, ELF, Microchip COFF or a raw binary\n");
+#ifndef _WIN32
+	printf("-p also takes sn:<USB serial number> or auto, and -P lists the programmers attached\n");
+#endif
+	printf("-u tunes the link to the programmer again, rather than using what was found last time\n");
+	printf("-L batches writes into USB packets and asks a USB serial adapter for low latency\n");
+	printf("-y prints where the programmer's time went at the end\n");
+	printf("-g rb0,rb3,... also programs the targets with data lines on those pins, and can't be used with -b or -v\n");
+	printf("-m writes Prometheus metrics for each programming session to a file\n");
+	printf("-c records everything sent to and received from the programmer, for serial_replay.c\n");
+	printf("devices for -t:\n");
+	list_device_profiles();
+}
 
-		computedChecksum = dataLength + (address >> 8) + (address & 0xff) + recordType;
+int main(int argc, const char *argv[])
+{
+	const char *port_name = NULL;
+	const char *filename = NULL;
+	const char *socket_path = NULL;
+	struct program_options options;
+	int stream = 0;
+	const char *patch_path = NULL;
+	const char *logic_spec = NULL;
+	int verify_only = 0;
+	int report_all = 0;
+	int list_ports = 0;
+	int retune = 0;
+	int usb_mode = 0;
+	int profile = 0;
+	int profile_counts[PROGRAMMER_PHASE_COUNT];
+	FILE *patches;
+	int failures;
+	int i;
 
-		if (address + dataLength > *outMaxAddress && address < 0x4000)
-			*outMaxAddress = address + dataLength;
+	options.show_progress = 1;
+	options.run_after = 1;
+	options.framed = 0;
+	options.blank_check = 0;
+	options.profile = NULL;
+	options.gang_targets = 0;
 
-		for (i = 0; i < dataLength; i++) {
-			if (fscanf(f, "%02x", &datum) < 0) {
-				fprintf(stderr, "premature end of file\n");
-				result = -1;
-				goto done;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			port_name = argv[++i];
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			socket_path = argv[++i];
+		else if (strcmp(argv[i], "-f") == 0)
+			options.framed = 1;
+		else if (strcmp(argv[i], "-b") == 0)
+			options.blank_check = 1;
+		else if (strcmp(argv[i], "-s") == 0)
+			stream = 1;
+		else if (strcmp(argv[i], "-v") == 0)
+			verify_only = 1;
+		else if (strcmp(argv[i], "-a") == 0)
+			report_all = 1;
+		else if (strcmp(argv[i], "-P") == 0)
+			list_ports = 1;
+		else if (strcmp(argv[i], "-u") == 0)
+			retune = 1;
+		else if (strcmp(argv[i], "-L") == 0)
+			usb_mode = 1;
+		else if (strcmp(argv[i], "-y") == 0)
+			profile = 1;
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			patch_path = argv[++i];
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+			logic_spec = argv[++i];
+		else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+		{
+			options.gang_targets = parse_gang_targets(argv[++i]);
+			if (options.gang_targets <= 0)
+			{
+				printf("bad gang target list %s\n", argv[i]);
+				usage();
+				return 1;
 			}
-
-			array[address + i] = (char) datum;
-			computedChecksum += datum;
 		}
-
-		if (fscanf(f, "%02x\n", &checksum) < 0) {
-			fprintf(stderr, "premature end of file\n");
-			result = -1;
-			break;
+		else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			metrics_set_output(argv[++i]);
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+		{
+			if (capture_open(argv[++i]) < 0)
+				return 1;
 		}
-
-		computedChecksum = (1 + ~(computedChecksum & 0xff)) & 0xff;
-
-		if (checksum != computedChecksum) {
-			fprintf(stderr, "checksum mismatch on line %d (file %02x computed %02x)\n", line, checksum, computedChecksum);
-			result = -1;
-			break;
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+		{
+			options.profile = find_device_profile(argv[++i]);
+			if (options.profile == NULL)
+			{
+				printf("unknown device %s\n", argv[i]);
+				usage();
+				return 1;
+			}
+		}
+		else if (argv[i][0] != '-' && filename == NULL)
+			filename = argv[i];
+		else
+		{
+			usage();
+			return 1;
 		}
-
-		if (recordType == 1)
-			break;
 	}
 
-done:
-	fclose(f);
-
-	return result;
-}
+	metrics_select_port(port_name != NULL ? port_name : "default");
+	set_serial_usb_mode(usb_mode);
+	if (usb_mode && socket_path == NULL)
+		atexit(report_ack_latency);
 
-int main(int argc, const char *argv[])
-{
-	int i;
-	int got_checksum;
-	int computed_checksum_hi;
-	int computed_checksum_lo;
-	int version;
-	unsigned char program_data[MAX_PROGRAM_SIZE * 2 + 16];
-	int instruction_count;
-	int config_word;
-
-	if (argc != 2) {
-		printf("enter a filename\n");
+	if (socket_path != NULL)
+	{
+#ifndef _WIN32
+		return run_daemon(socket_path);
+#else
+		printf("daemon mode is not supported on this platform\n");
 		return 1;
+#endif
 	}
 
-	if (!init_serial())
-		return 1;
+#ifndef _WIN32
+	if (list_ports)
+		return list_programmers() ? 0 : 1;
 
-	if (!write_octet('V'))
+	if (port_name != NULL && (port_name = resolve_port(port_name)) == NULL)
 		return 1;
-
-	version = read_serial();
-	if (version == -1)
+#else
+	if (list_ports)
 	{
-		printf("Cannot communicate with serial device driver\n");
+		printf("listing programmers is not supported on this platform\n");
 		return 1;
 	}
-	else if (version == -2)
+#endif
+
+	if (options.profile != NULL && options.profile->family == FAMILY_PIC18
+		&& (stream || patch_path != NULL || options.blank_check || options.gang_targets != 0
+		|| logic_spec != NULL || filename == NULL))
 	{
-		printf("Programmer is not responding\n");
+		printf("pic%s only supports programming or verifying a file\n", options.profile->name);
 		return 1;
 	}
-	else if (version < 0)
+
+	// Reading back, for a verify or a blank check, only sees the first target
+	if (options.gang_targets != 0 && (verify_only || options.blank_check || filename == NULL))
 	{
-		printf("received unexpected result writing to programmer (bug in serial shim code)\n");
+		printf("gang mode can't verify or blank check the other targets\n");
 		return 1;
 	}
 
-	if (version != EXPECTED_PROTOCOL_VERSION)
+	if (stream)
 	{
-		printf("Programmer uses a different protocol version.  Cannot communicate\n");
+#ifndef _WIN32
+		return stream_program(port_name, filename, &options, retune);
+#else
+		printf("streaming is not supported on this platform\n");
 		return 1;
+#endif
 	}
 
-	memset(program_data, 0xff, sizeof(program_data));
-	if (read_hex_file(argv[1], program_data, &instruction_count) < 0)
-		return 1;
-
-	instruction_count /= 2;	// Returned value was max address.  Divide by two to get count.
-	printf("%d instructions\n", instruction_count);
-
-	// Enter programming mode
-	if (!write_octet('P'))
-		return 1;
-
-	if (!wait_for_ack())
-		return 1;
-
-	// Erase flash
-	if (!write_octet('E'))
-		return 1;
-
-	if (!wait_for_ack())
-		return 1;
-
-	computed_checksum_hi = 0;
-	computed_checksum_lo = 0;
-	if (!write_octet('W'))
+	if (filename == NULL && !options.blank_check && logic_spec == NULL)
+	{
+		printf("enter a filename\n");
 		return 1;
+	}
 
-	if (!write_short(instruction_count))	// Number of program words to write
+	if (open_serial(port_name) < 0)
 		return 1;
 
-	if (!wait_for_ack())
+	if (!check_protocol_version() || !open_link(port_name, retune))
 		return 1;
 
-	for (i = 0; i < instruction_count; i++)
+	atexit(close_link);
+	if (profile)
 	{
-		draw_progress_bar(i + 1, instruction_count, "Programming");
-
-		// The program words here are 14 bits LSB justified, but must be written
-		// to the device with a zero bit as padding on each end.  Also, the bytes in the file
-		// are little endian, so they need to be swapped before writing out to the
-		// file
-		int instruction = ((program_data[i * 2 + 1] << 8) | program_data[i * 2]) << 1;
-		if (!write_short(instruction))
-			return 1;
-
-		if (!wait_for_ack())
-		{
-			printf("writing instruction @ %d (%04x)\n", i, instruction);
+		// Start the counts from here
+		if (!read_programmer_profile(profile_counts))
 			return 1;
-		}
 
-		computed_checksum_lo = (computed_checksum_lo + ((instruction >> 8) & 0xff)) & 0xff;
-		computed_checksum_hi = (computed_checksum_hi + computed_checksum_lo) & 0xff;
-		computed_checksum_lo = (computed_checksum_lo + (instruction & 0xff)) & 0xff;
-		computed_checksum_hi = (computed_checksum_hi + computed_checksum_lo) & 0xff;
+		atexit(report_programmer_profile);
 	}
 
-	if (read_serial() != 'D')
-	{
-		printf("Unexpected response waiting for checksum\n");
-		return 1;
-	}
-
-	got_checksum = (read_serial() << 8) & 0xff00;
-	got_checksum |= read_serial() & 0xff;
-
-	if (((computed_checksum_hi << 8) | computed_checksum_lo) != got_checksum)
-	{
-		printf("Checksum mismatch.  Data was corrupted while being transferred\n");
-		return 1;
-	}
+	if (logic_spec != NULL)
+		return capture_pins(logic_spec, &options) ? 0 : 1;
 
-	if (!write_octet('C'))
-		return 1;
+	if (filename == NULL)
+		return check_target_blank(&options) ? 0 : 1;
 
-	config_word = (program_data[0x400f] << 8) | program_data[0x400e];
+	if (options.profile != NULL && options.profile->family == FAMILY_PIC18)
+		return program_pic18_file(filename, &options, verify_only, report_all) ? 0 : 1;
 
-	// Write configuration word
-	if (!write_short(config_word << 1))
+	if (load_image(filename, &program_data) < 0)
 		return 1;
 
-	if (!wait_for_ack())
+	if (patch_path != NULL)
 	{
-		printf("Writing configuration word\n");
-		return 1;
-	}
-
-	// Exit programming mode
-	if (!write_octet('X'))
-		return 1;
+		if (strcmp(patch_path, "-") == 0)
+			patches = stdin;
+		else if ((patches = fopen(patch_path, "r")) == NULL)
+		{
+			perror("error opening patch file");
+			return 1;
+		}
 
-	if (!wait_for_ack())
-		return 1;
+		options.show_progress = 0;
+		failures = run_batch(&program_data, patches, stdout, &options);
+		printf("%d units failed\n", failures);
+		return failures ? 1 : 0;
+	}
 
-	printf("\nFlash programmed.\n");
+	printf("%d instructions\n", program_data.instruction_count);
+	if (program_data.data_size > 0)
+		printf("%d bytes of EEPROM data\n", program_data.data_size);
 
-	// Turn on chip
-	write_octet('I');
-	write_octet('2');
+	if (verify_only)
+		return verify_image(&program_data, &options, report_all) ? 0 : 1;
 
-	if (!wait_for_ack())
+	if (!program_image(&program_data, &options))
 		return 1;
 
 	return 0;
@@ -0,0 +1,314 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "metrics.h"
+
+#define MAX_METRICS_PORTS 16
+#define MAX_PORT_NAME 64
+#define ERROR_CODE_COUNT 5
+
+// Upper bounds of the ack latency histogram buckets, in seconds.  There is
+// also an implied +Inf bucket.
+static const double latency_bounds[] =
+{
+	0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0
+};
+
+#define LATENCY_BUCKETS (sizeof(latency_bounds) / sizeof(latency_bounds[0]))
+
+struct port_metrics
+{
+	char port[MAX_PORT_NAME];
+	unsigned long sessions;
+	unsigned long failures;
+	unsigned long bytes_sent;
+	unsigned long bytes_received;
+	unsigned long errors[ERROR_CODE_COUNT];
+	unsigned long retransmits;
+	unsigned long resumes;
+	unsigned long latency_buckets[LATENCY_BUCKETS + 1];
+	unsigned long latency_count;
+	double latency_sum;
+	double phase_seconds[PHASE_COUNT];
+};
+
+static const char *phase_names[PHASE_COUNT] =
+{
+	"setup", "blank_check", "erase", "write", "config", "verify"
+};
+
+static struct port_metrics ports[MAX_METRICS_PORTS];
+static int port_count = 0;
+static struct port_metrics *current = NULL;
+static const char *output_path = NULL;
+static int current_phase = -1;
+static double phase_start;
+
+void metrics_set_output(const char *path)
+{
+	output_path = path;
+}
+
+void metrics_select_port(const char *port_name)
+{
+	int i;
+
+	for (i = 0; i < port_count; i++)
+	{
+		if (strcmp(ports[i].port, port_name) == 0)
+		{
+			current = &ports[i];
+			return;
+		}
+	}
+
+	if (port_count == MAX_METRICS_PORTS)
+	{
+		current = NULL;	// Not tracked
+		return;
+	}
+
+	current = &ports[port_count++];
+	memset(current, 0, sizeof(*current));
+	strncpy(current->port, port_name, MAX_PORT_NAME - 1);
+}
+
+double metrics_now()
+{
+#ifdef _WIN32
+	LARGE_INTEGER count;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double) count.QuadPart / frequency.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+void metrics_count_sent(int bytes)
+{
+	if (current != NULL)
+		current->bytes_sent += bytes;
+}
+
+void metrics_count_received(int bytes)
+{
+	if (current != NULL)
+		current->bytes_received += bytes;
+}
+
+void metrics_count_error(int code)
+{
+	if (current != NULL && code >= '1' && code < '1' + ERROR_CODE_COUNT)
+		current->errors[code - '1']++;
+}
+
+void metrics_count_retransmit()
+{
+	if (current != NULL)
+		current->retransmits++;
+}
+
+void metrics_count_resume()
+{
+	if (current != NULL)
+		current->resumes++;
+}
+
+void metrics_get_link_counts(unsigned long *bytes_sent, unsigned long *errors)
+{
+	*bytes_sent = 0;
+	*errors = 0;
+	if (current == NULL)
+		return;
+
+	*bytes_sent = current->bytes_sent;
+	*errors = current->retransmits + current->resumes
+		+ current->errors[0] + current->errors[1];	// '1' overflow, '2' framing
+}
+
+void metrics_record_ack_latency(double seconds)
+{
+	unsigned int bucket;
+
+	if (current == NULL)
+		return;
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		if (seconds <= latency_bounds[bucket])
+			break;
+	}
+
+	current->latency_buckets[bucket]++;
+	current->latency_count++;
+	current->latency_sum += seconds;
+}
+
+void metrics_get_ack_latency(unsigned long *count, double *total_seconds)
+{
+	*count = 0;
+	*total_seconds = 0;
+	if (current == NULL)
+		return;
+
+	*count = current->latency_count;
+	*total_seconds = current->latency_sum;
+}
+
+void metrics_begin_phase(enum metrics_phase phase)
+{
+	double now = metrics_now();
+
+	if (current != NULL && current_phase >= 0)
+		current->phase_seconds[current_phase] += now - phase_start;
+
+	current_phase = phase;
+	phase_start = now;
+}
+
+///
+/// Write a counter with one value per port.  offset is the offset of the
+/// value in struct port_metrics.
+///
+static void write_counter(FILE *f, const char *name, const char *help, size_t offset)
+{
+	int i;
+
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s counter\n", name);
+	for (i = 0; i < port_count; i++)
+	{
+		fprintf(f, "%s{port=\"%s\"} %lu\n", name, ports[i].port,
+			*(const unsigned long*) ((const char*) &ports[i] + offset));
+	}
+}
+
+static void write_metrics(FILE *f)
+{
+	unsigned long cumulative;
+	unsigned int bucket;
+	int i;
+	int j;
+
+	write_counter(f, "programmer_sessions_total", "Programming sessions",
+		offsetof(struct port_metrics, sessions));
+	write_counter(f, "programmer_session_failures_total", "Programming sessions that failed",
+		offsetof(struct port_metrics, failures));
+	write_counter(f, "programmer_bytes_sent_total", "Bytes sent to the programmer",
+		offsetof(struct port_metrics, bytes_sent));
+	write_counter(f, "programmer_bytes_received_total", "Bytes received from the programmer",
+		offsetof(struct port_metrics, bytes_received));
+	write_counter(f, "programmer_frame_retransmits_total", "Frames sent again in framed mode",
+		offsetof(struct port_metrics, retransmits));
+	write_counter(f, "programmer_resumes_total", "Writes resumed after an error",
+		offsetof(struct port_metrics, resumes));
+
+	fprintf(f, "# HELP programmer_errors_total Errors reported by the programmer\n");
+	fprintf(f, "# TYPE programmer_errors_total counter\n");
+	for (i = 0; i < port_count; i++)
+	{
+		for (j = 0; j < ERROR_CODE_COUNT; j++)
+		{
+			fprintf(f, "programmer_errors_total{port=\"%s\",code=\"E%d\"} %lu\n",
+				ports[i].port, j + 1, ports[i].errors[j]);
+		}
+	}
+
+	fprintf(f, "# HELP programmer_phase_seconds_total Time spent in each phase of programming\n");
+	fprintf(f, "# TYPE programmer_phase_seconds_total counter\n");
+	for (i = 0; i < port_count; i++)
+	{
+		for (j = 0; j < PHASE_COUNT; j++)
+		{
+			fprintf(f, "programmer_phase_seconds_total{port=\"%s\",phase=\"%s\"} %.6f\n",
+				ports[i].port, phase_names[j], ports[i].phase_seconds[j]);
+		}
+	}
+
+	fprintf(f, "# HELP programmer_ack_latency_seconds Time from sending a command to its ack\n");
+	fprintf(f, "# TYPE programmer_ack_latency_seconds histogram\n");
+	for (i = 0; i < port_count; i++)
+	{
+		cumulative = 0;
+		for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+		{
+			cumulative += ports[i].latency_buckets[bucket];
+			fprintf(f, "programmer_ack_latency_seconds_bucket{port=\"%s\",le=\"%g\"} %lu\n",
+				ports[i].port, latency_bounds[bucket], cumulative);
+		}
+
+		fprintf(f, "programmer_ack_latency_seconds_bucket{port=\"%s\",le=\"+Inf\"} %lu\n",
+			ports[i].port, ports[i].latency_count);
+		fprintf(f, "programmer_ack_latency_seconds_sum{port=\"%s\"} %.6f\n",
+			ports[i].port, ports[i].latency_sum);
+		fprintf(f, "programmer_ack_latency_seconds_count{port=\"%s\"} %lu\n",
+			ports[i].port, ports[i].latency_count);
+	}
+}
+
+void metrics_end_session(int success)
+{
+	char temp_path[1024];
+	FILE *f;
+
+	// Charge the time since the last phase started
+	if (current_phase >= 0)
+	{
+		metrics_begin_phase(0);
+		current_phase = -1;
+	}
+
+	if (current != NULL)
+	{
+		current->sessions++;
+		if (!success)
+			current->failures++;
+	}
+
+	if (output_path == NULL)
+		return;
+
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", output_path);
+	f = fopen(temp_path, "w");
+	if (f == NULL)
+	{
+		perror("error writing metrics");
+		return;
+	}
+
+	write_metrics(f);
+	fclose(f);
+
+#ifdef _WIN32
+	remove(output_path);	// rename won't replace a file on Windows
+#endif
+	if (rename(temp_path, output_path) != 0)
+		perror("error writing metrics");
+}
@@ -0,0 +1,68 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// Per-port programming metrics, written out in the Prometheus text format
+// so a node_exporter textfile collector can pick them up.
+//
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+enum metrics_phase
+{
+	PHASE_SETUP,		// Timing and entering programming mode
+	PHASE_BLANK_CHECK,
+	PHASE_ERASE,
+	PHASE_WRITE,
+	PHASE_CONFIG,		// ID locations, configuration word, and exit
+	PHASE_VERIFY,		// Reading back for a verify without programming
+	PHASE_COUNT
+};
+
+/// Write metrics to this file after every programming session.  The file is
+/// replaced atomically, so a collector never sees it half written.
+void metrics_set_output(const char *path);
+
+/// Attribute the following activity to a port
+void metrics_select_port(const char *port_name);
+
+/// @returns a monotonic time in seconds
+double metrics_now();
+
+void metrics_count_sent(int bytes);
+void metrics_count_received(int bytes);
+void metrics_count_error(int code);	// '1' - '5', as sent after 'E'
+void metrics_count_retransmit();
+void metrics_count_resume();
+void metrics_record_ack_latency(double seconds);
+
+/// Get the bytes sent to the current port so far, and the errors that point
+/// at a bad link: retransmits, resumes, and overflow and framing errors
+/// reported by the programmer.  Both are 0 if the port isn't tracked.
+void metrics_get_link_counts(unsigned long *bytes_sent, unsigned long *errors);
+
+/// Get the acks recorded for the current port so far and their total latency
+/// in seconds.  Both are 0 if the port isn't tracked.
+void metrics_get_ack_latency(unsigned long *count, double *total_seconds);
+
+/// Time is charged to the current phase until the next call
+void metrics_begin_phase(enum metrics_phase phase);
+
+/// Close out a session and write the output file, if there is one
+void metrics_end_session(int success);
+
+#endif
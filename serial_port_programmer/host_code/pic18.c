@@ -0,0 +1,413 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <string.h>
+#include "pic18.h"
+#include "image.h"
+#include "metrics.h"
+
+// Bytes read back per 'Z R' when verifying.  The response fits in a frame.
+// In raw mode, two reads are kept outstanding, as in verify_image.
+#define READ_CHUNK 32
+#define RAW_READ_WINDOW (READ_CHUNK * 2)
+
+static void store_byte(void *context, unsigned long address, int value)
+{
+	struct pic18_image *image = context;
+
+	if (address < PIC18_MAX_PROGRAM_SIZE)
+	{
+		image->program[address] = value;
+		if ((int) address >= image->program_size)
+			image->program_size = address + 1;
+	}
+	else if (address - PIC18_ID_ADDRESS < PIC18_ID_SIZE)
+	{
+		image->id[address - PIC18_ID_ADDRESS] = value;
+		image->has_id = 1;
+	}
+	else if (address - PIC18_CONFIG_ADDRESS < PIC18_CONFIG_SIZE)
+	{
+		image->config[address - PIC18_CONFIG_ADDRESS] = value;
+		image->config_set[address - PIC18_CONFIG_ADDRESS] = 1;
+	}
+}
+
+int load_pic18_image(const char *filename, struct pic18_image *image)
+{
+	memset(image->program, 0xff, sizeof(image->program));
+	memset(image->id, 0xff, sizeof(image->id));
+	memset(image->config_set, 0, sizeof(image->config_set));
+	image->program_size = 0;
+	image->has_id = 0;
+
+	if (read_image_records(filename, store_byte, image) < 0)
+		return -1;
+
+	// Program memory is written two bytes at a time
+	image->program_size = (image->program_size + 1) & ~1;
+
+	return 0;
+}
+
+///
+/// Point the programmer's table pointer at address, unless it is already
+/// there.  *table_pointer tracks where it is, or is -1 if that isn't known.
+///
+static int set_address(int address, int *table_pointer)
+{
+	if (*table_pointer == address)
+		return 1;
+
+	if (!write_octet('Z') || !write_octet('A'))
+		return 0;
+
+	if (!write_octet(address >> 16) || !write_octet(address >> 8) || !write_octet(address))
+		return 0;
+
+	if (!wait_for_ack())
+		return 0;
+
+	*table_pointer = address;
+	return 1;
+}
+
+static int write_block(int address, const unsigned char *data, int count, int *table_pointer)
+{
+	int i;
+
+	if (!set_address(address, table_pointer))
+		return 0;
+
+	if (!write_octet('Z') || !write_octet('W') || !write_octet(count))
+		return 0;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!write_octet(data[i]))
+			return 0;
+	}
+
+	if (!wait_for_ack())
+	{
+		printf("writing block @ %06x\n", address);
+		*table_pointer = -1;
+		return 0;
+	}
+
+	*table_pointer += count;
+	return 1;
+}
+
+static int is_blank(const unsigned char *data, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (data[i] != 0xff)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int program_pic18_session(const struct pic18_image *image,
+	const struct program_options *options)
+{
+	const struct device_profile *profile = options->profile;
+	struct device_profile config_timing;
+	int table_pointer = -1;
+	int block = profile->write_block;
+	int address;
+	int count;
+	int i;
+
+	if (image->program_size > profile->program_size)
+	{
+		printf("Image is %d bytes, but the pic%s only has %d\n", image->program_size,
+			profile->name, profile->program_size);
+		return 0;
+	}
+
+	if (!require_capability(CAP_PIC18, "Programming PIC18 targets") || !set_timing(profile))
+		return 0;
+
+	if (!write_octet('Z') || !write_octet('P') || !wait_for_ack())
+		return 0;
+
+	metrics_begin_phase(PHASE_ERASE);
+	if (!write_octet('Z') || !write_octet('E') || !wait_for_ack())
+		return 0;
+
+	metrics_begin_phase(PHASE_WRITE);
+	for (address = 0; address < image->program_size; address += block)
+	{
+		count = image->program_size - address;
+		if (count > block)
+			count = block;
+
+		if (options->show_progress)
+			draw_progress_bar(address + count, image->program_size, "Programming");
+
+		// Erased already
+		if (is_blank(image->program + address, count))
+			continue;
+
+		if (!write_block(address, image->program + address, count, &table_pointer))
+			return 0;
+	}
+
+	metrics_begin_phase(PHASE_CONFIG);
+	if (image->has_id
+		&& !write_block(PIC18_ID_ADDRESS, image->id, PIC18_ID_SIZE, &table_pointer))
+		return 0;
+
+	// Configuration bytes are written one at a time, and take longer
+	config_timing = *profile;
+	config_timing.program_time = profile->config_time;
+	if (!set_timing(&config_timing))
+		return 0;
+
+	for (i = 0; i < PIC18_CONFIG_SIZE; i++)
+	{
+		if (!image->config_set[i])
+			continue;
+
+		if (!set_address(PIC18_CONFIG_ADDRESS + i, &table_pointer))
+			return 0;
+
+		if (!write_octet('Z') || !write_octet('C') || !write_octet(image->config[i]))
+			return 0;
+
+		if (!wait_for_ack())
+		{
+			printf("Writing configuration byte %d\n", i);
+			return 0;
+		}
+
+		table_pointer++;
+	}
+
+	if (!write_octet('X') || !wait_for_ack())
+		return 0;
+
+	if (options->show_progress)
+		printf("\nFlash programmed.\n");
+
+	if (options->run_after)
+	{
+		if (!write_octet('I') || !write_octet('2') || !wait_for_ack())
+			return 0;
+	}
+
+	return 1;
+}
+
+int program_pic18_image(const struct pic18_image *image,
+	const struct program_options *options)
+{
+	int result;
+
+	if (options->gang_targets != 0)
+	{
+		printf("Gang mode is not supported for PIC18 targets\n");
+		return 0;
+	}
+
+	metrics_begin_phase(PHASE_SETUP);
+	if (options->framed && !set_framing(1))
+	{
+		metrics_end_session(0);
+		return 0;
+	}
+
+	result = program_pic18_session(image, options);
+	if (!set_framing(0))
+		result = 0;
+
+	metrics_end_session(result);
+	return result;
+}
+
+///
+/// Read back count bytes from address and compare them with expected as they
+/// arrive.  *mismatches is incremented for each byte that differs.
+///
+static int verify_region(int address, const unsigned char *expected, int count,
+	const struct program_options *options, int report_all, int *mismatches)
+{
+	int table_pointer = -1;
+	int requested = 0;
+	int received = 0;
+	int window;
+	int chunk;
+	int c;
+
+	if (!set_address(address, &table_pointer))
+		return 0;
+
+	window = options->framed ? READ_CHUNK : RAW_READ_WINDOW;
+	while (received < count)
+	{
+		while (requested < count && requested - received < window)
+		{
+			chunk = count - requested;
+			if (chunk > READ_CHUNK)
+				chunk = READ_CHUNK;
+
+			if (!write_octet('Z') || !write_octet('R') || !write_short(chunk))
+				return 0;
+
+			requested += chunk;
+		}
+
+		if (options->show_progress && address == 0)
+			draw_progress_bar(received + 1, count, "Verifying");
+
+		c = read_octet();
+		if (c < 0)
+		{
+			printf("\nError reading back from programmer (%d)\n", c);
+			return 0;
+		}
+
+		if (c != expected[received])
+		{
+			printf("\nbyte @ %06x reads back as %02x, expected %02x\n",
+				address + received, c, expected[received]);
+			(*mismatches)++;
+			if (!report_all)
+				break;
+		}
+
+		received++;
+	}
+
+	// Throw away the bytes that were already asked for
+	while (++received < requested)
+	{
+		if (read_octet() < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+///
+/// Read back the configuration bytes the image sets and compare them with it.
+/// Only the bits profile->config_mask says are implemented count, and
+/// *mismatches is incremented for each byte that differs in them.
+///
+static int verify_config(const struct pic18_image *image,
+	const struct device_profile *profile, int *mismatches)
+{
+	int table_pointer = -1;
+	int mask;
+	int i;
+	int c;
+
+	if (!set_address(PIC18_CONFIG_ADDRESS, &table_pointer))
+		return 0;
+
+	if (!write_octet('Z') || !write_octet('R') || !write_short(PIC18_CONFIG_SIZE))
+		return 0;
+
+	for (i = 0; i < PIC18_CONFIG_SIZE; i++)
+	{
+		c = read_octet();
+		if (c < 0)
+		{
+			printf("\nError reading back from programmer (%d)\n", c);
+			return 0;
+		}
+
+		mask = profile->config_mask != NULL ? profile->config_mask[i] : 0xff;
+		if (image->config_set[i] && ((c ^ image->config[i]) & mask) != 0)
+		{
+			printf("\nconfiguration byte @ %06x reads back as %02x, file has %02x\n",
+				PIC18_CONFIG_ADDRESS + i, c, image->config[i]);
+			(*mismatches)++;
+		}
+	}
+
+	return 1;
+}
+
+static int verify_pic18_session(const struct pic18_image *image,
+	const struct program_options *options, int report_all, int *mismatches)
+{
+	if (!require_capability(CAP_PIC18, "Verifying PIC18 targets"))
+		return 0;
+
+	if (!write_octet('Z') || !write_octet('P') || !wait_for_ack())
+		return 0;
+
+	metrics_begin_phase(PHASE_VERIFY);
+	if (!verify_region(0, image->program, image->program_size, options, report_all,
+		mismatches))
+		return 0;
+
+	if ((*mismatches == 0 || report_all) && image->has_id
+		&& !verify_region(PIC18_ID_ADDRESS, image->id, PIC18_ID_SIZE, options,
+		report_all, mismatches))
+		return 0;
+
+	if ((*mismatches == 0 || report_all) && !verify_config(image, options->profile, mismatches))
+		return 0;
+
+	if (!write_octet('X') || !wait_for_ack())
+		return 0;
+
+	if (options->run_after)
+	{
+		if (!write_octet('I') || !write_octet('2') || !wait_for_ack())
+			return 0;
+	}
+
+	return 1;
+}
+
+int verify_pic18_image(const struct pic18_image *image,
+	const struct program_options *options, int report_all)
+{
+	int mismatches = 0;
+	int result;
+
+	metrics_begin_phase(PHASE_SETUP);
+	if (options->framed && !set_framing(1))
+	{
+		metrics_end_session(0);
+		return 0;
+	}
+
+	result = verify_pic18_session(image, options, report_all, &mismatches);
+	if (!set_framing(0))
+		result = 0;
+
+	if (result && mismatches > 0)
+	{
+		printf("\n%d %s differ%s from the image\n", mismatches,
+			mismatches == 1 ? "byte" : "bytes", mismatches == 1 ? "s" : "");
+		result = 0;
+	}
+	else if (result && options->show_progress)
+		printf("\nTarget matches the image.\n");
+
+	metrics_end_session(result);
+	return result;
+}
@@ -0,0 +1,74 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// PIC18 (16 bit core) targets.  These have up to 128 KB of program memory,
+// so images use extended linear address records, and the ID locations and
+// configuration bytes are far above program memory.  Program memory is
+// written a write buffer at a time with the programmer's 'Z' commands (see
+// programmer.asm).
+//
+
+#ifndef __PIC18_H
+#define __PIC18_H
+
+#include "protocol.h"
+
+#define PIC18_MAX_PROGRAM_SIZE 0x20000	// Bytes
+#define PIC18_ID_ADDRESS 0x200000
+#define PIC18_ID_SIZE 8
+#define PIC18_CONFIG_ADDRESS 0x300000
+#define PIC18_CONFIG_SIZE 14
+
+struct pic18_image
+{
+	unsigned char program[PIC18_MAX_PROGRAM_SIZE];
+	int program_size;	// Bytes, up to the last one the file sets
+	unsigned char id[PIC18_ID_SIZE];
+	int has_id;			// The file sets the ID locations
+	unsigned char config[PIC18_CONFIG_SIZE];
+	unsigned char config_set[PIC18_CONFIG_SIZE];	// Bytes the file sets
+};
+
+/// Read an image file (see read_image_records) for a PIC18.  Bytes the file
+/// doesn't set are left erased (0xff).
+/// @returns
+///   - 0 if the file was read successfully
+///   - -1 if an error occured
+int load_pic18_image(const char *filename, struct pic18_image *image);
+
+/// Erase the target and write program memory, the ID locations and the
+/// configuration bytes the image sets.  options->profile must be a PIC18.
+/// Blocks that are blank in the image are skipped.
+/// @returns
+///   - 1 if the target was programmed successfully
+///   - 0 if an error occured
+///
+/// This will print an error message if an error occurs
+int program_pic18_image(const struct pic18_image *image,
+	const struct program_options *options);
+
+/// Compare program memory and the ID locations with the image without
+/// programming anything, like verify_image.  Configuration bytes are
+/// printed if they differ, but not counted, since unimplemented bits read
+/// back as 0.
+/// @returns
+///   - 1 if the target matches the image
+///   - 0 if it doesn't, or an error occured
+int verify_pic18_image(const struct pic18_image *image,
+	const struct program_options *options, int report_all);
+
+#endif
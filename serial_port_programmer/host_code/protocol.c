@@ -0,0 +1,1790 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "serial.h"
+#include "protocol.h"
+#include "metrics.h"
+
+#define PROGRESS_BAR_WIDTH 60
+#define MAX_RESUME_ATTEMPTS 3
+
+// Number of program words that may be sent ahead of their acks in raw mode,
+// until set_raw_window changes it
+#define RAW_WINDOW 16
+
+// Words kept for resending after a streamed write fails.  Must be larger than
+// any window, including RAW_WINDOW_MAX.
+#define STREAM_HISTORY 32
+
+// Ends a streamed write.  Program words never have the top bit set.
+#define STREAM_TERMINATOR 0x8000
+
+// Words read back per 'R' command when verifying.  The response fits in a
+// frame.  In raw mode, two commands are kept outstanding, so the programmer
+// always has the next one queued.
+#define VERIFY_CHUNK (FRAME_MAX_PAYLOAD / 2)
+#define RAW_VERIFY_WINDOW (VERIFY_CHUNK * 2)
+
+// Configuration memory read back by a verify, from the ID locations at
+// 0x2000 to the configuration word at 0x2007
+#define CONFIG_MEMORY_ADDRESS 0x2000
+#define CONFIG_MEMORY_WORDS 8
+#define DEVICE_ID_OFFSET 6
+#define CONFIG_WORD_INDEX 7
+
+// The programmer's UART runs from Fosc / 16, and the baud rate divisor is
+// only allowed to be this far off (in percent) from the rate asked for.
+#define UART_CLOCK 250000
+#define MAX_BAUD_ERROR 2
+
+// Bytes of the programmer's receive buffer kept free of program words, for
+// the command and anything that arrives late
+#define RX_BUFFER_RESERVE 8
+
+// Tprog and Tera the programmer uses if it can't be told otherwise (before
+// CAP_TIMING), in microseconds
+#define DEFAULT_PROGRAM_TIME 2500
+#define DEFAULT_ERASE_TIME 6000
+
+// After an error, the programmer throws away data until the line has been
+// idle for 10 ms.
+#define DRAIN_TIME 50	// milliseconds
+
+// Error codes reported by the programmer after an 'E'
+#define ERROR_OVERFLOW '1'
+#define ERROR_FRAMING '2'
+#define ERROR_VERIFY '3'
+#define ERROR_BAD_COMMAND '4'
+#define ERROR_BAD_PARAMETER '5'
+
+// Framing (see the description in programmer.asm)
+#define FRAME_START 0x7e
+#define FRAME_ACK '+'
+#define FRAME_NAK '-'
+#define FRAME_MAX_PAYLOAD 32
+#define MAX_FRAME_RETRIES 8
+#define RESPONSE_QUEUE_SIZE 256
+
+// Error code from the last failed wait_for_ack, or 0 if the programmer did
+// not report one (for example, the response timed out)
+static int programmer_error = 0;
+
+static int framing = 0;
+static int raw_window = RAW_WINDOW;
+static int frame_seq;
+static unsigned char frame_payload[FRAME_MAX_PAYLOAD];
+static int frame_length;
+static unsigned char response_queue[RESPONSE_QUEUE_SIZE];
+static int response_head;
+static int response_tail;
+
+// For measuring ack latency.  The windowed writers set ack_sent_time to when
+// the word being acknowledged went out, since later words were sent since.
+static double last_write_time;
+static double ack_sent_time = -1;
+
+// Gang mode targets for the current session, and those that have failed
+static int gang_targets;
+static int gang_failed;
+
+static struct programmer_capabilities capabilities;
+
+// The features programmers before CAPABILITY_QUERY_VERSION have, by the
+// version that added them
+static const int version_features[CAPABILITY_QUERY_VERSION] =
+{
+	0,
+	0,					// 1: the original protocol
+	CAP_READ,
+	CAP_FRAMING,
+	CAP_RX_BUFFER,
+	CAP_BLANK_CHECK,
+	CAP_STREAM,
+	CAP_ID_LOCATIONS,
+	CAP_TIMING,
+	CAP_GANG,
+	CAP_CAPTURE,
+	CAP_VERIFY,
+	CAP_PIC18,
+	CAP_BAUD,
+	CAP_DATA_MEMORY		// 14
+};
+
+// The receive buffer programmers before CAPABILITY_QUERY_VERSION have once
+// they have CAP_RX_BUFFER, and the smallest divisor they take once they have
+// CAP_BAUD (19200 baud)
+#define LEGACY_BUFFER_SIZE 64
+#define LEGACY_BAUD_DIVISOR_MIN 12
+
+/// Write an 8 bit value directly to the port, bypassing framing
+/// @returns
+///   - 1 if the octet was written successfully
+///   - 0 if the octet was not written successfully
+///
+/// This will print an error message if an error occurs
+static int write_raw(int value)
+{
+	int result = write_serial(value & 0xff);
+	if (result == -1)
+	{
+		printf("\nCan't write to serial device (OS returned error)\n");
+		return 0;
+	}
+	else if (result == -2)
+	{
+		printf("\nA timeout occured trying to write the the programmer\n");
+		return 0;
+	}
+	else if (result != 0)
+	{
+		printf("\nreceived unexpected result writing to programmer (bug in serial shim code)\n");
+		return 0;
+	}
+
+	metrics_count_sent(1);
+	return 1;
+
+}
+
+///
+/// Read an 8 bit value directly from the port, bypassing framing
+/// @returns the same values as read_serial
+///
+static int read_raw()
+{
+	int c = read_serial();
+	if (c >= 0)
+		metrics_count_received(1);
+
+	return c;
+}
+
+///
+/// Update a CRC-16-CCITT with one byte
+///
+static int crc16_update(int crc, int value)
+{
+	int bit;
+
+	crc ^= (value & 0xff) << 8;
+	for (bit = 0; bit < 8; bit++)
+	{
+		if (crc & 0x8000)
+			crc = (crc << 1) ^ 0x1021;
+		else
+			crc <<= 1;
+	}
+
+	return crc & 0xffff;
+}
+
+///
+/// Read a frame from the programmer, skipping anything before the start
+/// of the frame.
+/// @returns
+///   - 1 if a frame with a valid CRC was read
+///   - 0 if the frame was corrupted
+///   - -1 if the programmer stopped responding
+///
+static int read_frame(int *status, int *seq, unsigned char *payload, int *length)
+{
+	int header[3];
+	int crc;
+	int c;
+	int i;
+
+	do
+	{
+		c = read_raw();
+		if (c < 0)
+			return -1;
+	}
+	while (c != FRAME_START);
+
+	crc = 0xffff;
+	for (i = 0; i < 3; i++)
+	{
+		header[i] = read_raw();
+		if (header[i] < 0)
+			return -1;
+
+		crc = crc16_update(crc, header[i]);
+	}
+
+	*status = header[0];
+	*seq = header[1];
+	*length = header[2];
+	if (*length > FRAME_MAX_PAYLOAD)
+		return 0;
+
+	for (i = 0; i < *length; i++)
+	{
+		c = read_raw();
+		if (c < 0)
+			return -1;
+
+		payload[i] = c;
+		crc = crc16_update(crc, c);
+	}
+
+	c = read_raw();
+	if (c < 0)
+		return -1;
+
+	crc ^= c << 8;
+	c = read_raw();
+	if (c < 0)
+		return -1;
+
+	crc ^= c;
+
+	return crc == 0;
+}
+
+///
+/// Send the pending frame to the programmer and queue its response,
+/// retransmitting until it is acknowledged.
+/// @returns
+///   - 1 if the frame was acknowledged
+///   - 0 if an error occured
+///
+/// This will print an error message if an error occurs
+static int send_frame()
+{
+	unsigned char payload[FRAME_MAX_PAYLOAD];
+	int attempt;
+	int status;
+	int seq;
+	int length;
+	int crc;
+	int result;
+	int i;
+
+	for (attempt = 0; attempt < MAX_FRAME_RETRIES; attempt++)
+	{
+		if (attempt > 0)
+			metrics_count_retransmit();
+
+		crc = crc16_update(0xffff, frame_seq);
+		crc = crc16_update(crc, frame_length);
+		for (i = 0; i < frame_length; i++)
+			crc = crc16_update(crc, frame_payload[i]);
+
+		if (!write_raw(FRAME_START) || !write_raw(frame_seq) || !write_raw(frame_length))
+			return 0;
+
+		for (i = 0; i < frame_length; i++)
+		{
+			if (!write_raw(frame_payload[i]))
+				return 0;
+		}
+
+		if (!write_raw(crc >> 8) || !write_raw(crc))
+			return 0;
+
+		// Skip stale acks for earlier frames
+		do
+		{
+			result = read_frame(&status, &seq, payload, &length);
+		}
+		while (result == 1 && status == FRAME_ACK && seq != frame_seq);
+
+		if (result == 1 && status == FRAME_ACK)
+		{
+			for (i = 0; i < length; i++)
+			{
+				response_queue[response_tail] = payload[i];
+				response_tail = (response_tail + 1) % RESPONSE_QUEUE_SIZE;
+			}
+
+			frame_seq = (frame_seq + 1) & 0xff;
+			frame_length = 0;
+			return 1;
+		}
+
+		if (result < 0)
+		{
+			// The programmer may be stuck partway through a frame that lost
+			// bytes.  Pad it out so it rejects it and looks for a new one.
+			for (i = 0; i < FRAME_MAX_PAYLOAD + 5; i++)
+			{
+				if (!write_raw(0))
+					return 0;
+			}
+		}
+
+		// Otherwise it was a NAK or a corrupted response.  Send it again.
+	}
+
+	printf("\nProgrammer did not accept frame %d after %d attempts\n", frame_seq,
+		MAX_FRAME_RETRIES);
+	return 0;
+}
+
+/// Write an 8 bit value to the programmer.  In framed mode, this is added to
+/// the pending frame, which is sent when it is full or a response is needed.
+/// @returns
+///   - 1 if the octet was written successfully
+///   - 0 if the octet was not written successfully
+///
+/// This will print an error message if an error occurs
+int write_octet(int value)
+{
+	last_write_time = metrics_now();
+	if (!framing)
+		return write_raw(value);
+
+	if (frame_length == FRAME_MAX_PAYLOAD && !send_frame())
+		return 0;
+
+	frame_payload[frame_length++] = value;
+	return 1;
+}
+
+/// Read an 8 bit value from the programmer.  In framed mode, this sends the
+/// pending frame if nothing is left from the responses to earlier ones.
+/// @returns
+///   - 0x00 to 0xff for a valid 8 bit character read
+///   - -1 If there was an error communicating with the port
+///   - -2 If there was a timeout reciving the character.
+int read_octet()
+{
+	int c;
+
+	if (!framing)
+		return read_raw();
+
+	if (response_head == response_tail && frame_length > 0 && !send_frame())
+		return -1;
+
+	if (response_head == response_tail)
+		return -2;	// Programmer didn't send anything back
+
+	c = response_queue[response_head];
+	response_head = (response_head + 1) % RESPONSE_QUEUE_SIZE;
+
+	return c;
+}
+
+int set_framing(int enable)
+{
+	if (enable == framing)
+		return 1;
+
+	if (enable && !(capabilities.features & CAP_FRAMING))
+	{
+		printf("Programmer can't use framed mode, staying in raw mode\n");
+		return 1;
+	}
+
+	if (!write_octet('F') || !write_octet(enable) || !wait_for_ack())
+	{
+		// Don't leave stale frames in front of whatever is sent next
+		if (!enable)
+			reset_framing();
+
+		return 0;
+	}
+
+	framing = enable;
+	frame_seq = 1;
+	frame_length = 0;
+	response_head = 0;
+	response_tail = 0;
+
+	return 1;
+}
+
+void reset_framing()
+{
+	framing = 0;
+	frame_length = 0;
+	response_head = 0;
+	response_tail = 0;
+}
+
+void set_raw_window(int words)
+{
+	if (words < 1)
+		words = 1;
+	else if (words > RAW_WINDOW_MAX)
+		words = RAW_WINDOW_MAX;
+
+	raw_window = words;
+}
+
+///
+/// @returns how many program words to send ahead of their acks.  In framed
+/// mode, this is a frame's worth.  Without a receive buffer, the programmer
+/// can only take one at a time.
+///
+static int words_in_flight()
+{
+	int limit;
+
+	if (framing)
+		return FRAME_MAX_PAYLOAD / 2;
+
+	if (!(capabilities.features & CAP_RX_BUFFER))
+		return 1;
+
+	limit = (capabilities.buffer_size - RX_BUFFER_RESERVE) / 2;
+	if (limit < 1)
+		return 1;
+
+	return raw_window < limit ? raw_window : limit;
+}
+
+int set_baud_rate(int baud)
+{
+	int divisor = (UART_CLOCK + baud / 2) / baud - 1;
+	int actual;
+
+	if (!require_capability(CAP_BAUD, "Changing the baud rate"))
+		return 0;
+
+	if (baud > capabilities.max_baud || divisor < 0 || divisor > 255)
+	{
+		printf("The programmer can't run at %d baud\n", baud);
+		return 0;
+	}
+
+	actual = UART_CLOCK / (divisor + 1);
+	if (abs(actual - baud) * 100 > baud * MAX_BAUD_ERROR)
+	{
+		printf("The programmer can't run at %d baud (closest is %d)\n", baud, actual);
+		return 0;
+	}
+
+	if (!write_octet('U') || !write_octet(divisor) || !wait_for_ack())
+		return 0;
+
+	// The programmer has switched once the ack went out
+	if (set_serial_baud(baud) < 0)
+	{
+		printf("Can't set the serial port to %d baud\n", baud);
+		reset_baud_rate();
+		return 0;
+	}
+
+	return 1;
+}
+
+int reset_baud_rate()
+{
+	if (set_serial_baud(BASE_BAUD_RATE) < 0)
+		return 0;	// The port's rate can't change, so neither has the programmer's
+
+	// A break sends the programmer back to the base rate and raw mode.  Not
+	// every adapter can send one, so follow it with a zero byte, which is low
+	// for longer than a frame at any faster rate and so looks like one there.
+	// If the programmer is already at the base rate in raw mode, the zero is
+	// a bad command.  Either way, throw away the response.
+	send_serial_break();
+	if (!write_raw(0))
+		return 0;
+
+	serial_delay(DRAIN_TIME);
+	flush_serial();
+	return 1;
+}
+
+/// Write a 16 bit value to the port, in bigendian format
+/// @returns
+///   - 1 if the short was written successfully
+///   - 0 if the short was not written successfully
+///
+/// This will print an error message if an error occurs
+int write_short(int value)
+{
+	if (!write_octet(value >> 8))
+		return 0;
+
+	return write_octet(value);
+}
+
+///
+/// Print the names of gang mode targets, each preceded by a space
+///
+static void print_gang_targets(int targets)
+{
+	int line;
+
+	if (targets & GANG_PRIMARY_TARGET)
+		printf(" RA3");
+
+	for (line = 0; line < 8; line++)
+	{
+		if (targets & GANG_TARGET_LINES & (1 << line))
+			printf(" RB%d", line);
+	}
+}
+
+int parse_gang_targets(const char *list)
+{
+	int targets = 0;
+	int line;
+
+	while (*list != '\0')
+	{
+		if ((list[0] != 'r' && list[0] != 'R') || (list[1] != 'b' && list[1] != 'B')
+			|| list[2] < '0' || list[2] > '7')
+			return -1;
+
+		line = 1 << (list[2] - '0');
+		if ((line & GANG_TARGET_LINES) == 0)
+			return -1;
+
+		targets |= line;
+		list += 3;
+		if (*list == ',')
+			list++;
+		else if (*list != '\0')
+			return -1;
+	}
+
+	return targets;
+}
+
+int gang_failed_targets()
+{
+	return gang_failed;
+}
+
+///
+/// Switch gang mode on for the given targets, or off if there are none
+///
+static int set_gang(int targets)
+{
+	if (!require_capability(CAP_GANG, "Gang mode"))
+		return 0;
+
+	if (!write_octet('G'))
+		return 0;
+
+	if (!write_octet(targets))
+		return 0;
+
+	return wait_for_ack();
+}
+
+/// @returns
+///   - 1 if the ack was returned successfully
+///   - 0 if an error occured
+///
+///  This function will print an error message if an error occurs
+int wait_for_ack()
+{
+	int c = read_octet();
+	double sent_time = ack_sent_time >= 0 ? ack_sent_time : last_write_time;
+
+	ack_sent_time = -1;
+	programmer_error = 0;
+	if (c == '+')
+	{
+		metrics_record_ack_latency(metrics_now() - sent_time);
+		return 1;	// Success
+	}
+	else if (c == -1)
+	{
+		printf("\nThe serial device is not communicating\n");
+		return 0;
+	}
+	else if (c == -2)
+	{
+		printf("\nTimeout waiting for programmer response\n");
+		return 0;
+	}
+	else if (c == 'G')
+	{
+		// In gang mode, some targets failed.  Carry on with the others.
+		int failed = read_octet();
+		if (failed < 0)
+		{
+			printf("\nThe serial device is not communicating\n");
+			return 0;
+		}
+
+		gang_failed |= failed;
+		printf("\nTarget(s)");
+		print_gang_targets(failed);
+		printf(" failed to verify\n");
+		return 1;
+	}
+	else if (c == 'E')
+	{
+		int error = read_octet();
+		if (error == -1)
+		{
+			printf("\nThe serial device is not communicating\n");
+			return 0;
+		}
+		else if (error == -2)
+		{
+			printf("\nTimeout waiting for programmer response\n");
+			return 0;
+		}
+
+		programmer_error = error;
+		metrics_count_error(error);
+		switch (error)
+		{
+			case '1':
+				printf("\nProgrammer has reported an overflow error\n");
+				break;
+
+			case '2':
+				printf("\nProgrammer has reported a framing error\n");
+				break;
+
+			case '3':
+				printf("\nProgrammer has reported that verification has failed\n");
+
+				// Get word that was read back
+				int msb = read_octet();
+				int lsb = read_octet();
+
+				printf("got 0x%02x%02x\n", msb, lsb);
+
+				break;
+
+			case '4':
+				printf("\nProgrammer has reported that a command is not understood\n");
+				break;
+
+			case '5':
+				printf("\nProgrammer has rejected a command parameter\n");
+				break;
+		}
+
+		return 0;
+	}
+	else
+	{
+		printf("\nReceived unrecognized error from programmer: %c\n", c);
+		return 0;
+	}
+}
+
+void draw_progress_bar(int current, int max, const char *prefix)
+{
+	int i;
+	int dotCount;
+
+	printf("\r%s [", prefix);
+
+	dotCount = PROGRESS_BAR_WIDTH * current / max;
+
+	for (i = 0; i < dotCount; i++)
+		printf(".");
+
+	for (; i < PROGRESS_BAR_WIDTH; i++)
+		printf(" ");
+
+	printf("]");
+	fflush(stdout);
+}
+
+///
+/// Ask a programmer from CAPABILITY_QUERY_VERSION on what it can do
+///
+static int query_capabilities()
+{
+	int response[4];
+	int i;
+
+	if (!write_octet('Q'))
+		return 0;
+
+	for (i = 0; i < 4; i++)
+	{
+		response[i] = read_octet();
+		if (response[i] < 0)
+		{
+			printf("Error reading capabilities from programmer (%d)\n", response[i]);
+			return 0;
+		}
+	}
+
+	capabilities.features = (response[0] << 8) | response[1];
+	capabilities.buffer_size = response[2];
+	capabilities.max_baud = UART_CLOCK / (response[3] + 1);
+
+	return 1;
+}
+
+///
+/// Work out what a programmer from before CAPABILITY_QUERY_VERSION can do
+/// from its version
+///
+static void infer_capabilities(int version)
+{
+	int i;
+
+	capabilities.features = 0;
+	for (i = MIN_PROTOCOL_VERSION; i <= version; i++)
+		capabilities.features |= version_features[i];
+
+	capabilities.buffer_size = (capabilities.features & CAP_RX_BUFFER) ? LEGACY_BUFFER_SIZE : 0;
+	capabilities.max_baud = (capabilities.features & CAP_BAUD)
+		? UART_CLOCK / (LEGACY_BAUD_DIVISOR_MIN + 1) : BASE_BAUD_RATE;
+}
+
+int check_protocol_version()
+{
+	int version;
+
+	// The handshake is always in raw mode, whatever an earlier session on
+	// this or another programmer left behind
+	reset_framing();
+	if (!write_octet('V'))
+		return 0;
+
+	version = read_octet();
+	if ((version < MIN_PROTOCOL_VERSION || version > EXPECTED_PROTOCOL_VERSION)
+		&& version != -1 && reset_baud_rate())
+	{
+		// The programmer may still be at a rate, or in framed mode, that an
+		// earlier run left it in, so the 'V' arrived garbled or was taken for
+		// noise between frames.  Now it has gone back to the base rate in raw
+		// mode, ask again.
+		if (!write_octet('V'))
+			return 0;
+
+		version = read_octet();
+	}
+
+	if (version == -1)
+	{
+		printf("Cannot communicate with serial device driver\n");
+		return 0;
+	}
+	else if (version == -2)
+	{
+		printf("Programmer is not responding\n");
+		return 0;
+	}
+	else if (version < 0)
+	{
+		printf("received unexpected result writing to programmer (bug in serial shim code)\n");
+		return 0;
+	}
+
+	if (version < MIN_PROTOCOL_VERSION)
+	{
+		printf("Programmer uses a different protocol version.  Cannot communicate\n");
+		return 0;
+	}
+
+	// Newer firmware still answers 'Q', and only the features this host
+	// knows about are used.
+	if (version >= CAPABILITY_QUERY_VERSION)
+	{
+		if (!query_capabilities())
+		{
+			printf("Programmer uses a different protocol version.  Cannot communicate\n");
+			return 0;
+		}
+	}
+	else
+		infer_capabilities(version);
+
+	capabilities.version = version;
+	return 1;
+}
+
+const struct programmer_capabilities *get_capabilities()
+{
+	return &capabilities;
+}
+
+void set_capabilities(const struct programmer_capabilities *new_capabilities)
+{
+	capabilities = *new_capabilities;
+}
+
+int require_capability(int features, const char *operation)
+{
+	if ((capabilities.features & features) == features)
+		return 1;
+
+	printf("%s isn't supported by this programmer (protocol version %d)\n", operation,
+		capabilities.version);
+	return 0;
+}
+
+int set_timing(const struct device_profile *profile)
+{
+	if (profile->program_time < MIN_PROGRAM_TIME || profile->erase_time < MIN_PROGRAM_TIME)
+	{
+		printf("Program and erase times for %s are below the programmer's limit\n",
+			profile->name);
+		return 0;
+	}
+
+	if (!(capabilities.features & CAP_TIMING))
+	{
+		// Waiting longer than the part needs does no harm
+		if (profile->program_time <= DEFAULT_PROGRAM_TIME
+			&& profile->erase_time <= DEFAULT_ERASE_TIME)
+			return 1;
+
+		return require_capability(CAP_TIMING, "Setting the programming times");
+	}
+
+	if (!write_octet('M'))
+		return 0;
+
+	// Round up, so the wait is never shorter than the device needs
+	if (!write_short((profile->program_time + TIMING_TICK - 1) / TIMING_TICK))
+		return 0;
+
+	if (!write_short((profile->erase_time + TIMING_TICK - 1) / TIMING_TICK))
+		return 0;
+
+	return wait_for_ack();
+}
+
+///
+/// Add a program word, as sent to the programmer, to the running checksum
+///
+static void add_to_checksum(int instruction, int *checksum_hi, int *checksum_lo)
+{
+	*checksum_lo = (*checksum_lo + ((instruction >> 8) & 0xff)) & 0xff;
+	*checksum_hi = (*checksum_hi + *checksum_lo) & 0xff;
+	*checksum_lo = (*checksum_lo + (instruction & 0xff)) & 0xff;
+	*checksum_hi = (*checksum_hi + *checksum_lo) & 0xff;
+}
+
+///
+/// Read the checksum the programmer sends at the end of a write and compare
+/// it with the one computed while sending.
+///
+static int check_write_checksum(int computed_checksum_hi, int computed_checksum_lo)
+{
+	int got_checksum;
+
+	programmer_error = 0;
+	if (read_octet() != 'D')
+	{
+		printf("Unexpected response waiting for checksum\n");
+		return 0;
+	}
+
+	got_checksum = (read_octet() << 8) & 0xff00;
+	got_checksum |= read_octet() & 0xff;
+
+	if (((computed_checksum_hi << 8) | computed_checksum_lo) != got_checksum)
+	{
+		printf("Checksum mismatch.  Data was corrupted while being transferred\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+///
+/// Send a 'W' command for the program words from *next_word to the end of the
+/// image.  *next_word is advanced past each word the programmer acknowledges,
+/// so on failure it is the first word that was not written.
+///
+static int write_program_words(const struct image *image, int *next_word,
+	const struct program_options *options)
+{
+	int computed_checksum_hi;
+	int computed_checksum_lo;
+	int instruction_count = image->instruction_count;
+	double send_times[STREAM_HISTORY];
+	int window;
+	int sent;
+
+	computed_checksum_hi = 0;
+	computed_checksum_lo = 0;
+	if (!write_octet('W'))
+		return 0;
+
+	if (!write_short(instruction_count - *next_word))	// Number of program words to write
+		return 0;
+
+	if (!wait_for_ack())
+		return 0;
+
+	// Keep a window of words in flight, so they transfer while earlier ones
+	// are being programmed
+	window = words_in_flight();
+	sent = *next_word;
+	while (*next_word < instruction_count)
+	{
+		while (sent < instruction_count && sent - *next_word < window)
+		{
+			// The program words here are 14 bits LSB justified, but must be written
+			// to the device with a zero bit as padding on each end.  Also, the bytes in the file
+			// are little endian, so they need to be swapped before writing out to the
+			// file.  Words the file doesn't set are written blank.
+			int instruction = (image_word(image, sent) & 0x3fff) << 1;
+			if (!write_short(instruction))
+				return 0;
+
+			add_to_checksum(instruction, &computed_checksum_hi, &computed_checksum_lo);
+			send_times[sent % STREAM_HISTORY] = metrics_now();
+			sent++;
+		}
+
+		if (options->show_progress)
+			draw_progress_bar(*next_word + 1, instruction_count, "Programming");
+
+		ack_sent_time = send_times[*next_word % STREAM_HISTORY];
+		if (!wait_for_ack())
+		{
+			printf("writing instruction @ %d (%04x)\n", *next_word,
+				image_word(image, *next_word) << 1);
+			return 0;
+		}
+
+		(*next_word)++;
+	}
+
+	return check_write_checksum(computed_checksum_hi, computed_checksum_lo);
+}
+
+///
+/// Send an 'S' command with words from the source, starting with the ones
+/// in history from *next_word up to *received.  *next_word is advanced past
+/// each word the programmer acknowledges.  Words that have been sent but not
+/// acknowledged are kept in history, so they can be sent again on a resume.
+///
+static int stream_program_words(struct word_source *source, int *history,
+	int *next_word, int *received, const struct program_options *options)
+{
+	int computed_checksum_hi = 0;
+	int computed_checksum_lo = 0;
+	double send_times[STREAM_HISTORY];
+	int window;
+	int sent;
+	int word;
+	int instruction;
+	int result = WORD_SOURCE_EMPTY;
+
+	if (!write_octet('S'))
+		return 0;
+
+	if (!wait_for_ack())
+		return 0;
+
+	window = words_in_flight();
+	sent = *next_word;
+	for (;;)
+	{
+		while (sent - *next_word < window)
+		{
+			if (sent == *received)
+			{
+				if (result == WORD_SOURCE_END || result == WORD_SOURCE_ERROR)
+					break;
+
+				// Only block waiting for the source if nothing is in flight.
+				// Otherwise collect acks while it catches up.
+				result = source->next_word(source, &word, sent == *next_word);
+				if (result != WORD_SOURCE_OK)
+					break;
+
+				history[*received % STREAM_HISTORY] = word;
+				(*received)++;
+			}
+
+			instruction = (history[sent % STREAM_HISTORY] & 0x3fff) << 1;
+			if (!write_short(instruction))
+				return 0;
+
+			add_to_checksum(instruction, &computed_checksum_hi, &computed_checksum_lo);
+			send_times[sent % STREAM_HISTORY] = metrics_now();
+			sent++;
+		}
+
+		if (sent == *next_word)
+			break;	// Everything has been acknowledged and the source is done
+
+		ack_sent_time = send_times[*next_word % STREAM_HISTORY];
+		if (!wait_for_ack())
+		{
+			printf("writing instruction @ %d (%04x)\n", *next_word,
+				(history[*next_word % STREAM_HISTORY] & 0x3fff) << 1);
+			return 0;
+		}
+
+		(*next_word)++;
+		if (options->show_progress)
+		{
+			printf("\rProgramming %d words", *next_word);
+			fflush(stdout);
+		}
+	}
+
+	if (!write_short(STREAM_TERMINATOR))
+		return 0;
+
+	if (!check_write_checksum(computed_checksum_hi, computed_checksum_lo))
+		return 0;
+
+	// The programmer finished cleanly, so this isn't something a resume
+	// will fix.
+	if (result == WORD_SOURCE_ERROR)
+	{
+		printf("\nError reading program words\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+///
+/// Get the programmer back into programming mode with the address at
+/// next_word after a write failed partway through, without erasing.  The last
+/// acknowledged word, previous_word, is read back first to make sure it is
+/// intact.
+/// @returns
+///   - 1 if the write can be resumed at next_word
+///   - 0 if the programmer is in an unknown state
+///
+static int resume_write(int previous_word, int next_word)
+{
+	int attempt;
+	int c;
+	int readback;
+	int expected;
+
+	if (!(capabilities.features & CAP_READ))
+		return 0;	// Can't check what was written, so start over
+
+	// Throw away the words that were queued ahead of the failed one.  In raw
+	// mode they have already been sent, so let the programmer discard them.
+	if (framing)
+		frame_length = 0;
+	else
+		serial_delay(DRAIN_TIME);
+
+	if (programmer_error == ERROR_OVERFLOW || programmer_error == ERROR_FRAMING)
+	{
+		// The programmer may still be waiting for the rest of the word with the
+		// lost byte, and will abandon the write once it arrives.  Pad it out
+		// with 'X' until one is acknowledged, which also exits programming mode.
+		for (attempt = 0; attempt < 3; attempt++)
+		{
+			if (!write_octet('X'))
+				return 0;
+
+			while ((c = read_octet()) >= 0 && c != '+')
+				;
+
+			if (c == '+')
+				break;
+		}
+
+		if (attempt == 3)
+			return 0;
+	}
+	else if (programmer_error != ERROR_VERIFY)
+		return 0;	// Programmer exits programming mode on a verify error.
+	else if (gang_targets != 0)
+		return 0;	// In gang mode, that means every target failed
+
+	// Re-enter programming mode, which resets the address to 0
+	if (!write_octet('P'))
+		return 0;
+
+	if (!wait_for_ack())
+		return 0;
+
+	if (next_word == 0)
+		return 1;
+
+	if (!write_octet('A'))
+		return 0;
+
+	if (!write_short(next_word - 1))
+		return 0;
+
+	if (!wait_for_ack())
+		return 0;
+
+	// Read back the last word that was acknowledged.  This leaves the address
+	// at next_word.
+	if (!write_octet('R'))
+		return 0;
+
+	if (!write_short(1))
+		return 0;
+
+	readback = (read_octet() << 8) & 0xff00;
+	readback |= read_octet() & 0xff;
+	expected = (previous_word << 1) & 0x7ffe;
+	if (readback != expected)
+	{
+		printf("\nword @ %d reads back as %04x, expected %04x.  Can't resume.\n",
+			next_word - 1, readback, expected);
+		return 0;
+	}
+
+	return 1;
+}
+
+int check_blank(int count, int *first_used)
+{
+	int c;
+
+	if (!require_capability(CAP_BLANK_CHECK, "The blank check"))
+		return 0;
+
+	if (!write_octet('B'))
+		return 0;
+
+	if (!write_short(count))
+		return 0;
+
+	c = read_octet();
+	if (c == '+')
+	{
+		*first_used = -1;
+		return 1;
+	}
+
+	if (c != '-')
+	{
+		printf("Unexpected response to blank check %02x\n", c);
+		return 0;
+	}
+
+	*first_used = (read_octet() << 8) & 0xff00;
+	*first_used |= read_octet() & 0xff;
+
+	return 1;
+}
+
+int target_program_words(const struct program_options *options)
+{
+	if (options->profile != NULL && options->profile->family == FAMILY_MIDRANGE)
+		return options->profile->program_size / 2;
+
+	return DEVICE_PROGRAM_SIZE;
+}
+
+///
+/// Read one word of an 'R' response
+/// @returns
+///   - The word, with padding, as sent by the programmer
+///   - -1 if an error occured
+///
+static int read_word()
+{
+	int hi;
+	int lo;
+
+	hi = read_octet();
+	lo = hi < 0 ? hi : read_octet();
+	if (lo < 0)
+	{
+		printf("\nError reading back from programmer (%d)\n", lo);
+		return -1;
+	}
+
+	return (hi << 8) | lo;
+}
+
+int read_programmer_profile(int *milliseconds)
+{
+	int i;
+
+	if (!require_capability(CAP_PROFILE, "Profiling") || !write_octet('Y'))
+		return 0;
+
+	for (i = 0; i < PROGRAMMER_PHASE_COUNT; i++)
+	{
+		milliseconds[i] = read_word();
+		if (milliseconds[i] < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+///
+/// Compare a word read back from the target with the 14 bit word expected,
+/// and report it if they differ.
+///
+static int compare_word(int address, int readback, int expected)
+{
+	readback = (readback >> 1) & 0x3fff;
+	if (readback == (expected & 0x3fff))
+		return 1;
+
+	printf("\nword @ %04x reads back as %04x, expected %04x\n", address, readback,
+		expected & 0x3fff);
+	return 0;
+}
+
+///
+/// Read program memory back from address 0 and compare it with the image as
+/// it arrives.  Words are requested ahead of being compared, so the link
+/// stays busy.  *mismatches is incremented for each word that differs.
+///
+static int verify_program_words(const struct image *image,
+	const struct program_options *options, int report_all, int *mismatches)
+{
+	int instruction_count = image->instruction_count;
+	int requested = 0;
+	int received = 0;
+	int window;
+	int count;
+	int word;
+
+	window = framing ? VERIFY_CHUNK : RAW_VERIFY_WINDOW;
+	while (received < instruction_count)
+	{
+		while (requested < instruction_count && requested - received < window)
+		{
+			count = instruction_count - requested;
+			if (count > VERIFY_CHUNK)
+				count = VERIFY_CHUNK;
+
+			if (!write_octet('R') || !write_short(count))
+				return 0;
+
+			requested += count;
+		}
+
+		if (options->show_progress)
+			draw_progress_bar(received + 1, instruction_count, "Verifying");
+
+		word = read_word();
+		if (word < 0)
+			return 0;
+
+		if (!compare_word(received, word, image_word(image, received)))
+		{
+			(*mismatches)++;
+			if (!report_all)
+				break;
+		}
+
+		received++;
+	}
+
+	// Stopped at a mismatch.  Throw away the words that were already asked
+	// for.
+	while (++received < requested)
+	{
+		if (read_word() < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+///
+/// Read back the ID locations (if the image sets them) and configuration
+/// word and compare them with the image.  This leaves the address in
+/// configuration memory.
+///
+static int verify_config_words(const struct image *image,
+	const struct program_options *options, int report_all, int *mismatches)
+{
+	int words[CONFIG_MEMORY_WORDS];
+	int id_words[ID_LOCATION_COUNT];
+	int i;
+
+	if (!write_octet('J') || !wait_for_ack())
+		return 0;
+
+	if (!write_octet('R') || !write_short(CONFIG_MEMORY_WORDS))
+		return 0;
+
+	for (i = 0; i < CONFIG_MEMORY_WORDS; i++)
+	{
+		words[i] = read_word();
+		if (words[i] < 0)
+			return 0;
+	}
+
+	if (options->show_progress)
+		printf("\nDevice ID %04x\n", (words[DEVICE_ID_OFFSET] >> 1) & 0x3fff);
+
+	if (image_id_locations(image, id_words))
+	{
+		for (i = 0; i < ID_LOCATION_COUNT; i++)
+		{
+			if (!compare_word(CONFIG_MEMORY_ADDRESS + i, words[i], id_words[i]))
+			{
+				(*mismatches)++;
+				if (!report_all)
+					return 1;
+			}
+		}
+	}
+
+	if (!compare_word(CONFIG_MEMORY_ADDRESS + CONFIG_WORD_INDEX, words[CONFIG_WORD_INDEX],
+		image->config_word))
+		(*mismatches)++;
+
+	return 1;
+}
+
+///
+/// Move the target's address forward until its low bits, which select the
+/// data EEPROM byte, are address.  *target_address tracks where it is.
+///
+static int seek_data_byte(int address, int *target_address)
+{
+	int count = (address - *target_address) & (MAX_DATA_MEMORY_SIZE - 1);
+
+	if (count == 0)
+		return 1;
+
+	if (!write_octet('A') || !write_short(count) || !wait_for_ack())
+		return 0;
+
+	*target_address += count;
+	return 1;
+}
+
+///
+/// Read back data EEPROM and compare it with the image.  *target_address is
+/// the target's address, and is updated.
+///
+static int verify_data_memory(const struct image *image, int *target_address,
+	int report_all, int *mismatches)
+{
+	int address = 0;
+	int count;
+	int word;
+	int i;
+
+	if (!write_octet('O') || !write_octet(1) || !wait_for_ack())
+		return 0;
+
+	if (!seek_data_byte(0, target_address))
+		return 0;
+
+	while (address < image->data_size)
+	{
+		count = image->data_size - address;
+		if (count > VERIFY_CHUNK)
+			count = VERIFY_CHUNK;
+
+		if (!write_octet('R') || !write_short(count))
+			return 0;
+
+		for (i = 0; i < count; i++)
+		{
+			word = read_word();
+			if (word < 0)
+				return 0;
+
+			if (((word >> 1) & 0xff) != image_data_byte(image, address + i))
+			{
+				printf("\nEEPROM byte @ %02x reads back as %02x, expected %02x\n",
+					address + i, (word >> 1) & 0xff, image_data_byte(image, address + i));
+				(*mismatches)++;
+			}
+		}
+
+		address += count;
+		*target_address += count;
+		if (*mismatches > 0 && !report_all)
+			break;
+	}
+
+	return write_octet('O') && write_octet(0) && wait_for_ack();
+}
+
+static int verify_image_session(const struct image *image,
+	const struct program_options *options, int report_all, int *mismatches)
+{
+	int target_address;
+	int features = CAP_READ | CAP_VERIFY;
+
+	if (image->data_size > 0)
+		features |= CAP_DATA_MEMORY;
+
+	if (!require_capability(features, "Verifying"))
+		return 0;
+
+	if (!write_octet('P') || !wait_for_ack())
+		return 0;
+
+	metrics_begin_phase(PHASE_VERIFY);
+	if (!verify_program_words(image, options, report_all, mismatches))
+		return 0;
+
+	target_address = image->instruction_count;
+	if (image->data_size > 0 && (*mismatches == 0 || report_all)
+		&& !verify_data_memory(image, &target_address, report_all, mismatches))
+		return 0;
+
+	if ((*mismatches == 0 || report_all)
+		&& !verify_config_words(image, options, report_all, mismatches))
+		return 0;
+
+	if (!write_octet('X') || !wait_for_ack())
+		return 0;
+
+	if (options->run_after)
+	{
+		if (!write_octet('I') || !write_octet('2') || !wait_for_ack())
+			return 0;
+	}
+
+	return 1;
+}
+
+///
+/// Enter programming mode and erase the target, unless it is already blank
+/// and a blank check was asked for.
+///
+static int begin_session(const struct program_options *options)
+{
+	int first_used = 0;
+
+	if (options->profile != NULL && !set_timing(options->profile))
+		return 0;
+
+	gang_targets = options->gang_targets;
+	gang_failed = 0;
+	if (gang_targets != 0 && !set_gang(gang_targets))
+		return 0;
+
+	// Enter programming mode
+	if (!write_octet('P'))
+		return 0;
+
+	if (!wait_for_ack())
+		return 0;
+
+	if (options->blank_check && !(capabilities.features & CAP_BLANK_CHECK))
+	{
+		if (options->show_progress)
+			printf("Programmer can't check for a blank target, erasing\n");
+	}
+	else if (options->blank_check)
+	{
+		metrics_begin_phase(PHASE_BLANK_CHECK);
+		if (!check_blank(target_program_words(options), &first_used))
+			return 0;
+
+		// The check moved the address.  Re-entering programming mode is the
+		// only way to set it back to 0.
+		if (!write_octet('X') || !wait_for_ack())
+			return 0;
+
+		if (!write_octet('P') || !wait_for_ack())
+			return 0;
+
+		if (options->show_progress && first_used < 0)
+			printf("Target is blank, skipping erase\n");
+	}
+
+	if (first_used >= 0)
+	{
+		// Erase flash
+		metrics_begin_phase(PHASE_ERASE);
+		if (!write_octet('E'))
+			return 0;
+
+		if (!wait_for_ack())
+			return 0;
+	}
+
+	return 1;
+}
+
+///
+/// Erase data EEPROM and write the bytes of the image that aren't erased.
+/// Each is verified by the programmer.  This is done a byte at a time,
+/// since each takes longer to program than to send.  *target_address is the
+/// target's address, and is updated.
+///
+static int write_data_memory(const struct image *image, int *target_address,
+	const struct program_options *options)
+{
+	int checksum_hi;
+	int checksum_lo;
+	int value;
+	int address;
+
+	if (!write_octet('O') || !write_octet(1) || !wait_for_ack())
+		return 0;
+
+	if (!write_octet('E') || !wait_for_ack())
+		return 0;
+
+	for (address = 0; address < image->data_size; address++)
+	{
+		if (options->show_progress)
+			draw_progress_bar(address + 1, image->data_size, "EEPROM     ");
+
+		value = image_data_byte(image, address);
+		if (value == 0xff)
+			continue;	// Erased already
+
+		if (!seek_data_byte(address, target_address))
+			return 0;
+
+		if (!write_octet('W') || !write_short(1) || !wait_for_ack())
+			return 0;
+
+		checksum_hi = 0;
+		checksum_lo = 0;
+		add_to_checksum(value << 1, &checksum_hi, &checksum_lo);
+		if (!write_short(value << 1))
+			return 0;
+
+		if (!wait_for_ack())
+		{
+			printf("writing EEPROM byte @ %02x (%02x)\n", address, value);
+			return 0;
+		}
+
+		if (!check_write_checksum(checksum_hi, checksum_lo))
+			return 0;
+
+		(*target_address)++;
+	}
+
+	return write_octet('O') && write_octet(0) && wait_for_ack();
+}
+
+///
+/// Write the ID locations, if there are any, and the configuration word,
+/// then exit programming mode and start the target if asked to.
+///
+static int end_session(int config_word, const int *id_words,
+	const struct program_options *options)
+{
+	int i;
+
+	metrics_begin_phase(PHASE_CONFIG);
+	if (id_words != NULL)
+	{
+		if (!require_capability(CAP_ID_LOCATIONS, "Writing the ID locations")
+			|| !write_octet('K'))
+			return 0;
+
+		for (i = 0; i < ID_LOCATION_COUNT; i++)
+		{
+			if (!write_short((id_words[i] << 1) & 0x7ffe))
+				return 0;
+		}
+	}
+	else if (!write_octet('C'))
+		return 0;
+
+	// Write configuration word
+	if (!write_short(config_word << 1))
+		return 0;
+
+	if (!wait_for_ack())
+	{
+		printf("Writing configuration word\n");
+		return 0;
+	}
+
+	// Exit programming mode
+	if (!write_octet('X'))
+		return 0;
+
+	if (!wait_for_ack())
+		return 0;
+
+	if (gang_targets != 0)
+	{
+		printf("\nGood targets:");
+		print_gang_targets((gang_targets | GANG_PRIMARY_TARGET) & ~gang_failed);
+		printf("\n");
+		if (gang_failed != 0)
+			return 0;
+	}
+
+	if (options->show_progress)
+		printf("\nFlash programmed.\n");
+
+	if (options->run_after)
+	{
+		// Turn on chip
+		write_octet('I');
+		write_octet('2');
+
+		if (!wait_for_ack())
+			return 0;
+	}
+
+	return 1;
+}
+
+static int program_image_session(const struct image *image,
+	const struct program_options *options)
+{
+	int next_word = 0;
+	int attempt;
+	int id_words[ID_LOCATION_COUNT];
+	int target_address;
+
+	if (image->data_size > 0 && options->gang_targets != 0)
+	{
+		printf("Data EEPROM can't be programmed in gang mode\n");
+		return 0;
+	}
+
+	if (image->data_size > 0 && !require_capability(CAP_DATA_MEMORY, "Programming data EEPROM"))
+		return 0;
+
+	if (options->profile != NULL && image->data_size > options->profile->data_size)
+	{
+		printf("Image has %d bytes of EEPROM data, but the pic%s only has %d\n",
+			image->data_size, options->profile->name, options->profile->data_size);
+		return 0;
+	}
+
+	if (!begin_session(options))
+		return 0;
+
+	metrics_begin_phase(PHASE_WRITE);
+	for (attempt = 0; !write_program_words(image, &next_word, options); attempt++)
+	{
+		if (attempt == MAX_RESUME_ATTEMPTS
+			|| !resume_write(next_word > 0 ? image_word(image, next_word - 1) : 0, next_word))
+			return 0;
+
+		metrics_count_resume();
+		printf("Resuming at word %d\n", next_word);
+	}
+
+	// The address is now past the last program word
+	target_address = image->instruction_count;
+	if (image->data_size > 0 && !write_data_memory(image, &target_address, options))
+		return 0;
+
+	return end_session(image->config_word,
+		image_id_locations(image, id_words) ? id_words : NULL, options);
+}
+
+static int program_stream_session(struct word_source *source,
+	const struct program_options *options)
+{
+	int history[STREAM_HISTORY];
+	int next_word = 0;
+	int received = 0;
+	int attempt;
+
+	if (!require_capability(CAP_STREAM, "Streaming"))
+		return 0;
+
+	if (!begin_session(options))
+		return 0;
+
+	metrics_begin_phase(PHASE_WRITE);
+	for (attempt = 0; !stream_program_words(source, history, &next_word, &received,
+		options); attempt++)
+	{
+		if (attempt == MAX_RESUME_ATTEMPTS
+			|| !resume_write(next_word > 0 ? history[(next_word - 1) % STREAM_HISTORY] : 0,
+			next_word))
+			return 0;
+
+		metrics_count_resume();
+		printf("\nResuming at word %d\n", next_word);
+	}
+
+	return end_session(source->config_word, NULL, options);
+}
+
+int program_image(const struct image *image, const struct program_options *options)
+{
+	int result;
+
+	metrics_begin_phase(PHASE_SETUP);
+	if (options->framed && !set_framing(1))
+	{
+		metrics_end_session(0);
+		return 0;
+	}
+
+	result = program_image_session(image, options);
+
+	// Leave the programmer in raw mode with one target for whoever talks to
+	// it next
+	if (options->gang_targets != 0 && !set_gang(0))
+		result = 0;
+
+	if (!set_framing(0))
+		result = 0;
+
+	metrics_end_session(result);
+	return result;
+}
+
+int program_stream(struct word_source *source, const struct program_options *options)
+{
+	int result;
+
+	metrics_begin_phase(PHASE_SETUP);
+	if (options->framed && !set_framing(1))
+	{
+		metrics_end_session(0);
+		return 0;
+	}
+
+	result = program_stream_session(source, options);
+
+	if (options->gang_targets != 0 && !set_gang(0))
+		result = 0;
+
+	if (!set_framing(0))
+		result = 0;
+
+	metrics_end_session(result);
+	return result;
+}
+
+int verify_image(const struct image *image, const struct program_options *options,
+	int report_all)
+{
+	int mismatches = 0;
+	int result;
+
+	metrics_begin_phase(PHASE_SETUP);
+	if (options->framed && !set_framing(1))
+	{
+		metrics_end_session(0);
+		return 0;
+	}
+
+	result = verify_image_session(image, options, report_all, &mismatches);
+	if (!set_framing(0))
+		result = 0;
+
+	if (result && mismatches > 0)
+	{
+		printf("\n%d %s differ%s from the image\n", mismatches,
+			mismatches == 1 ? "word" : "words", mismatches == 1 ? "s" : "");
+		result = 0;
+	}
+	else if (result && options->show_progress)
+		printf("\nTarget matches the image.\n");
+
+	metrics_end_session(result);
+	return result;
+}
@@ -0,0 +1,265 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// Host side of the serial protocol spoken by programmer.asm
+//
+
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+#include "image.h"
+#include "device.h"
+
+#define EXPECTED_PROTOCOL_VERSION 16
+
+// Oldest programmer firmware this host can drive, and the first version that
+// reports its capabilities with 'Q'.  For firmware before that, they are
+// inferred from the version.
+#define MIN_PROTOCOL_VERSION 1
+#define CAPABILITY_QUERY_VERSION 15
+
+// Programmer capabilities (programmer_capabilities.features), with the
+// commands they bring.  Firmware newer than this host may set bits it
+// doesn't know about.
+#define CAP_READ 0x0001			// A and R, so an interrupted write can resume
+#define CAP_FRAMING 0x0002		// F
+#define CAP_RX_BUFFER 0x0004	// Words may be sent ahead of their acks
+#define CAP_BLANK_CHECK 0x0008	// B
+#define CAP_STREAM 0x0010		// S
+#define CAP_ID_LOCATIONS 0x0020	// K
+#define CAP_TIMING 0x0040		// M
+#define CAP_GANG 0x0080			// G
+#define CAP_CAPTURE 0x0100		// L
+#define CAP_VERIFY 0x0200		// J, so configuration memory can be read
+#define CAP_PIC18 0x0400		// Z, block writes to PIC18 targets
+#define CAP_BAUD 0x0800			// U
+#define CAP_DATA_MEMORY 0x1000	// O
+#define CAP_PROFILE 0x2000		// Y
+
+// The programmer starts at this rate, and goes back to it after a break
+// (see reset_baud_rate)
+#define BASE_BAUD_RATE 9600
+
+// Most program words set_raw_window allows in flight.  The programmer
+// buffers 64 bytes from the host, and fewer are sent ahead if it reports a
+// smaller buffer.
+#define RAW_WINDOW_MAX 28
+
+// The programmer's Tprog and Tera waits are in ticks of this many
+// microseconds, and can't be set below MIN_PROGRAM_TIME.
+#define TIMING_TICK 10
+#define MIN_PROGRAM_TIME 1000
+
+// Words of program memory on the largest supported part (PIC16F648A), for
+// when the part isn't known.  On smaller parts, the extra words fail the
+// blank check.
+#define DEVICE_PROGRAM_SIZE 0x1000
+
+// Gang mode targets (see programmer.asm).  Each is identified by the PORTB
+// bit of its data line, except the one on RA3, which is always programmed.
+#define GANG_PRIMARY_TARGET 0x02
+#define GANG_TARGET_LINES 0xf9	// RB0 and RB3-RB7; RB1 and RB2 are the UART
+
+// What the programmer's firmware spends its time on, in the order 'Y' sends
+// the counts (see programmer.asm)
+enum programmer_phase
+{
+	PROGRAMMER_OTHER,		// Command handling, framing and checksums
+	PROGRAMMER_HOST_WAIT,	// Waiting for data from the host
+	PROGRAMMER_TARGET,		// Clocking bits to or from the target
+	PROGRAMMER_HOST_SEND,	// Waiting for the UART to send to the host
+	PROGRAMMER_DELAY,		// Tprog, Tera and other programming waits
+	PROGRAMMER_PHASE_COUNT
+};
+
+struct programmer_capabilities
+{
+	int version;		// Protocol version
+	int features;		// CAP_ bits
+	int buffer_size;	// Bytes of host data it buffers, or 0
+	int max_baud;		// Fastest rate 'U' can switch it to
+};
+
+struct program_options
+{
+	int show_progress;	// Draw a progress bar while programming
+	int run_after;		// Power the target up once it has been programmed
+	int framed;			// Use framed mode, which retransmits corrupted data
+	int blank_check;	// Skip the bulk erase if the target is already blank
+	const struct device_profile *profile;	// Timing to use, or NULL for the default
+	int gang_targets;	// Data lines of other targets to program at the same time
+};
+
+int write_octet(int value);
+int write_short(int value);
+int read_octet();
+int wait_for_ack();
+
+/// Draw an ascii progress bar
+void draw_progress_bar(int current, int max, const char *prefix);
+
+/// Switch the programmer between raw and framed mode.  In framed mode,
+/// write_octet and read_octet transparently carry data in frames with a CRC
+/// and sequence number, and retransmit frames that are corrupted.  If the
+/// programmer doesn't support framed mode, this stays in raw mode.
+/// @returns
+///   - 1 on success
+///   - 0 if an error occured
+int set_framing(int enable);
+
+/// Forget about framed mode without telling the programmer, after a
+/// session that failed part way or before talking to another programmer.
+/// The next check_protocol_version gets the programmer back to raw mode
+/// (see reset_baud_rate).
+void reset_framing();
+
+/// Set how many program words are sent ahead of their acks in raw mode.
+/// More hides more round trip latency, but more has to be resent after an
+/// error.  Limited to RAW_WINDOW_MAX.
+void set_raw_window(int words);
+
+/// Switch the programmer and the current port to another baud rate.  Only
+/// rates the programmer's clock can divide down to closely are allowed, and
+/// only in raw mode.
+/// @returns
+///   - 1 on success
+///   - 0 if an error occured
+///
+/// This will print an error message if an error occurs
+int set_baud_rate(int baud);
+
+/// Put the programmer and the current port back at BASE_BAUD_RATE, and the
+/// programmer in raw mode, whatever rate and mode it is in, and throw away
+/// anything it sent.
+/// @returns
+///   - 1 on success
+///   - 0 if the port's rate can't be changed, or an error occured
+int reset_baud_rate();
+
+/// Set how long the programmer waits for program and erase cycles to
+/// complete, from a device profile.  Until this is called, it uses the
+/// times for the PIC16F627A/628A/648A.
+/// @returns
+///   - 1 on success
+///   - 0 if an error occured
+int set_timing(const struct device_profile *profile);
+
+/// Parse a comma separated list of gang mode data lines, such as "rb0,rb3"
+/// @returns
+///   - A mask for program_options.gang_targets
+///   - -1 if the list is not valid
+int parse_gang_targets(const char *list);
+
+/// @returns the targets that failed in the last programming session in gang
+/// mode, including GANG_PRIMARY_TARGET if the one on RA3 did
+int gang_failed_targets();
+
+/// Query the programmer's protocol version, and its capabilities, which are
+/// used from then on to decide which features to use.
+/// @returns
+///   - 1 if the programmer responded with a version this host understands
+///   - 0 if an error occured
+///
+/// This will print an error message if an error occurs
+int check_protocol_version();
+
+/// @returns the capabilities of the programmer found by the last
+/// check_protocol_version (or set with set_capabilities)
+const struct programmer_capabilities *get_capabilities();
+
+/// Switch to the capabilities of another open programmer, for hosts that
+/// keep several open and select between them
+void set_capabilities(const struct programmer_capabilities *capabilities);
+
+/// Check that the programmer has a feature, printing an error naming the
+/// operation if it doesn't
+/// @returns
+///   - 1 if it has all of the CAP_ bits in features
+///   - 0 if it doesn't
+int require_capability(int features, const char *operation);
+
+/// Read the programmer's profiling counters, the milliseconds it spent in
+/// each programmer_phase since they were last read, and reset them.  Needs
+/// CAP_PROFILE.
+/// @returns
+///   - 1 on success
+///   - 0 if an error occured
+int read_programmer_profile(int *milliseconds);
+
+/// Check that program memory on the target is erased.  The programmer must
+/// be in programming mode.  This leaves the target's address past the last
+/// word checked.
+/// @returns
+///   - 1 on success, and first_used is set to the address of the first word
+///     that isn't erased, or -1 if all of them are
+///   - 0 if an error occured
+int check_blank(int count, int *first_used);
+
+/// @returns the number of program memory words on the target: the
+/// profile's, or DEVICE_PROGRAM_SIZE if there isn't one
+int target_program_words(const struct program_options *options);
+
+/// Erase the target, write the program, data EEPROM (if the image sets any),
+/// ID locations (if the image sets them) and configuration word from the
+/// image, and verify them.  The serial port must already be open and selected.
+/// In gang mode, this continues as long as any target is good.
+/// @returns
+///   - 1 if the target (all targets in gang mode) was programmed successfully
+///   - 0 if an error occured
+///
+/// This will print an error message if an error occurs
+int program_image(const struct image *image, const struct program_options *options);
+
+/// Read back program memory, data EEPROM and the ID locations (if the image
+/// sets them) and the configuration word, and compare them with the image, without
+/// programming anything.  Stops at the first word that differs, unless
+/// report_all is set.  Gang targets are ignored; only the one on RA3 is read.
+/// @returns
+///   - 1 if the target matches the image
+///   - 0 if it doesn't, or an error occured
+///
+/// This will print each word that differs, and an error message if an
+/// error occurs
+int verify_image(const struct image *image, const struct program_options *options,
+	int report_all);
+
+// Results of word_source.next_word
+#define WORD_SOURCE_OK 1		// *word is the next program word
+#define WORD_SOURCE_END 0		// There are no more words
+#define WORD_SOURCE_ERROR -1
+#define WORD_SOURCE_EMPTY -2	// No word is ready yet (only when not waiting)
+
+///
+/// Supplies program words, starting at address 0, for program_stream when
+/// the number of words isn't known up front.
+///
+struct word_source
+{
+	int (*next_word)(struct word_source *source, int *word, int wait);
+	int config_word;	// Valid once next_word has returned WORD_SOURCE_END
+};
+
+/// Like program_image, but writes words as the source produces them, so
+/// programming can start before the whole image is available.
+/// @returns
+///   - 1 if the target was programmed successfully
+///   - 0 if an error occured
+///
+/// This will print an error message if an error occurs
+int program_stream(struct word_source *source, const struct program_options *options);
+
+#endif
@@ -17,7 +17,35 @@
 #ifndef __SERIAL_H
 #define __SERIAL_H
 
-int init_serial();
+#define MAX_SERIAL_PORTS 8
+#define SERIAL_DEFAULT_TIMEOUT 1500	// milliseconds
+
+// Bytes in a full speed USB bulk packet.  FTDI adapters use two of each
+// packet they send the host for status.
+#define SERIAL_USB_PACKET_SIZE 64
+
+/// Set up ports opened from now on for a USB serial adapter.  Bytes written
+/// are collected and sent in transfers of up to SERIAL_USB_PACKET_SIZE,
+/// rather than each in its own, and are always sent before reading, waiting
+/// or changing the rate, so nothing waits for a response to something still
+/// held back.  The driver is also asked to pass received bytes on as soon as
+/// they arrive (ASYNC_LOW_LATENCY on Linux), instead of when the adapter's
+/// latency timer runs out, which is often 16 ms for a lone ack.  A port that
+/// doesn't support that gets a message but is still used.
+void set_serial_usb_mode(int enable);
+
+/// Open a serial port and make it the current port for write_serial and
+/// read_serial.  If port_name is NULL, the platform's default port is used.
+/// @returns
+///   - A handle (0 to MAX_SERIAL_PORTS - 1) on success
+///   - -1 if the port could not be opened
+int open_serial(const char *port_name);
+
+/// Make a previously opened port the target of write_serial and read_serial.
+void select_serial(int handle);
+
+/// Close a port opened with open_serial.
+void close_serial(int handle);
 
 /// @returns
 ///   - 0 on success
@@ -32,5 +60,28 @@ int write_serial(char c);
 ///   - -2 If there was a timeout reciving the character.
 int read_serial();
 
+/// Wait for the given number of milliseconds
+void serial_delay(int milliseconds);
+
+/// Change the baud rate of the current port.  Ports open at 9600 baud.
+/// @returns
+///   - 0 on success
+///   - -1 if the port can't be set to that rate
+int set_serial_baud(int baud);
+
+/// Send a break on the current port: hold the line low for longer than a
+/// frame, after anything still waiting to go out.
+/// @returns
+///   - 0 on success
+///   - -1 if the port can't send one
+int send_serial_break();
+
+/// Set how long write_serial and read_serial wait on the current port
+/// before reporting a timeout.  Ports open with SERIAL_DEFAULT_TIMEOUT.
+void set_serial_timeout(int milliseconds);
+
+/// Throw away anything received on the current port that hasn't been read
+void flush_serial();
+
 #endif
 
@@ -0,0 +1,350 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#include "serial.h"
+#include "capture.h"
+
+#define DEFAULT_SERIAL_PORT "/dev/ttyUSB0"
+
+static int serialFds[MAX_SERIAL_PORTS];
+static int serialFdValid[MAX_SERIAL_PORTS];
+static int serialTimeouts[MAX_SERIAL_PORTS];
+static int serialCoalesce[MAX_SERIAL_PORTS];
+static unsigned char writeBuffers[MAX_SERIAL_PORTS][SERIAL_USB_PACKET_SIZE];
+static int writeLengths[MAX_SERIAL_PORTS];
+static int serialFd = -1;
+static int serialTimeout = SERIAL_DEFAULT_TIMEOUT;
+static int serialHandle = -1;
+static int usbMode = 0;
+
+static int write_pending(int handle);
+
+void set_serial_usb_mode(int enable)
+{
+	usbMode = enable;
+}
+
+///
+/// Ask the driver to hand received bytes over as soon as they arrive.  For
+/// FTDI adapters, Linux turns this into a 1 ms latency timer.
+///
+static void set_low_latency(int fd, const char *port_name)
+{
+#ifdef __linux__
+	struct serial_struct serial;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) == 0)
+	{
+		serial.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &serial) == 0)
+			return;
+	}
+#endif
+
+	printf("%s doesn't support low latency mode\n", port_name);
+}
+
+int open_serial(const char *port_name)
+{
+	struct termios portState;
+	int handle;
+	int fd;
+
+	for (handle = 0; handle < MAX_SERIAL_PORTS; handle++)
+	{
+		if (!serialFdValid[handle])
+			break;
+	}
+
+	if (handle == MAX_SERIAL_PORTS)
+	{
+		printf("Too many serial ports open\n");
+		return -1;
+	}
+
+	if (port_name == NULL)
+		port_name = DEFAULT_SERIAL_PORT;
+
+	fd = open(port_name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+	{
+		printf("Error opening serial port %s: %s\n", port_name, strerror(errno));
+		return -1;
+	}
+
+	// Keep anything else, such as discovery in another instance, from
+	// opening the port and talking to the programmer while it is in use.
+	ioctl(fd, TIOCEXCL);
+
+	if (tcgetattr(fd, &portState) < 0)
+	{
+		printf("tcgetattr failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	// 9600 baud, 8 data bits, no parity, one stop bit, no flow control
+	cfmakeraw(&portState);
+	cfsetispeed(&portState, B9600);
+	cfsetospeed(&portState, B9600);
+	portState.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS | HUPCL);
+	portState.c_cflag |= CLOCAL | CREAD | CS8;
+	portState.c_iflag &= ~(IXON | IXOFF | IXANY);
+	portState.c_cc[VMIN] = 0;
+	portState.c_cc[VTIME] = 0;
+
+	if (tcsetattr(fd, TCSANOW, &portState) < 0)
+	{
+		printf("tcsetattr failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	tcflush(fd, TCIOFLUSH);
+
+	if (usbMode)
+		set_low_latency(fd, port_name);
+
+	serialFds[handle] = fd;
+	serialFdValid[handle] = 1;
+	serialTimeouts[handle] = SERIAL_DEFAULT_TIMEOUT;
+	serialCoalesce[handle] = usbMode;
+	writeLengths[handle] = 0;
+	select_serial(handle);
+
+	return handle;
+}
+
+void select_serial(int handle)
+{
+	if (serialHandle != handle)
+		write_pending(serialHandle);
+
+	serialFd = serialFds[handle];
+	serialTimeout = serialTimeouts[handle];
+	serialHandle = handle;
+	capture_select(handle);
+}
+
+void close_serial(int handle)
+{
+	if (!serialFdValid[handle])
+		return;
+
+	write_pending(handle);
+	if (serialFd == serialFds[handle])
+	{
+		serialFd = -1;
+		serialHandle = -1;
+	}
+
+	close(serialFds[handle]);
+	serialFdValid[handle] = 0;
+}
+
+static int write_port(int fd, const unsigned char *data, int length)
+{
+	struct pollfd pfd;
+	int result;
+	int written;
+
+	while (length > 0)
+	{
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		result = poll(&pfd, 1, serialTimeout);
+		if (result < 0)
+		{
+			printf("poll: %s\n", strerror(errno));
+			return -1;
+		}
+		else if (result == 0)
+		{
+			printf("Write timeout\n");
+			return -2;
+		}
+
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+			return -1;
+
+		written = write(fd, data, length);
+		if (written <= 0)
+		{
+			printf("write: %s\n", strerror(errno));
+			return -1;
+		}
+
+		data += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+///
+/// Send the bytes collected for a port in USB mode
+///
+static int write_pending(int handle)
+{
+	int length;
+
+	if (handle < 0 || writeLengths[handle] == 0)
+		return 0;
+
+	length = writeLengths[handle];
+	writeLengths[handle] = 0;
+	return write_port(serialFds[handle], writeBuffers[handle], length);
+}
+
+static int read_port()
+{
+	struct pollfd pfd;
+	unsigned char c;
+	int result;
+
+	result = write_pending(serialHandle);
+	if (result < 0)
+		return result;
+
+	pfd.fd = serialFd;
+	pfd.events = POLLIN;
+	result = poll(&pfd, 1, serialTimeout);
+	if (result < 0)
+	{
+		printf("poll: %s\n", strerror(errno));
+		return -1;
+	}
+	else if (result == 0)
+	{
+		printf("Read timeout\n");
+		return -2;
+	}
+
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return -1;
+
+	// A readable descriptor that returns no data means the device has gone
+	// away (for example, a USB adapter that was unplugged).
+	if (read(serialFd, &c, 1) != 1)
+		return -1;
+
+	return c;
+}
+
+int write_serial(char c)
+{
+	int result;
+
+	if (serialHandle >= 0 && serialCoalesce[serialHandle])
+	{
+		// Anything that fails to go out will show up as an error on the
+		// read that sends it
+		writeBuffers[serialHandle][writeLengths[serialHandle]++] = c;
+		result = 0;
+		if (writeLengths[serialHandle] == SERIAL_USB_PACKET_SIZE)
+			result = write_pending(serialHandle);
+	}
+	else
+		result = write_port(serialFd, (unsigned char*) &c, 1);
+
+	capture_write(c, result);
+	return result;
+}
+
+int read_serial()
+{
+	int result = read_port();
+
+	capture_read(result);
+	return result;
+}
+
+void serial_delay(int milliseconds)
+{
+	write_pending(serialHandle);
+	poll(NULL, 0, milliseconds);
+}
+
+int set_serial_baud(int baud)
+{
+	struct termios portState;
+	speed_t speed;
+
+	switch (baud)
+	{
+		case 9600:
+			speed = B9600;
+			break;
+
+		case 19200:
+			speed = B19200;
+			break;
+
+		case 38400:
+			speed = B38400;
+			break;
+
+		default:
+			return -1;
+	}
+
+	// Let anything already written go out at the old rate
+	if (write_pending(serialHandle) < 0 || tcdrain(serialFd) < 0
+		|| tcgetattr(serialFd, &portState) < 0)
+		return -1;
+
+	cfsetispeed(&portState, speed);
+	cfsetospeed(&portState, speed);
+	if (tcsetattr(serialFd, TCSANOW, &portState) < 0)
+	{
+		printf("tcsetattr failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int send_serial_break()
+{
+	if (write_pending(serialHandle) < 0 || tcdrain(serialFd) < 0
+		|| tcsendbreak(serialFd, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+void set_serial_timeout(int milliseconds)
+{
+	serialTimeout = milliseconds;
+	if (serialHandle >= 0)
+		serialTimeouts[serialHandle] = milliseconds;
+}
+
+void flush_serial()
+{
+	tcflush(serialFd, TCIFLUSH);
+}
@@ -0,0 +1,409 @@
+// 
+// Copyright 2005-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+// A serial backend that replays a capture recorded with capture.c instead of
+// talking to a programmer.  Link it in place of serial_posix.c or
+// serial_win32.c.  The port name is the capture file, optionally followed by
+// @<speed>: @1 (the default) replays with the original timing, @10 ten times
+// faster, and @0 with no delays at all.
+//
+// The speed can be followed by :<milliseconds> to model a USB serial adapter
+// with that latency timer, such as @1:16 for an FTDI adapter's default.  The
+// adapter holds on to what the programmer sends until the timer runs out,
+// so for a session captured on a link without one, this shows what such an
+// adapter would cost.  In USB mode (see set_serial_usb_mode), the driver is
+// taken to have set the timer to 1 ms, as Linux does for FTDI adapters.
+//
+// Writes must match the bytes that were recorded, in order, or the replay
+// stops with an error.  Reads return what the programmer sent.  A response
+// isn't available until everything written before it in the capture has
+// been written again, so a host that reads too early times out as it would
+// with a real programmer.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <poll.h>
+#endif
+#include "serial.h"
+#include "capture.h"
+#include "metrics.h"
+
+#define MAX_CAPTURE_NAME 1024
+#define LOW_LATENCY_TIMER 1000		// microseconds
+
+struct capture_record
+{
+	unsigned long long time;		// Microseconds since the capture started
+	int type;
+	int value;
+	unsigned long long replayed;	// When this was replayed, in replay time
+};
+
+static struct capture_record *records = NULL;
+static int record_count;
+static int next_write;
+static int next_read;
+static int replay_open = 0;
+static int replay_failed;
+static double replay_speed;
+static unsigned long long replay_start;
+static int replay_timeout = SERIAL_DEFAULT_TIMEOUT;
+static unsigned long long latency_timer;	// Microseconds, 0 for none
+static unsigned long long packet_deadline;
+static int usb_mode = 0;
+
+static unsigned long long replay_time()
+{
+	return (unsigned long long) (metrics_now() * 1000000) - replay_start;
+}
+
+static void sleep_us(unsigned long long microseconds)
+{
+#ifdef _WIN32
+	Sleep((DWORD) (microseconds / 1000));
+#else
+	poll(NULL, 0, (int) (microseconds / 1000));
+#endif
+}
+
+/// Scale a recorded interval by the replay speed
+static unsigned long long scale(unsigned long long microseconds)
+{
+	if (replay_speed == 0)
+		return 0;
+
+	return (unsigned long long) (microseconds / replay_speed);
+}
+
+static int load_capture(const char *path)
+{
+	char magic[4];
+	unsigned long long time = 0;
+	unsigned long long delta;
+	int allocated = 0;
+	int shift;
+	int c;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		perror("error opening capture");
+		return -1;
+	}
+
+	if (fread(magic, 1, 4, f) != 4 || memcmp(magic, CAPTURE_MAGIC, 4) != 0
+		|| fgetc(f) != CAPTURE_VERSION)
+	{
+		printf("%s is not a capture file\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	record_count = 0;
+	while ((c = fgetc(f)) != EOF)
+	{
+		delta = 0;
+		shift = 0;
+		while (c != EOF && (c & 0x80))
+		{
+			// Bits past the 64th can only come from a corrupt file
+			if (shift < 64)
+			{
+				delta |= (unsigned long long) (c & 0x7f) << shift;
+				shift += 7;
+			}
+
+			c = fgetc(f);
+		}
+
+		if (c == EOF)
+			break;	// Truncated in the middle of a timestamp
+
+		if (shift < 64)
+			delta |= (unsigned long long) c << shift;
+
+		time += delta;
+		if (record_count == allocated)
+		{
+			allocated = allocated ? allocated * 2 : 4096;
+			records = realloc(records, allocated * sizeof(struct capture_record));
+			if (records == NULL)
+			{
+				printf("out of memory loading capture\n");
+				fclose(f);
+				return -1;
+			}
+		}
+
+		records[record_count].time = time;
+		records[record_count].type = fgetc(f);
+		records[record_count].value = fgetc(f);
+		if (records[record_count].value == EOF)
+			break;	// Truncated, as when the host was killed
+
+		records[record_count].replayed = 0;
+		record_count++;
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+static void print_summary()
+{
+	int unused = 0;
+	int i;
+
+	for (i = next_write; i < record_count; i++)
+	{
+		if (records[i].type == CAPTURE_WRITE || records[i].type == CAPTURE_WRITE_ERROR)
+			unused++;
+	}
+
+	for (i = next_read; i < record_count; i++)
+	{
+		if (records[i].type != CAPTURE_WRITE && records[i].type != CAPTURE_WRITE_ERROR
+			&& records[i].type != CAPTURE_OPEN)
+			unused++;
+	}
+
+	printf("replay: %.1f ms, captured session took %.1f ms",
+		replay_time() / 1000.0, record_count > 0 ? records[record_count - 1].time / 1000.0 : 0.0);
+	if (unused > 0)
+		printf(", %d records not replayed", unused);
+
+	printf("\n");
+}
+
+int open_serial(const char *port_name)
+{
+	char path[MAX_CAPTURE_NAME];
+	char *speed;
+	char *latency;
+
+	if (replay_open)
+	{
+		printf("Only one capture can be replayed at a time\n");
+		return -1;
+	}
+
+	if (port_name == NULL || strlen(port_name) >= MAX_CAPTURE_NAME)
+	{
+		printf("Give the capture to replay as the port name\n");
+		return -1;
+	}
+
+	strcpy(path, port_name);
+	replay_speed = 1;
+	latency_timer = 0;
+	speed = strrchr(path, '@');
+	if (speed != NULL)
+	{
+		*speed++ = '\0';
+		latency = strchr(speed, ':');
+		if (latency != NULL)
+		{
+			*latency++ = '\0';
+			latency_timer = (unsigned long long) (atof(latency) * 1000);
+			if (usb_mode && latency_timer > LOW_LATENCY_TIMER)
+				latency_timer = LOW_LATENCY_TIMER;
+		}
+
+		replay_speed = *speed != '\0' ? atof(speed) : 1;
+	}
+
+	if (load_capture(path) < 0)
+		return -1;
+
+	next_write = 0;
+	next_read = 0;
+	packet_deadline = 0;
+	replay_failed = 0;
+	replay_open = 1;
+	replay_start = (unsigned long long) (metrics_now() * 1000000);
+	atexit(print_summary);
+
+	return 0;
+}
+
+void set_serial_usb_mode(int enable)
+{
+	usb_mode = enable;
+}
+
+void select_serial(int handle)
+{
+	(void) handle;
+}
+
+void close_serial(int handle)
+{
+	(void) handle;
+	replay_open = 0;
+}
+
+///
+/// Find the next record at or after index that is a write (if writes is set)
+/// or a read result.
+///
+static int find_record(int index, int writes)
+{
+	int is_write;
+
+	while (index < record_count)
+	{
+		is_write = records[index].type == CAPTURE_WRITE
+			|| records[index].type == CAPTURE_WRITE_ERROR;
+		if (records[index].type != CAPTURE_OPEN && is_write == writes)
+			break;
+
+		index++;
+	}
+
+	return index;
+}
+
+int write_serial(char c)
+{
+	struct capture_record *record;
+
+	if (replay_failed)
+		return -1;
+
+	next_write = find_record(next_write, 1);
+	if (next_write == record_count)
+	{
+		printf("replay: the host wrote past the end of the capture\n");
+		replay_failed = 1;
+		return -1;
+	}
+
+	record = &records[next_write];
+	if (record->value != (c & 0xff))
+	{
+		printf("replay: diverged from the capture at record %d: wrote %02x, expected %02x\n",
+			next_write, c & 0xff, record->value);
+		replay_failed = 1;
+		return -1;
+	}
+
+	record->replayed = replay_time();
+	next_write++;
+
+	return record->type == CAPTURE_WRITE ? 0 : -1;
+}
+
+int read_serial()
+{
+	struct capture_record *record;
+	unsigned long long ready;
+	unsigned long long now;
+	int previous;
+
+	if (replay_failed)
+		return -1;
+
+	next_read = find_record(next_read, 0);
+	if (next_read == record_count)
+	{
+		printf("replay: the host read past the end of the capture\n");
+		replay_failed = 1;
+		return -1;
+	}
+
+	record = &records[next_read];
+	if (find_record(next_write, 1) < next_read)
+	{
+		// The programmer hadn't been sent what it responded to yet
+		sleep_us(scale(replay_timeout * 1000ULL));
+		printf("Read timeout\n");
+		return -2;
+	}
+
+	// Reproduce the delay between the previous record and this one
+	previous = next_read - 1;
+	while (previous >= 0 && records[previous].type == CAPTURE_OPEN)
+		previous--;
+
+	if (previous >= 0)
+		ready = records[previous].replayed + scale(record->time - records[previous].time);
+	else
+		ready = scale(record->time);
+
+	// The adapter sends everything received since the timer started when it
+	// runs out.  At the programmer's baud rates, that always happens before
+	// a packet fills up.
+	if (latency_timer > 0)
+	{
+		if (ready > packet_deadline)
+			packet_deadline = ready + scale(latency_timer);
+
+		ready = packet_deadline;
+	}
+
+	now = replay_time();
+	if (ready > now)
+		sleep_us(ready - now);
+
+	record->replayed = replay_time();
+	next_read++;
+
+	if (record->type == CAPTURE_READ)
+		return record->value;
+	else if (record->type == CAPTURE_TIMEOUT)
+	{
+		printf("Read timeout\n");
+		return -2;
+	}
+
+	return -1;
+}
+
+void serial_delay(int milliseconds)
+{
+	sleep_us(scale(milliseconds * 1000ULL));
+}
+
+// A capture doesn't record the rate, and the link tuner would measure the
+// replay rather than a port, so tuning is refused (see link.c).
+int set_serial_baud(int baud)
+{
+	(void) baud;
+	return -1;
+}
+
+// The capture only has the bytes around it
+int send_serial_break()
+{
+	return 0;
+}
+
+void set_serial_timeout(int milliseconds)
+{
+	replay_timeout = milliseconds;
+}
+
+void flush_serial()
+{
+}
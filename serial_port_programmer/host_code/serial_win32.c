@@ -16,12 +16,31 @@
 
 #include <windows.h>
 #include "serial.h"
+#include "capture.h"
 
-#define SERIAL_TIMEOUT 1500
+#define DEFAULT_SERIAL_PORT "COM4"
+#define SERIAL_BREAK_TIME 250	// milliseconds, as long as tcsendbreak's
 
+static HANDLE serialPorts[MAX_SERIAL_PORTS];
+static HANDLE readEvents[MAX_SERIAL_PORTS];
+static HANDLE writeEvents[MAX_SERIAL_PORTS];
+static int serialTimeouts[MAX_SERIAL_PORTS];
+static int serialCoalesce[MAX_SERIAL_PORTS];
+static unsigned char writeBuffers[MAX_SERIAL_PORTS][SERIAL_USB_PACKET_SIZE];
+static int writeLengths[MAX_SERIAL_PORTS];
 static HANDLE serialPort = 0;
 static HANDLE readEvent = 0;
 static HANDLE writeEvent = 0;
+static int serialTimeout = SERIAL_DEFAULT_TIMEOUT;
+static int serialHandle = -1;
+static int usbMode = 0;
+
+static int write_pending(int handle);
+
+void set_serial_usb_mode(int enable)
+{
+	usbMode = enable;
+}
 
 static void print_error()
 {
@@ -32,40 +51,62 @@ static void print_error()
 	printf("%s\n", messageBuffer);
 }
 
-int init_serial()
+int open_serial(const char *port_name)
 {
 	DCB portState;
+	HANDLE port;
+	int handle;
+
+	for (handle = 0; handle < MAX_SERIAL_PORTS; handle++)
+	{
+		if (serialPorts[handle] == 0)
+			break;
+	}
+
+	if (handle == MAX_SERIAL_PORTS)
+	{
+		printf("Too many serial ports open\n");
+		return -1;
+	}
 
-	serialPort = CreateFile("COM4", GENERIC_READ | GENERIC_WRITE,
+	if (port_name == NULL)
+		port_name = DEFAULT_SERIAL_PORT;
+
+	port = CreateFile(port_name, GENERIC_READ | GENERIC_WRITE,
 		0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
-	if (serialPort == INVALID_HANDLE_VALUE)
+	if (port == INVALID_HANDLE_VALUE)
 	{
 		printf("Error opening serial port\n");
 		print_error();
-		return 0;
+		return -1;
 	}
 
-	readEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (!readEvent)
+	serialPorts[handle] = port;
+	serialTimeouts[handle] = SERIAL_DEFAULT_TIMEOUT;
+	readEvents[handle] = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!readEvents[handle])
 	{
 		printf("Error creating read event\n");
 		print_error();
-		return 0;
+		close_serial(handle);
+		return -1;
 	}
 
-	writeEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (!writeEvent)
+	writeEvents[handle] = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!writeEvents[handle])
 	{
 		printf("Error creating write event\n");
 		print_error();
-		return 0;
+		close_serial(handle);
+		return -1;
 	}
 
-	if (!GetCommState(serialPort, &portState))
+	if (!GetCommState(port, &portState))
 	{
 		printf("GetCommState failed\n");
 		print_error();
-		return 0;
+		close_serial(handle);
+		return -1;
 	}
 
 	portState.BaudRate = CBR_9600;
@@ -82,33 +123,83 @@ int init_serial()
 	portState.Parity = NOPARITY;
 
 
-	if (!SetCommState(serialPort, &portState))
+	if (!SetCommState(port, &portState))
 	{
 		printf("SetCommState failed\n");
 		print_error();
-		return 0;
+		close_serial(handle);
+		return -1;
 	}
 
-	return 1;
+	// The latency timer of a USB adapter is a setting of its driver, which
+	// can't be reached through the comm API
+	if (usbMode)
+		printf("%s doesn't support low latency mode, set the adapter's latency timer in its driver\n",
+			port_name);
+
+	serialCoalesce[handle] = usbMode;
+	writeLengths[handle] = 0;
+	select_serial(handle);
+
+	return handle;
 }
 
-int write_serial(char c)
+void select_serial(int handle)
+{
+	if (serialHandle != handle)
+		write_pending(serialHandle);
+
+	serialPort = serialPorts[handle];
+	readEvent = readEvents[handle];
+	writeEvent = writeEvents[handle];
+	serialTimeout = serialTimeouts[handle];
+	serialHandle = handle;
+	capture_select(handle);
+}
+
+void close_serial(int handle)
+{
+	if (serialPorts[handle] == 0)
+		return;
+
+	write_pending(handle);
+	if (serialPort == serialPorts[handle])
+	{
+		serialPort = 0;
+		readEvent = 0;
+		writeEvent = 0;
+		serialHandle = -1;
+	}
+
+	if (writeEvents[handle])
+		CloseHandle(writeEvents[handle]);
+
+	if (readEvents[handle])
+		CloseHandle(readEvents[handle]);
+
+	CloseHandle(serialPorts[handle]);
+	serialPorts[handle] = 0;
+	readEvents[handle] = 0;
+	writeEvents[handle] = 0;
+}
+
+static int write_port(HANDLE port, HANDLE event, const unsigned char *data, int length)
 {
 	OVERLAPPED overlap;
 	DWORD written;
 
-	overlap.hEvent = writeEvent;
+	overlap.hEvent = event;
 	overlap.Offset = 0;
 	overlap.OffsetHigh = 0;
 
-	if (!WriteFile(serialPort, &c, 1, &written, &overlap) && GetLastError() != ERROR_IO_PENDING)
+	if (!WriteFile(port, data, length, &written, &overlap) && GetLastError() != ERROR_IO_PENDING)
 	{
 		printf("WriteFile\n");
 		print_error();
 		return -1;
 	}
 
-	if (WaitForSingleObject(writeEvent, SERIAL_TIMEOUT) != WAIT_OBJECT_0)
+	if (WaitForSingleObject(event, serialTimeout) != WAIT_OBJECT_0)
 	{
 		printf("Write timeout\n");
 		return -2;
@@ -117,11 +208,31 @@ int write_serial(char c)
 	return 0;
 }
 
-int read_serial()
+///
+/// Send the bytes collected for a port in USB mode
+///
+static int write_pending(int handle)
+{
+	int length;
+
+	if (handle < 0 || writeLengths[handle] == 0)
+		return 0;
+
+	length = writeLengths[handle];
+	writeLengths[handle] = 0;
+	return write_port(serialPorts[handle], writeEvents[handle], writeBuffers[handle], length);
+}
+
+static int read_port()
 {
 	OVERLAPPED overlap;
 	unsigned char c = 0x55;
 	DWORD bytesRead;
+	int result;
+
+	result = write_pending(serialHandle);
+	if (result < 0)
+		return result;
 
 	overlap.hEvent = readEvent;
 	overlap.Offset = 0;
@@ -133,7 +244,7 @@ int read_serial()
 		return -1;
 	}
 
-	if (WaitForSingleObject(readEvent, SERIAL_TIMEOUT) != WAIT_OBJECT_0)
+	if (WaitForSingleObject(readEvent, serialTimeout) != WAIT_OBJECT_0)
 	{
 		printf("Read timeout\n");
 		return -2;
@@ -142,4 +253,78 @@ int read_serial()
 	return c;
 }
 
+int write_serial(char c)
+{
+	int result;
+
+	if (serialHandle >= 0 && serialCoalesce[serialHandle])
+	{
+		// Anything that fails to go out will show up as an error on the
+		// read that sends it
+		writeBuffers[serialHandle][writeLengths[serialHandle]++] = c;
+		result = 0;
+		if (writeLengths[serialHandle] == SERIAL_USB_PACKET_SIZE)
+			result = write_pending(serialHandle);
+	}
+	else
+		result = write_port(serialPort, writeEvent, (unsigned char*) &c, 1);
+
+	capture_write(c, result);
+	return result;
+}
+
+int read_serial()
+{
+	int result = read_port();
+
+	capture_read(result);
+	return result;
+}
+
+void serial_delay(int milliseconds)
+{
+	write_pending(serialHandle);
+	Sleep(milliseconds);
+}
+
+int set_serial_baud(int baud)
+{
+	DCB portState;
+
+	if (write_pending(serialHandle) < 0 || !FlushFileBuffers(serialPort)
+		|| !GetCommState(serialPort, &portState))
+		return -1;
+
+	portState.BaudRate = baud;
+	if (!SetCommState(serialPort, &portState))
+	{
+		printf("SetCommState failed\n");
+		print_error();
+		return -1;
+	}
+
+	return 0;
+}
+
+int send_serial_break()
+{
+	if (write_pending(serialHandle) < 0 || !FlushFileBuffers(serialPort)
+		|| !SetCommBreak(serialPort))
+		return -1;
+
+	Sleep(SERIAL_BREAK_TIME);
+	ClearCommBreak(serialPort);
+	return 0;
+}
 
+void set_serial_timeout(int milliseconds)
+{
+	serialTimeout = milliseconds;
+	if (serialHandle >= 0)
+		serialTimeouts[serialHandle] = milliseconds;
+}
+
+void flush_serial()
+{
+	PurgeComm(serialPort, PURGE_RXCLEAR);
+}
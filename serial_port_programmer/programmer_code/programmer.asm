@@ -29,13 +29,235 @@
 ;;
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-PROTOCOL_VERSION		equ		1
+PROTOCOL_VERSION		equ		16
+
+; Host commands.  Each is a single character, followed by arguments.  Unless
+; noted, the programmer responds with '+' on success or 'E' and an error code.
+;   V                       Get protocol version (responds with version byte)
+;   Q                       Get capabilities.  Responds with the CAP_ bits
+;                           (16 bits), the size of the receive buffer and
+;                           the smallest divisor U takes.
+;   P                       Enter programming mode (address resets to 0)
+;   X                       Exit programming mode
+;   E                       Bulk erase program memory
+;   W count16 {word16}      Write and verify program words.  Each word is
+;                           acked.  Ends with 'D' and a 16 bit checksum.
+;                           Received data is buffered (see rx_ring), so the
+;                           host may send words ahead of the acks.
+;   S {word16} 0x8000       Like W, but for a stream of unknown length.  A
+;                           word with the top bit set ends it.
+;   C word16                Write configuration word
+;   K {word16 x4} word16    Write the ID locations (0x2000-0x2003), then the
+;                           configuration word
+;   A count16               Advance the address by count words
+;   R count16               Read count words from the current address,
+;                           advancing past each.  Responds with the words.
+;   J                       Jump to configuration memory.  The address
+;                           becomes 0x2000 (the ID locations), so the device
+;                           ID and configuration word can be read with R.
+;                           Only P moves it back to program memory.
+;   B count16               Check that count words from the current address
+;                           are erased.  Responds with '+' if they are, or
+;                           '-' and the 16 bit offset of the first one that
+;                           isn't.  The address is left past the last word
+;                           checked.
+;   F n                     n = 1 switches to framed mode, 0 back to raw.
+;                           A break (see U) also goes back to raw mode.
+;   M tprog16 tera16        Set the Tprog and Tera waits, in 10 us ticks.
+;                           Values under TIMING_MIN are rejected with
+;                           ERROR_BAD_PARAMETER and the old ones are kept.
+;   G targets               Gang mode: also program the targets whose data
+;                           lines are the PORTB bits set in targets (see
+;                           below).  0 goes back to one target.  Responds
+;                           with ERROR_BAD_PARAMETER if the UART's pins are
+;                           included.
+;   L period8 op [word16]   Logic capture: sample the PORTA pins every period
+;                           us while doing one operation, then respond with
+;                           '+', a count byte and that many samples (see
+;                           below).
+;                           op is 'E' (bulk erase), 'R' (read the word at
+;                           the current address) or 'W' (write and verify
+;                           word16 at the current address).  Only available
+;                           in raw mode.
+;   Z op ...                PIC18 targets (see below).  Not available in
+;                           gang mode.
+;   O n                     n = 1 switches W, R, A and E to data EEPROM,
+;                           0 back to program memory.  P also switches back.
+;                           Data memory is addressed by the low bits of the
+;                           same address as program memory, so the host
+;                           moves to a byte with A.  Each byte is a word
+;                           with the data in bits 1-8 (as program words are
+;                           sent, shifted left one).  E erases all of data
+;                           memory.  Writes wait Tera rather than Tprog.
+;                           Not available in gang mode.
+;   U divisor8              Change the baud rate to Fosc / (16 * (divisor8 +
+;                           1)).  The ack is sent at the old rate, and the
+;                           new one is used once it has gone out.  A break
+;                           from the host (a zero byte with a framing error)
+;                           goes back to BAUD_DIVISOR_DEFAULT and raw mode,
+;                           abandoning the current command, so a host that
+;                           has lost track of the rate or framing can always
+;                           recover.  Other framing errors, such as noise,
+;                           keep the rate.  Only available in raw mode,
+;                           and divisors below BAUD_DIVISOR_MIN (the fastest
+;                           rate, reported by Q) are refused.
+;   Y                       Get and reset the profiling counters (see
+;                           below).  Responds with five 16 bit counts.
+;   I n                     I/O control (see cmd_io)
+;   T                       Test
+;
+; In gang mode, several targets share Vpp, nVDD and PGM_CLOCK, which must be
+; buffered to drive them, and each has its own data line.  The one on RA3 is
+; always used, and the others are on PORTB.  Targets are identified by the
+; PORTB bit of their data line, with bit 1 (the UART's RX pin) standing for
+; the RA3 target.  Everything written is sent to all of them, and readback
+; after each write is checked on each.  A target that fails is reported once,
+; by acking with 'G' and a bitmap of the targets that just failed in place of
+; '+', and is no longer checked until the next 'G' command.  It is only an
+; error (ERROR_VERIFY) when every target has failed.  Reads and blank checks
+; only use the RA3 target.
+;
+; Logic capture samples are run length encoded.  The high nibble of each is
+; RA0-RA3 (VPP, nVDD, PGM_CLOCK, PGM_DATA), and the low nibble is the number
+; of periods they stayed that way, minus one.  Sampling is done by the Timer 2
+; interrupt, which takes about 40 cycles, so it stretches the operation it is
+; measuring and can't resolve single bits.  It is meant for the longer waits
+; (Tprog, Tera, and the gaps between commands).  If the buffer fills, the rest
+; of the operation isn't captured.
+;
+; For profiling, Timer 1 interrupts every PROFILE_PERIOD cycles (about 1 ms),
+; and the interrupt handler counts a sample for what the mainline code is
+; doing at the time: waiting for the host in uart_recv, clocking bits to or
+; from the target, waiting on the UART to send to the host, sitting in delay
+; or delay_ticks (Tprog, Tera and the other programming waits), or anything
+; else (command handling, framing, checksums).  'Y' sends the counts in that
+; order, starting with anything else, and clears them.  Each wraps after
+; about 65 seconds, so the host clears them at the start of a session.
+;
+; PIC18 (16 bit core) targets have a different ICSP protocol, with 4 bit
+; commands that each take 16 bits of data, and are programmed a write buffer
+; at a time through table writes.  They have their own commands, which
+; replace P, E, W, C/K and R.  X exits programming mode as usual.
+;   Z P                     Enter programming mode, with Vdd before Vpp
+;   Z A addr24              Set the table pointer
+;   Z E                     Chip erase, waiting Tera
+;   Z W count8 {byte}       Write count bytes from the table pointer, which
+;                           must be at the start of a write buffer.  count
+;                           must be even, and at most the part's write
+;                           buffer size.  Programming waits Tprog, then the
+;                           block is read back and its checksum compared
+;                           with the one of the data received (there is no
+;                           room to keep the block).  Responds with '+', or
+;                           ERROR_VERIFY and the readback checksum.
+;   Z C byte                Write a configuration byte at the table
+;                           pointer, waiting Tprog
+;   Z R count16             Read count bytes from the table pointer.
+;                           Responds with the bytes.
+; Z W and Z C leave the table pointer past what they wrote, so consecutive
+; ones don't need a Z A.  Z R doesn't move the address they use.
+;
+; In framed mode, the command stream is carried in frames with a sequence
+; number and CRC, so corrupted data is retransmitted rather than killing the
+; session.  All CRCs are CRC-16-CCITT (polynomial 0x1021, initial value
+; 0xffff), most significant byte first.
+;   Host:       FRAME_START seq length payload crc16
+;   Programmer: FRAME_START status seq length payload crc16
+; The CRC covers everything between FRAME_START and the CRC.  Once the
+; programmer has consumed a frame's payload, it answers with a FRAME_ACK
+; frame carrying the frame's sequence number and everything the commands in
+; it sent back.  A frame with a bad CRC, bad length, or that isn't the next
+; in sequence is answered with an empty FRAME_NAK frame carrying the sequence
+; number the programmer expects.  A repeat of the last frame is answered by
+; resending its response.
 
 ; Error codes
 ERROR_OVERFLOW			equ		'1'
 ERROR_FRAMING			equ		'2'
 ERROR_VERIFY			equ		'3'
 ERROR_BAD_COMMAND		equ		'4'
+ERROR_BAD_PARAMETER		equ		'5'
+
+; Programming waits, in 10 us ticks (see delay_ticks).  The defaults are for
+; the PIC16F627A/628A/648A.  The host can change them with 'M'.
+TPROG_DEFAULT			equ		.250	; 2.5 ms
+TERA_DEFAULT			equ		.600	; 6 ms
+TIMING_MIN				equ		.100	; 1 ms, no flash part is faster
+
+; UART baud rate divisor (SPBRG, with BRGH set) at reset, and the smallest
+; that is close to a standard rate
+BAUD_DIVISOR_DEFAULT	equ		.25		; 9600 baud
+BAUD_DIVISOR_MIN		equ		.12		; 19200 baud (0.2% fast)
+
+; Capabilities reported by 'Q', one bit per feature, so the host can use
+; the ones it knows about and fall back on older firmware.  The host infers
+; them from the version for firmware from before 'Q'.
+CAP_READ				equ		0		; A and R
+CAP_FRAMING				equ		1		; F
+CAP_RX_BUFFER			equ		2		; Host data is buffered (rx_ring)
+CAP_BLANK_CHECK			equ		3		; B
+CAP_STREAM				equ		4		; S
+CAP_ID_LOCATIONS		equ		5		; K
+CAP_TIMING				equ		6		; M
+CAP_GANG				equ		7		; G
+CAP_CAPTURE				equ		8		; L
+CAP_VERIFY				equ		9		; J
+CAP_PIC18				equ		.10		; Z
+CAP_BAUD				equ		.11		; U
+CAP_DATA_MEMORY			equ		.12		; O
+CAP_PROFILE				equ		.13		; Y
+CAPABILITIES			equ		(1 << (CAP_PROFILE + 1)) - 1	; All of them
+
+; Logic capture
+LOGIC_BUFFER			equ		0xa0	; The frame buffers, unused in raw mode
+LOGIC_END				equ		0xf0	; 80 samples
+LOGIC_MIN_PERIOD		equ		.50		; us, leaves time between interrupts
+
+; Profiling.  Each phase sets bits in profile_phase, which is then the offset
+; of its counter in profile_counts.  Sending to the host, which is only done
+; in uart_send, sets both PROFILE_HOST_WAIT and PROFILE_TARGET.
+PROFILE_PERIOD			equ		.1000	; Timer 1 ticks (1 us) between samples
+PROFILE_HOST_WAIT		equ		1		; Waiting for data from the host
+PROFILE_TARGET			equ		2		; Clocking bits to or from the target
+PROFILE_DELAY			equ		3		; In delay or delay_ticks
+PROFILE_COUNT_BYTES		equ		.10		; Five counters, most significant byte first
+
+; Bits in error_flag
+ERROR_FLAG_VERIFY		equ		0		; Readback didn't match
+ERROR_FLAG_RECEIVE		equ		1		; A byte from the host was lost
+
+; Bits in mode_flags
+MODE_FRAMED				equ		0		; Host commands are carried in frames
+MODE_RESPONSE_OWED		equ		1		; Current frame has not been acked yet
+MODE_STREAM				equ		2		; Write is ended by a terminator word
+MODE_GANG				equ		3		; Programming several targets at once
+MODE_DATA				equ		4		; Target commands are for data EEPROM
+
+; Gang mode (see above)
+GANG_PRIMARY			equ		1		; Bit for the target on RA3
+GANG_RESERVED			equ		b'00000110'	; RB1 and RB2 are the UART
+
+; Framing
+FRAME_START				equ		0x7e
+FRAME_ACK				equ		'+'
+FRAME_NAK				equ		'-'
+FRAME_MAX_PAYLOAD		equ		.32
+CRC_POLY_HI				equ		0x10
+CRC_POLY_LO				equ		0x21
+
+; Frame buffers (bank 1, accessed indirectly)
+frame_buffer			equ		0xa0	; seq, length, payload, crc (36 bytes)
+response_buffer			equ		0xc8	; Response payload (32 bytes)
+
+; Bytes from the host are put in a ring buffer by the receive interrupt, so
+; they keep arriving while the mainline code is busy programming.  It is in
+; bank 2, accessed indirectly with IRP set.
+rx_ring					equ		0x120
+RX_RING_SIZE			equ		.64		; Must be a power of two, at most 128
+
+; Bits in rx_status
+RX_OVERFLOW				equ		0		; UART or ring buffer overflowed
+RX_FRAMING_ERROR		equ		1
+RX_BREAK				equ		2		; A framing error with all zeros
 
 ; Pins
 VPP						equ		0		; RA0
@@ -50,6 +272,84 @@ CMD_INCREMENT_ADDR				equ		0x06
 CMD_BEGIN_PROGRAM_ONLY_CYCLE	equ		0x08
 CMD_READ_PROGRAM_MEMORY			equ		0x04
 CMD_LOAD_CONFIGURATION			equ		0x00
+CMD_LOAD_DATA_DATA				equ		0x03
+CMD_READ_DATA_MEMORY			equ		0x05
+CMD_BULK_ERASE_DATA				equ		0x0b
+
+; PIC18 commands to target (rightmost 4 bits)
+PIC18_CORE_INSTRUCTION			equ		b'0000'
+PIC18_TABLE_READ_INC			equ		b'1001'
+PIC18_TABLE_WRITE				equ		b'1100'
+PIC18_TABLE_WRITE_INC2			equ		b'1101'
+PIC18_TABLE_WRITE_START			equ		b'1111'
+PIC18_P10						equ		.10		; 100 us after programming, in ticks
+
+; Clock one bit out to the target, which latches it on the falling edge of
+; PGM_CLOCK.  Either way through the btfsc/btfss pair takes the same number of
+; cycles, so every bit is 6 cycles: clock high for 5 us and low for 1 us at
+; 4 MHz.  The data line changes at most once, at least 1 us before the falling
+; edge (Tset1 is 100 ns) and at least 3 us after the previous one (Thld1 is
+; 100 ns).  An interrupt can only stretch these.
+SEND_BIT				macro	reg, bitnum
+						bsf		PORTA, PGM_CLOCK
+						btfsc	reg, bitnum
+						bsf		PORTA, PGM_DATA
+						btfss	reg, bitnum
+						bcf		PORTA, PGM_DATA
+						bcf		PORTA, PGM_CLOCK
+						endm
+
+; Like SEND_BIT, but also drives the gang data lines on PORTB.  Writing all of
+; PORTB is harmless, since the other pins are inputs or belong to the UART.
+; Every bit is 10 cycles.
+SEND_GANG_BIT			macro	reg, bitnum
+						bsf		PORTA, PGM_CLOCK
+						movlw	0x00
+						btfsc	reg, bitnum
+						movlw	0xff
+						movwf	PORTB
+						btfsc	reg, bitnum
+						bsf		PORTA, PGM_DATA
+						btfss	reg, bitnum
+						bcf		PORTA, PGM_DATA
+						bcf		PORTA, PGM_CLOCK
+						endm
+
+; Clock one bit in from the target into a register that starts out cleared.
+; Every bit is 5 cycles.  Data is sampled 1.25 us after the rising edge
+; (Tdly3 is 80 ns).
+RECV_BIT				macro	reg, bitnum
+						bsf		PORTA, PGM_CLOCK
+						nop								; Wait Tdly3
+						btfsc	PORTA, PGM_DATA
+						bsf		reg, bitnum
+						bcf		PORTA, PGM_CLOCK
+						endm
+
+; Like RECV_BIT, but also samples the gang data lines on PORTB, and sets the
+; bits in gang_sample for lines that don't match bit bitnum of expected.
+; Every bit is 9 cycles.
+RECV_GANG_BIT			macro	reg, bitnum, expected
+						bsf		PORTA, PGM_CLOCK
+						nop								; Wait Tdly3
+						btfsc	PORTA, PGM_DATA
+						bsf		reg, bitnum
+						movfw	PORTB
+						btfsc	expected, bitnum		; Expecting a one?
+						xorlw	0xff					; Then zeros are mismatches
+						iorwf	gang_sample, f
+						bcf		PORTA, PGM_CLOCK
+						endm
+
+; Send a PIC18 core instruction to the target.  This overwrites
+; program_word_hi and program_word_lo.
+PIC18_INSTRUCTION		macro	instruction
+						movlw	low (instruction)
+						movwf	program_word_lo
+						movlw	high (instruction)
+						movwf	program_word_hi
+						call	pic18_core_instruction
+						endm
 
 						org		0x20
 
@@ -58,16 +358,60 @@ program_size_hi:		res		1
 program_size_lo:		res		1
 checksum_hi:			res		1
 checksum_lo:			res		1
-word_shift_register:	res		1	; Temporary for send_to_target
-word_shift_count:		res		1	; Temporary for send_to_target
+word_shift_register:	res		1	; Temporary for send_to_target6
 program_word_hi:		res		1
 program_word_lo:		res		1
 error_flag:				res		1
 delay_interval:			res		1	; Temporary used by delay
 delay_sub_count:		res		1	; Temporary used by delay
+delay_hi:				res		1	; Tick count for delay_ticks
+delay_lo:				res		1
+tprog_hi:				res		1	; Tprog, in 10 us ticks
+tprog_lo:				res		1
+tera_hi:				res		1	; Tera, in 10 us ticks
+tera_lo:				res		1
 loop_count:				res		1
 verify_word_hi:			res		1
 verify_word_lo:			res		1
+blank_offset_hi:		res		1
+blank_offset_lo:		res		1
+mode_flags:				res		1
+frame_seq:				res		1	; Sequence number of the last frame accepted
+frame_length:			res		1	; Payload length of the current frame
+frame_index:			res		1	; Next byte of the current frame payload
+frame_count:			res		1	; Temporary used by framing
+frame_temp:				res		1	; Temporary used by framing
+response_length:		res		1
+crc_hi:					res		1
+crc_lo:					res		1
+crc_bit_count:			res		1	; Temporary used by crc_update
+recv_byte:				res		1	; Temporary used by uart_recv
+recv_fsr_save:			res		1	; Temporary used by uart_recv
+gang_mask:				res		1	; PORTB data lines in use in gang mode
+gang_active:			res		1	; Targets that haven't failed
+gang_sample:			res		1	; PORTB data lines that failed the last read
+gang_failed:			res		1	; Targets that failed since the last ack
+tblptr_u:				res		1	; PIC18 table pointer for writes
+tblptr_h:				res		1
+tblptr_l:				res		1
+block_count:			res		1	; Bytes of a PIC18 block left
+block_sum_hi:			res		1	; Checksum of a PIC18 block as received
+block_sum_lo:			res		1
+profile_counts:			res		PROFILE_COUNT_BYTES	; Profiling samples per phase
+
+						; Shared by all banks, so the interrupt handler can use them
+						; without switching banks.
+						org		0x70
+
+w_save:					res		1
+status_save:			res		1
+fsr_save:				res		1
+rx_head:				res		1	; Next slot the interrupt handler fills
+rx_tail:				res		1	; Next slot uart_recv reads
+rx_status:				res		1
+logic_next:				res		1	; Logic capture sample being counted
+logic_sample:			res		1	; Temporary used by the interrupt handler
+profile_phase:			res		1	; What the mainline code is doing, for profiling
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;;
@@ -81,7 +425,7 @@ verify_word_lo:			res		1
 						nop
 						nop
 						nop
-						nop
+						goto	interrupt_handler	; Interrupt vector
 
 initialize:				movlw	0x07			; Turn comparters off and enable pins for IO
 						movwf	CMCON
@@ -94,7 +438,7 @@ initialize:				movlw	0x07			; Turn comparters off and enable pins for IO
 						clrf	VRCON			; Turn off voltage reference module (RA2 is GPIO)
 
 						; Set up the serial port
-						movlw	.25		; 9600 baud
+						movlw	BAUD_DIVISOR_DEFAULT
 						movwf	SPBRG
 						bsf		TXSTA, BRGH	; High speed
 						bcf		TXSTA, SYNC
@@ -113,6 +457,43 @@ initialize:				movlw	0x07			; Turn comparters off and enable pins for IO
 						bcf		PORTA, VPP
 						bsf		PORTA, nVDD
 
+						clrf	mode_flags				; Start in raw mode and with one target
+						clrf	gang_mask
+						clrf	gang_failed
+
+						movlw	HIGH TPROG_DEFAULT
+						movwf	tprog_hi
+						movlw	LOW TPROG_DEFAULT
+						movwf	tprog_lo
+						movlw	HIGH TERA_DEFAULT
+						movwf	tera_hi
+						movlw	LOW TERA_DEFAULT
+						movwf	tera_lo
+
+						; Timer 1 counts cycles, and CCP1 resets it and interrupts
+						; every PROFILE_PERIOD of them to take a profiling sample.
+						; The CCP1 pin (RB3) isn't affected.
+						clrf	profile_phase
+						movlw	HIGH PROFILE_PERIOD
+						movwf	CCPR1H
+						movlw	LOW PROFILE_PERIOD
+						movwf	CCPR1L
+						movlw	b'00001011'				; Compare, special event trigger
+						movwf	CCP1CON
+						movlw	1 << TMR1ON				; Internal clock, no prescale
+						movwf	T1CON
+
+						; Take received data in the interrupt handler
+						clrf	rx_head
+						clrf	rx_tail
+						clrf	rx_status
+						bsf		STATUS, RP0				; Page 1
+						bsf		PIE1, RCIE
+						bsf		PIE1, CCP1IE
+						bcf		STATUS, RP0				; Page 0
+						bsf		INTCON, PEIE
+						bsf		INTCON, GIE
+
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;;
 ;; Command interpreter
@@ -136,6 +517,12 @@ command_loop:			clrf	error_flag
 						btfsc	STATUS, Z	; Equal?
 						goto	cmd_write_config_word
 
+						; case 'K':	  Write ID locations and configuration word
+						movfw	command_buffer
+						sublw	'K'
+						btfsc	STATUS, Z	; Equal?
+						goto	cmd_write_id_locations
+
 						; case 'W':   Write program memory
 						movfw	command_buffer
 						sublw	'W'
@@ -172,7 +559,93 @@ command_loop:			clrf	error_flag
 						btfsc	STATUS, Z
 						goto	cmd_io
 
-						; Command is unrecognized.
+						; case 'A': Advance address
+						movfw	command_buffer
+						sublw	'A'
+						btfsc	STATUS, Z
+						goto	cmd_advance_address
+
+						; case 'R': Read program memory
+						movfw	command_buffer
+						sublw	'R'
+						btfsc	STATUS, Z
+						goto	cmd_read_program
+
+						; case 'J': Jump to configuration memory
+						movfw	command_buffer
+						sublw	'J'
+						btfsc	STATUS, Z
+						goto	cmd_config_memory
+
+						; case 'F': Framing
+						movfw	command_buffer
+						sublw	'F'
+						btfsc	STATUS, Z
+						goto	cmd_framing
+
+						; case 'B': Blank check
+						movfw	command_buffer
+						sublw	'B'
+						btfsc	STATUS, Z
+						goto	cmd_blank_check
+
+						; case 'S': Stream program memory
+						movfw	command_buffer
+						sublw	'S'
+						btfsc	STATUS, Z
+						goto	cmd_stream_program
+
+						; case 'M': Set timing
+						movfw	command_buffer
+						sublw	'M'
+						btfsc	STATUS, Z
+						goto	cmd_set_timing
+
+						; case 'G': Gang mode
+						movfw	command_buffer
+						sublw	'G'
+						btfsc	STATUS, Z
+						goto	cmd_gang
+
+						; case 'L': Logic capture
+						movfw	command_buffer
+						sublw	'L'
+						btfsc	STATUS, Z
+						goto	cmd_logic_capture
+
+						; case 'Z': PIC18 targets
+						movfw	command_buffer
+						sublw	'Z'
+						btfsc	STATUS, Z
+						goto	cmd_pic18
+
+						; case 'U': Change baud rate
+						movfw	command_buffer
+						sublw	'U'
+						btfsc	STATUS, Z
+						goto	cmd_baud_rate
+
+						; case 'O': Select data EEPROM
+						movfw	command_buffer
+						sublw	'O'
+						btfsc	STATUS, Z
+						goto	cmd_data_memory
+
+						; case 'Q': Get capabilities
+						movfw	command_buffer
+						sublw	'Q'
+						btfsc	STATUS, Z
+						goto	cmd_capabilities
+
+						; case 'Y': Get and reset profiling counters
+						movfw	command_buffer
+						sublw	'Y'
+						btfsc	STATUS, Z
+						goto	cmd_profile
+
+						; Command is unrecognized.  Drop anything else that came
+						; with it.
+bad_command:			call	discard_host_input
 						movlw	'E'
 						call	send_to_host
 						movlw	ERROR_BAD_COMMAND
@@ -181,12 +654,7 @@ command_loop:			clrf	error_flag
 
 
 ;;;;; Erase Flash ;;;;;;;;;;;;;;;;;;;;;;
-cmd_erase_flash:		movlw	CMD_BULK_ERASE_PROGRAM
-						call	send_to_target6
-
-						; Wait Tera (6ms)
-						movlw	.120
-						call	delay
+cmd_erase_flash:		call	bulk_erase
 
 						; Send ack
 						movlw	'+'
@@ -194,23 +662,13 @@ cmd_erase_flash:		movlw	CMD_BULK_ERASE_PROGRAM
 						goto	command_loop
 
 ;;;;; Write Config Word ;;;;;;;;;;;;;;;;;;;;;;
-cmd_write_config_word:	call	recv_from_host
+cmd_write_config_word:	call	load_configuration
+
+						call	recv_from_host
 						movwf	program_word_hi
 						call	recv_from_host
 						movwf	program_word_lo
 
-						; Load data for configuration memory
-						; Advances the PC to the start of configuration memory (0x2000-0x200F)
-						; and loads the data for the first ID location.
-						movlw	CMD_LOAD_CONFIGURATION
-						call	send_to_target6
-
-						; 0x7ffe as data of command
-						movlw	0xfe
-						call	send_to_target8
-						movlw	0x7f
-						call	send_to_target8
-
 						; Advance to address 2007
 						movlw	7
 						movwf	loop_count
@@ -221,22 +679,60 @@ increment_loop:			movlw	CMD_INCREMENT_ADDR		; Increment address
 
 						; Now write the configuration word
 						call 	write_program_word
-						btfsc	error_flag, 0			; Did we write the config word?
+						btfsc	error_flag, ERROR_FLAG_VERIFY	; Did we write the config word?
 						goto	program_error			; Nope, bail
 
-						movlw	'+'
-						call	send_to_host
+						call	send_write_ack			; Also covers the ID locations
 
 						goto	command_loop
 
+;;;;; Write ID Locations ;;;;;;;;;;;;;;;;;;;;;;;
+; The configuration word is written by the same command, because the address
+; can't be moved back out of configuration memory without leaving
+; programming mode.
+cmd_write_id_locations:	call	load_configuration
+
+						movlw	4
+						movwf	loop_count
+id_location_loop:		call	recv_from_host
+						movwf	program_word_hi
+						call	recv_from_host
+						movwf	program_word_lo
+
+						call	write_program_word		; Advances to the next location
+						btfsc	error_flag, ERROR_FLAG_VERIFY
+						goto	program_error
+
+						decfsz	loop_count, f
+						goto	id_location_loop
+
+						; Then the configuration word, from address 2004
+						call	recv_from_host
+						movwf	program_word_hi
+						call	recv_from_host
+						movwf	program_word_lo
+
+						movlw	3
+						movwf	loop_count
+						goto	increment_loop
+
 ;;;;; Write Program Memory ;;;;;;;;;;;;;;;;;;;;;;
 cmd_write_program:			; Get the program size
 						call	recv_from_host
 						movwf	program_size_hi
 						call	recv_from_host
 						movwf	program_size_lo
+						bcf		mode_flags, MODE_STREAM
+						goto	start_write
 
-						clrf	checksum_hi
+						; The length isn't known, so count down from the largest
+						; size.  The host ends it with a terminator word.
+cmd_stream_program:		movlw	0xff
+						movwf	program_size_hi
+						movwf	program_size_lo
+						bsf		mode_flags, MODE_STREAM
+
+start_write:			clrf	checksum_hi
 						clrf	checksum_lo
 
 						movlw	'+'	; go ahead
@@ -262,7 +758,14 @@ get_instruction_loop:	; Update counters and loop
 get_instruction:		call	recv_from_host	; Get highword
 						movwf	program_word_hi
 
-						; Update checksum
+						; A word with the top bit set ends a streamed write.  It
+						; isn't part of the checksum.
+						btfss	mode_flags, MODE_STREAM
+						goto	update_checksum
+						btfsc	program_word_hi, 7
+						goto	stream_end
+
+update_checksum:		; Update checksum (W still holds the high byte)
 						addwf	checksum_lo, f
 						movfw	checksum_lo
 						addwf	checksum_hi, f
@@ -275,14 +778,24 @@ get_instruction:		call	recv_from_host	; Get highword
 						movfw	checksum_lo
 						addwf	checksum_hi, f
 
+						; If a byte was lost, this word is garbage.  Abandon the
+						; write without programming it and stay in programming mode,
+						; so the host can resume from the last acknowledged word.
+						; Words the host sent ahead can't be trusted either.
+						btfsc	error_flag, ERROR_FLAG_RECEIVE
+						goto	abandon_write
+
 						call	write_program_word		; Do it
-						btfsc	error_flag, 0			; Check if an error occured
+						btfsc	error_flag, ERROR_FLAG_VERIFY	; Check if an error occured
 						goto	program_error			; An error occured, bail
 
-						movlw	'+'
-						call	send_to_host
+						call	send_write_ack
 						goto	get_instruction_loop
 
+
+stream_end:				call	recv_from_host			; Low byte of the terminator
+						btfsc	error_flag, ERROR_FLAG_RECEIVE
+						goto	abandon_write
 
 instruction_loop_done:	; Write checksum
 						movlw	'D'
@@ -297,8 +810,38 @@ cmd_print_version:		movlw	PROTOCOL_VERSION
 						call	send_to_host
 						goto	command_loop
 
+cmd_capabilities:		movlw	HIGH CAPABILITIES
+						call	send_to_host
+						movlw	LOW CAPABILITIES
+						call	send_to_host
+						movlw	RX_RING_SIZE
+						call	send_to_host
+						movlw	BAUD_DIVISOR_MIN
+						call	send_to_host
+						goto	command_loop
+
+; send_to_host uses FSR in framed mode, so the counters are indexed by
+; loop_count.  A sample taken while they are being sent may be lost.
+cmd_profile:			clrf	loop_count
+profile_send_loop:		movfw	loop_count
+						addlw	LOW profile_counts
+						movwf	FSR
+						movfw	INDF
+						clrf	INDF
+						call	send_to_host
+						incf	loop_count, f
+						movfw	loop_count
+						xorlw	PROFILE_COUNT_BYTES
+						btfss	STATUS, Z
+						goto	profile_send_loop
+						goto	command_loop
+
+abandon_write:			call	discard_host_input
+						goto	command_loop
+
 program_error:			; Automatically exit programming mode
 						call	exit_program_mode
+						call	discard_host_input		; Rest of the frame was for the write
 
 						; Send error to host
 						movlw	'E'
@@ -316,8 +859,12 @@ program_error:			; Automatically exit programming mode
 
 ;;;;; Enter programming mode ;;;;;;;;;;;;;;;;;;;
 cmd_enter_program_mode:	; Turn clock and data lines, which are currently floating, into
-						; outputs and drive them low.
+						; outputs and drive them low.  This includes the data lines
+						; for other targets in gang mode.
+						clrf	PORTB
+						comf	gang_mask, w
 						bsf		STATUS, RP0		; Switch to page 1
+						movwf	TRISB
 						bcf		TRISA, PGM_CLOCK
 						bcf		TRISA, PGM_DATA
 						bcf		STATUS, RP0		; Back to page 0
@@ -340,6 +887,8 @@ cmd_enter_program_mode:	; Turn clock and data lines, which are currently floatin
 						goto	$+1
 						goto	$+1
 
+						bcf		mode_flags, MODE_DATA	; Program memory
+
 						; Send acknowledgement
 						movlw	'+'
 						call	send_to_host
@@ -357,167 +906,1075 @@ cmd_test:				movlw	'+'
 						call	send_to_host
 						goto 	command_loop
 
-
-;;;;;; I/O command ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-cmd_io:					call	recv_from_host	; Get the next command
-						movwf	command_buffer	; Stash
 
-						sublw	'1'
-						btfsc	STATUS, Z	; Equal?
-						bsf		PORTA, VPP	; Yes, set bit
+;;;;; Advance address ;;;;;;;;;;;;;;;;;;;;;;;;;
+; There is no command to load the address directly, so this increments it
+; the requested number of times.
+cmd_advance_address:	call	recv_from_host
+						movwf	program_size_hi
+						call	recv_from_host
+						movwf	program_size_lo
 
-						movfw	command_buffer
-						sublw	'2'
-						btfsc	STATUS, Z
-						bcf		PORTA, nVDD
+advance_loop:			call	decrement_program_size
+						btfsc	STATUS, Z				; Done?
+						goto	advance_done
 
-						movfw	command_buffer
-						sublw	'3'
-						btfsc	STATUS, Z
-						bsf		PORTA, PGM_CLOCK
+						movlw	CMD_INCREMENT_ADDR
+						call	send_to_target6
+						nop		; Wait Tdly2
+						goto	advance_loop
 
-						movfw	command_buffer
-						sublw	'4'
-						btfsc	STATUS, Z
-						bsf		PORTA, PGM_DATA
+advance_done:			movlw	'+'
+						call	send_to_host
+						goto	command_loop
 
-						movfw	command_buffer
-						sublw	'5'
-						btfsc	STATUS, Z	; Equal?
-						bcf		PORTA, VPP	; Yes, set bit
+;;;;; Read program memory ;;;;;;;;;;;;;;;;;;;;;;
+cmd_read_program:		call	recv_from_host
+						movwf	program_size_hi
+						call	recv_from_host
+						movwf	program_size_lo
 
-						movfw	command_buffer
-						sublw	'6'
-						btfsc	STATUS, Z
-						bsf		PORTA, nVDD
+read_loop:				call	decrement_program_size
+						btfsc	STATUS, Z				; Done?
+						goto	command_loop
 
-						movfw	command_buffer
-						sublw	'7'
-						btfsc	STATUS, Z
-						bcf		PORTA, PGM_CLOCK
+						call	read_program_word
+						movfw	verify_word_hi
+						call	send_to_host
+						movfw	verify_word_lo
+						call	send_to_host
 
-						movfw	command_buffer
-						sublw	'8'
+						movlw	CMD_INCREMENT_ADDR
+						call	send_to_target6
+						nop		; Wait Tdly2
+						goto	read_loop
+
+;;;;; Select data EEPROM ;;;;;;;;;;;;;;;;;;;;;;;;;
+cmd_data_memory:		call	recv_from_host
+						bcf		mode_flags, MODE_DATA
+						iorlw	0						; Back to program memory?
 						btfsc	STATUS, Z
-						bcf		PORTA, PGM_DATA
+						goto	data_memory_ack
+						btfsc	mode_flags, MODE_GANG	; Readback isn't masked
+						goto	bad_parameter
+						bsf		mode_flags, MODE_DATA
 
-						movlw	'+'
+data_memory_ack:		movlw	'+'
 						call	send_to_host
-
 						goto	command_loop
 
-
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-;;
-;; Exit programming mode and set the programmer back to a known state.
-;;
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-
-exit_program_mode:		; Float clock and data so circuit can operate normally
-						bsf		STATUS, RP0		; Switch to page 1
-						bsf		TRISA, PGM_CLOCK
-						bsf		TRISA, PGM_DATA
-						bcf		STATUS, RP0		; Back to page 0
-
-						bcf		PORTA, VPP
-						bsf		PORTA, nVDD
-						return
+;;;;; Jump to configuration memory ;;;;;;;;;;;;;;
+cmd_config_memory:		call	load_configuration
+						movlw	'+'
+						call	send_to_host
+						goto	command_loop
 
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-;;
-;; Send data over the UART to the host.  Data to send should be loaded into W.
-;;
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;;;; Blank check ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Walks memory here rather than reading it back to the host, which would be
+; limited by the serial port.
+cmd_blank_check:		call	recv_from_host
+						movwf	program_size_hi
+						call	recv_from_host
+						movwf	program_size_lo
+						clrf	blank_offset_hi
+						clrf	blank_offset_lo
 
-send_to_host:			bsf		STATUS, RP0		; Page 1
-xmit_wait_loop:			btfss	TXSTA, TRMT
-						goto	xmit_wait_loop	; wait for space in transmitter
-						bcf		STATUS, RP0		; Page 0
-						movwf	TXREG
-						return
+blank_check_loop:		call	decrement_program_size
+						btfsc	STATUS, Z				; Done?
+						goto	blank_check_done
 
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-;;
-;; Wait for data to arrive over the UART from the host.  Returned data will
-;; be placed in w
-;;
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+						; An erased word reads back as 0x3fff, with padding
+						call	read_program_word
+						movfw	verify_word_hi
+						xorlw	0x7f
+						btfss	STATUS, Z
+						goto	not_blank
 
-recv_from_host:
-wait_for_data:			btfss	PIR1, RCIF
-						goto	wait_for_data
+						movfw	verify_word_lo
+						xorlw	0xfe
+						btfss	STATUS, Z
+						goto	not_blank
 
-						btfsc	RCSTA, OERR
-						goto	handle_overflow
-						btfsc	RCSTA, FERR
-						goto	handle_framing_error
-						movfw	RCREG
-						return
+						movlw	CMD_INCREMENT_ADDR
+						call	send_to_target6
+						incf	blank_offset_lo, f		; Also waits Tdly2
+						btfsc	STATUS, Z
+						incf	blank_offset_hi, f
+						goto	blank_check_loop
 
-handle_overflow:		movlw	'E'
+blank_check_done:		movlw	'+'
 						call	send_to_host
-						movlw	ERROR_OVERFLOW
-						call	send_to_host
-						goto	wait_for_data		; Wait for a valid data byte
+						goto	command_loop
 
-handle_framing_error:	movlw	'E'
+not_blank:				movlw	'-'
 						call	send_to_host
-						movlw	ERROR_FRAMING
+						movfw	blank_offset_hi
 						call	send_to_host
-						goto	wait_for_data		; Wait for a valid data byte
-
-
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-;;
-;; Write a program word to flash and verify that it was written correctly
-;;
-;;   program_word_hi (in)       High 8 bits of program word to write
-;;   program_word_lo (in)       Low 8 bits of program word to write
-;;
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+						movfw	blank_offset_lo
+						call	send_to_host
+						goto	command_loop
 
-write_program_word:		movlw	CMD_LOAD_DATA_PROGRAM
-						call	send_to_target6
 
-						nop		; Wait Tdly2
+;;;;; Set timing ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Both values are checked before either is used, so a bad command leaves the
+; old timing in place.
+cmd_set_timing:			call	recv_from_host
+						movwf	program_size_hi			; New Tprog
+						call	recv_from_host
+						movwf	program_size_lo
+						call	recv_from_host
+						movwf	program_word_hi			; New Tera
+						call	recv_from_host
+						movwf	program_word_lo
 
-						; Write data (16 bits)
-						movfw	program_word_lo
-						call	send_to_target8
+						movf	program_size_hi, f
+						btfss	STATUS, Z				; Over 255 ticks?
+						goto	tprog_ok
+						movlw	TIMING_MIN
+						subwf	program_size_lo, w
+						btfss	STATUS, C				; Under the minimum?
+						goto	bad_parameter
+
+tprog_ok:				movf	program_word_hi, f
+						btfss	STATUS, Z				; Over 255 ticks?
+						goto	tera_ok
+						movlw	TIMING_MIN
+						subwf	program_word_lo, w
+						btfss	STATUS, C				; Under the minimum?
+						goto	bad_parameter
+
+tera_ok:				movfw	program_size_hi
+						movwf	tprog_hi
+						movfw	program_size_lo
+						movwf	tprog_lo
 						movfw	program_word_hi
-						call	send_to_target8
-
-						movlw	CMD_BEGIN_PROGRAM_ONLY_CYCLE	; Begin programming only cycle
-						call	send_to_target6
+						movwf	tera_hi
+						movfw	program_word_lo
+						movwf	tera_lo
 
-						; Wait Tprog (2.5ms)
-						movlw 	.50					; 50 * 50 us = 2.5ms
-						call	delay
+						movlw	'+'
+						call	send_to_host
+						goto	command_loop
 
-						; Read data from program memory
-						movlw	CMD_READ_PROGRAM_MEMORY
-						call	send_to_target6
+bad_parameter:			movlw	'E'
+						call	send_to_host
+						movlw	ERROR_BAD_PARAMETER
+						call	send_to_host
+						goto	command_loop
 
-						; Turn the data line into an input so we can read back from
-						; the target
-						bsf		STATUS, RP0		; Switch to page 1
-						bsf		TRISA, PGM_DATA	; Turn data into an input
-						bcf		STATUS, RP0		; Back to page 0
+;;;;; Logic capture ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Samples are kept in the frame buffers, so this is only available in raw
+; mode.
+cmd_logic_capture:		btfsc	mode_flags, MODE_FRAMED
+						goto	bad_command
 
-						nop		; Wait Tdly2
+						call	recv_from_host
+						movwf	program_size_lo			; Sample period
+						call	recv_from_host
+						movwf	command_buffer			; Operation
+						xorlw	'E'
+						btfsc	STATUS, Z
+						goto	logic_check_period
+						xorlw	'E' ^ 'R'
+						btfsc	STATUS, Z
+						goto	logic_check_period
+						xorlw	'R' ^ 'W'
+						btfss	STATUS, Z
+						goto	bad_parameter
+
+						call	recv_from_host			; Word to write
+						movwf	program_word_hi
+						call	recv_from_host
+						movwf	program_word_lo
+
+logic_check_period:		movlw	LOGIC_MIN_PERIOD
+						subwf	program_size_lo, w
+						btfss	STATUS, C				; Under the minimum?
+						goto	bad_parameter
+
+						; The first sample is taken now
+						movlw	LOGIC_BUFFER
+						movwf	logic_next
+						movwf	FSR
+						swapf	PORTA, w
+						andlw	0xf0
+						movwf	INDF
+
+						; Timer 2 counts at 1 MHz and interrupts every period
+						clrf	TMR2
+						decf	program_size_lo, w
+						bsf		STATUS, RP0				; Page 1
+						movwf	PR2
+						bsf		PIE1, TMR2IE
+						bcf		STATUS, RP0				; Page 0
+						bcf		PIR1, TMR2IF
+						movlw	1 << TMR2ON				; Prescale and postscale 1:1
+						movwf	T2CON
+
+						movfw	command_buffer
+						sublw	'E'
+						btfsc	STATUS, Z
+						call	bulk_erase
+
+						movfw	command_buffer
+						sublw	'R'
+						btfsc	STATUS, Z
+						call	read_program_word
+
+						movfw	command_buffer
+						sublw	'W'
+						btfsc	STATUS, Z
+						call	write_program_word
+
+						clrf	T2CON					; Stop sampling
+						bsf		STATUS, RP0				; Page 1
+						bcf		PIE1, TMR2IE
+						bcf		STATUS, RP0				; Page 0
+						bcf		PIR1, TMR2IF			; So the interrupt handler ignores it
+
+						movlw	'+'
+						call	send_to_host
+						movlw	LOGIC_BUFFER - 1
+						subwf	logic_next, w			; Number of samples
+						movwf	loop_count
+						call	send_to_host
+						movlw	LOGIC_BUFFER
+						movwf	FSR
+logic_send_loop:		movfw	INDF
+						call	send_to_host
+						incf	FSR, f
+						decfsz	loop_count, f
+						goto	logic_send_loop
+						goto	command_loop
+
+;;;;; Gang mode ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Also resets which targets have failed
+cmd_gang:				call	recv_from_host
+						movwf	gang_mask
+						clrf	gang_failed
+						bcf		mode_flags, MODE_GANG
+						andlw	GANG_RESERVED
+						btfss	STATUS, Z				; Using the UART's pins?
+						goto	bad_gang
+
+						movf	gang_mask, f
+						btfss	STATUS, Z
+						bsf		mode_flags, MODE_GANG
+
+						movfw	gang_mask
+						iorlw	1 << GANG_PRIMARY
+						movwf	gang_active
+
+						movlw	'+'
+						call	send_to_host
+						goto	command_loop
+
+bad_gang:				clrf	gang_mask
+						goto	bad_parameter
+
+
+;;;;; PIC18 targets ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+cmd_pic18:				btfsc	mode_flags, MODE_GANG
+						goto	bad_command
+
+						call	recv_from_host
+						movwf	command_buffer			; Operation
+						xorlw	'P'
+						btfsc	STATUS, Z
+						goto	pic18_enter_program_mode
+						xorlw	'P' ^ 'A'
+						btfsc	STATUS, Z
+						goto	pic18_set_address
+						xorlw	'A' ^ 'E'
+						btfsc	STATUS, Z
+						goto	pic18_erase
+						xorlw	'E' ^ 'W'
+						btfsc	STATUS, Z
+						goto	pic18_write_block
+						xorlw	'W' ^ 'C'
+						btfsc	STATUS, Z
+						goto	pic18_write_config
+						xorlw	'C' ^ 'R'
+						btfsc	STATUS, Z
+						goto	pic18_read
+						goto	bad_parameter
+
+pic18_enter_program_mode:
+						bsf		STATUS, RP0				; Page 1
+						bcf		TRISA, PGM_CLOCK
+						bcf		TRISA, PGM_DATA
+						bcf		STATUS, RP0				; Page 0
+						bcf		PORTA, PGM_CLOCK
+						bcf		PORTA, PGM_DATA
+						goto	$+1
+						goto	$+1
+
+						bcf		PORTA, nVDD				; Vdd on
+
+						; Wait P13 (100 ns)
+						goto	$+1
+
+						bsf		PORTA, VPP				; Programming voltage goes high
+
+						; Wait P12 (2 us)
+						goto	$+1
+						goto	$+1
+						goto	pic18_ack
+
+pic18_set_address:		call	recv_from_host
+						movwf	tblptr_u
+						call	recv_from_host
+						movwf	tblptr_h
+						call	recv_from_host
+						movwf	tblptr_l
+						call	pic18_load_tblptr
+						goto	pic18_ack
+
+						; Write 0x3f3f to 0x3c0005 and 0x8f8f to 0x3c0004, then
+						; hold the data line low during the second NOP while the
+						; erase happens.
+pic18_erase:			movlw	0x3c
+						movwf	tblptr_u
+						clrf	tblptr_h
+						movlw	0x05
+						movwf	tblptr_l
+						call	pic18_load_tblptr
+						movlw	0x3f
+						call	pic18_table_write
+						decf	tblptr_l, f
+						call	pic18_load_tblptr
+						movlw	0x8f
+						call	pic18_table_write
+
+						PIC18_INSTRUCTION	0x0000		; NOP
+						movlw	PIC18_CORE_INSTRUCTION
+						call	send_to_target4
+						movfw	tera_hi
+						movwf	delay_hi
+						movfw	tera_lo
+						movwf	delay_lo
+						call	delay_ticks
+						clrf	program_word_hi
+						clrf	program_word_lo
+						call	send_to_target16
+						goto	pic18_ack
+
+pic18_write_block:		call	recv_from_host
+						movwf	block_count
+						movwf	loop_count				; Kept for the readback
+						btfsc	block_count, 0			; Odd?
+						goto	bad_block
+						movf	block_count, f
+						btfsc	STATUS, Z				; Empty?
+						goto	bad_block
+
+						clrf	checksum_hi
+						clrf	checksum_lo
+						PIC18_INSTRUCTION	0x8ea6		; BSF EECON1, EEPGD
+						PIC18_INSTRUCTION	0x9ca6		; BCF EECON1, CFGS
+						PIC18_INSTRUCTION	0x84a6		; BSF EECON1, WREN
+						call	pic18_load_tblptr
+
+						; The bytes go into the target's write buffer as they
+						; arrive, even address in the low half.  The last pair
+						; starts programming.
+pic18_write_loop:		call	recv_from_host
+						movwf	program_word_lo
+						call	add_to_checksum
+						call	recv_from_host
+						movwf	program_word_hi
+						call	add_to_checksum
+
+						; If a byte was lost, the block is garbage.  Don't program
+						; it.
+						btfsc	error_flag, ERROR_FLAG_RECEIVE
+						goto	abandon_write
+
+						decf	block_count, f
+						decf	block_count, f
+						movlw	PIC18_TABLE_WRITE_INC2
+						btfsc	STATUS, Z				; Last pair?
+						movlw	PIC18_TABLE_WRITE_START
+						call	send_to_target4
+						call	send_to_target16
+						movf	block_count, f
+						btfss	STATUS, Z
+						goto	pic18_write_loop
+
+						call	pic18_program_wait
+
+						; Read the block back from its start
+						movfw	checksum_hi
+						movwf	block_sum_hi
+						movfw	checksum_lo
+						movwf	block_sum_lo
+						clrf	checksum_hi
+						clrf	checksum_lo
+						call	pic18_load_tblptr
+						movfw	loop_count
+						movwf	block_count
+pic18_verify_loop:		call	pic18_read_byte
+						call	add_to_checksum
+						decfsz	block_count, f
+						goto	pic18_verify_loop
 
-						call	recv_from_target8
+						movfw	checksum_hi
+						movwf	verify_word_hi			; Reported if they differ
+						xorwf	block_sum_hi, w
+						btfss	STATUS, Z
+						goto	program_error
+						movfw	checksum_lo
 						movwf	verify_word_lo
-						bcf		verify_word_lo, 0	; Ignore low bit
-						call	recv_from_target8
-						movwf	verify_word_hi
-						bcf		verify_word_hi, 7	; Ignore high bit
+						xorwf	block_sum_lo, w
+						btfss	STATUS, Z
+						goto	program_error
+
+						; Move past the block.  The target's table pointer is
+						; already there.
+						movfw	loop_count
+						addwf	tblptr_l, f
+						btfss	STATUS, C
+						goto	pic18_ack
+						incfsz	tblptr_h, f
+						goto	pic18_ack
+						incf	tblptr_u, f
+						goto	pic18_ack
+
+bad_block:				call	discard_host_input		; The block's data
+						goto	bad_parameter
+
+pic18_write_config:		PIC18_INSTRUCTION	0x8ea6		; BSF EECON1, EEPGD
+						PIC18_INSTRUCTION	0x8ca6		; BSF EECON1, CFGS
+						PIC18_INSTRUCTION	0x84a6		; BSF EECON1, WREN
+						call	pic18_load_tblptr
+
+						; Even addresses take the low byte and odd ones the high
+						; byte, so send it in both.
+						call	recv_from_host
+						movwf	program_word_lo
+						movwf	program_word_hi
+						movlw	PIC18_TABLE_WRITE_START
+						call	send_to_target4
+						call	send_to_target16
+						call	pic18_program_wait
+
+						incfsz	tblptr_l, f
+						goto	pic18_ack
+						incfsz	tblptr_h, f
+						goto	pic18_ack
+						incf	tblptr_u, f
+						goto	pic18_ack
+
+pic18_read:				call	recv_from_host
+						movwf	program_size_hi
+						call	recv_from_host
+						movwf	program_size_lo
+
+pic18_read_loop:		call	decrement_program_size
+						btfsc	STATUS, Z				; Done?
+						goto	command_loop
+
+						call	pic18_read_byte
+						call	send_to_host
+						goto	pic18_read_loop
+
+pic18_ack:				movlw	'+'
+						call	send_to_host
+						goto	command_loop
+
+
+;;;;; Baud Rate ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+cmd_baud_rate:			call	recv_from_host
+						movwf	command_buffer			; New divisor
+						btfsc	mode_flags, MODE_FRAMED	; The ack would be queued
+						goto	bad_parameter
+						movlw	BAUD_DIVISOR_MIN
+						subwf	command_buffer, w
+						btfss	STATUS, C				; Faster than the UART keeps up?
+						goto	bad_parameter
+
+						movlw	'+'
+						call	uart_send
+						bsf		STATUS, RP0				; Page 1
+baud_drain_loop:		btfss	TXSTA, TRMT				; Wait for the ack to go out
+						goto	baud_drain_loop
+						bcf		STATUS, RP0				; Page 0
+						movfw	command_buffer
+						bsf		STATUS, RP0				; Page 1
+						movwf	SPBRG
+						bcf		STATUS, RP0				; Page 0
+						goto	command_loop
+
+
+;;;;; Framing ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+cmd_framing:			call	recv_from_host
+						movwf	command_buffer
+						movlw	'+'
+						call	send_to_host			; In framed mode, this is queued
+						movf	command_buffer, f
+						btfsc	STATUS, Z
+						goto	leave_framed_mode
+
+						btfsc	mode_flags, MODE_FRAMED
+						goto	command_loop			; Already framed
+
+						clrf	frame_seq				; Host starts at sequence 1
+						clrf	frame_length
+						clrf	frame_index
+						clrf	response_length
+						bcf		mode_flags, MODE_RESPONSE_OWED
+						bsf		mode_flags, MODE_FRAMED
+						goto	command_loop
+
+leave_framed_mode:		btfss	mode_flags, MODE_FRAMED
+						goto	command_loop
+
+						; Anything after this command in the frame is dropped
+						call	send_ack_frame
+						bcf		mode_flags, MODE_FRAMED
+						goto	command_loop
+
+
+;;;;;; I/O command ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+cmd_io:					call	recv_from_host	; Get the next command
+						movwf	command_buffer	; Stash
+
+						sublw	'1'
+						btfsc	STATUS, Z	; Equal?
+						bsf		PORTA, VPP	; Yes, set bit
+
+						movfw	command_buffer
+						sublw	'2'
+						btfsc	STATUS, Z
+						bcf		PORTA, nVDD
+
+						movfw	command_buffer
+						sublw	'3'
+						btfsc	STATUS, Z
+						bsf		PORTA, PGM_CLOCK
+
+						movfw	command_buffer
+						sublw	'4'
+						btfsc	STATUS, Z
+						bsf		PORTA, PGM_DATA
+
+						movfw	command_buffer
+						sublw	'5'
+						btfsc	STATUS, Z	; Equal?
+						bcf		PORTA, VPP	; Yes, set bit
+
+						movfw	command_buffer
+						sublw	'6'
+						btfsc	STATUS, Z
+						bsf		PORTA, nVDD
+
+						movfw	command_buffer
+						sublw	'7'
+						btfsc	STATUS, Z
+						bcf		PORTA, PGM_CLOCK
+
+						movfw	command_buffer
+						sublw	'8'
+						btfsc	STATUS, Z
+						bcf		PORTA, PGM_DATA
+
+						movlw	'+'
+						call	send_to_host
+
+						goto	command_loop
 
-						; Turn the data line back into an output
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Exit programming mode and set the programmer back to a known state.
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+exit_program_mode:		; Float clock and data so circuit can operate normally
 						bsf		STATUS, RP0		; Switch to page 1
-						bcf		TRISA, PGM_DATA	; Turn data back into an output
+						bsf		TRISA, PGM_CLOCK
+						bsf		TRISA, PGM_DATA
+						movlw	0xff
+						movwf	TRISB			; Gang data lines
 						bcf		STATUS, RP0		; Back to page 0
 
+						bcf		PORTA, VPP
+						bsf		PORTA, nVDD
+						return
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Send data to the host.  Data to send should be loaded into W.  In framed
+;; mode, it is queued in the response to the current frame.
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+send_to_host:			btfsc	mode_flags, MODE_FRAMED
+						goto	queue_response
+
+; Send W over the UART
+uart_send:				bsf		profile_phase, PROFILE_HOST_WAIT
+						bsf		profile_phase, PROFILE_TARGET
+						bsf		STATUS, RP0		; Page 1
+xmit_wait_loop:			btfss	TXSTA, TRMT
+						goto	xmit_wait_loop	; wait for space in transmitter
+						bcf		STATUS, RP0		; Page 0
+						movwf	TXREG
+						bcf		profile_phase, PROFILE_HOST_WAIT
+						bcf		profile_phase, PROFILE_TARGET
+						return
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Wait for data to arrive from the host.  Returned data will be placed in w.
+;; In framed mode, this returns the next payload byte of the current frame,
+;; and acks it and waits for another frame once the payload is used up.
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+recv_from_host:			btfsc	mode_flags, MODE_FRAMED
+						goto	recv_from_frame
+
+; Wait for a byte from the receive ring buffer.  Overflow and framing errors
+; set ERROR_FLAG_RECEIVE, and in raw mode are also reported to the host.
+; FSR is preserved.
+uart_recv:
+wait_for_data:			bsf		profile_phase, PROFILE_HOST_WAIT
+						movf	rx_status, f
+						btfss	STATUS, Z				; Any errors?
+						goto	handle_receive_error
+
+						movfw	rx_tail
+						xorwf	rx_head, w
+						btfsc	STATUS, Z				; Ring empty?
+						goto	wait_for_data
+
+						movfw	FSR
+						movwf	recv_fsr_save
+						movfw	rx_tail
+						addlw	LOW rx_ring
+						movwf	FSR
+						bsf		STATUS, IRP				; Ring is in bank 2
+						movfw	INDF
+						bcf		STATUS, IRP
+						movwf	recv_byte
+						movfw	recv_fsr_save
+						movwf	FSR
+						incf	rx_tail, f
+						movlw	RX_RING_SIZE - 1
+						andwf	rx_tail, f
+						bcf		profile_phase, PROFILE_HOST_WAIT
+						movfw	recv_byte
+						return
+
+handle_receive_error:	bcf		profile_phase, PROFILE_HOST_WAIT
+						btfsc	rx_status, RX_BREAK
+						goto	handle_break
+						btfss	rx_status, RX_OVERFLOW
+						goto	handle_framing_error
+
+handle_overflow:		bcf		rx_status, RX_OVERFLOW
+						bsf		error_flag, ERROR_FLAG_RECEIVE
+						btfsc	mode_flags, MODE_FRAMED	; Framed mode NAKs the frame instead
+						goto	wait_for_data
+						movlw	'E'
+						call	send_to_host
+						movlw	ERROR_OVERFLOW
+						call	send_to_host
+						goto	wait_for_data		; Wait for a valid data byte
+
+handle_framing_error:	bcf		rx_status, RX_FRAMING_ERROR
+						bsf		error_flag, ERROR_FLAG_RECEIVE
+						btfsc	mode_flags, MODE_FRAMED	; Framed mode NAKs the frame instead
+						goto	wait_for_data
+						movlw	'E'
+						call	send_to_host
+						movlw	ERROR_FRAMING
+						call	send_to_host
+						goto	wait_for_data		; Wait for a valid data byte
+
+; The host sent a break to get back to a known state (see U).  Drop the
+; command in progress and framed mode, wait for the line to go quiet, and
+; start over.  Whatever was on the stack is abandoned.
+handle_break:			bcf		mode_flags, MODE_FRAMED
+						bcf		mode_flags, MODE_RESPONSE_OWED
+						call	drain_host_input		; Also clears rx_status
+						goto	command_loop
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Interrupt handler.  Moves received bytes from the UART into rx_ring.  If
+;; the ring is full, the byte is dropped and reported as an overflow.
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+interrupt_handler:		movwf	w_save
+						swapf	STATUS, w				; swapf doesn't affect flags
+						clrf	STATUS					; Page 0, IRP clear
+						movwf	status_save
+						movfw	FSR
+						movwf	fsr_save
+
+						btfsc	PIR1, TMR2IF			; Time for a logic capture sample?
+						goto	isr_logic_sample
+						btfsc	PIR1, CCP1IF			; Time for a profiling sample?
+						goto	isr_profile_sample
+
+isr_receive_loop:		btfss	PIR1, RCIF
+						goto	isr_done
+
+						btfsc	RCSTA, OERR
+						goto	isr_overflow
+						btfsc	RCSTA, FERR
+						goto	isr_framing_error
+
+						movfw	rx_head
+						addlw	LOW rx_ring
+						movwf	FSR
+						bsf		STATUS, IRP				; Ring is in bank 2
+						movfw	RCREG
+						movwf	INDF
+						bcf		STATUS, IRP
+
+						incf	rx_head, w
+						andlw	RX_RING_SIZE - 1
+						xorwf	rx_tail, w				; Would the ring be full?
+						btfsc	STATUS, Z
+						goto	isr_ring_full
+						xorwf	rx_tail, w				; No, recover the new head
+						movwf	rx_head
+						goto	isr_receive_loop		; The UART holds up to two bytes
+
+isr_ring_full:			bsf		rx_status, RX_OVERFLOW
+						goto	isr_receive_loop
+
+isr_overflow:			bcf		RCSTA, CREN				; Reset the receiver to clear OERR
+						bsf		RCSTA, CREN
+						bsf		rx_status, RX_OVERFLOW
+						goto	isr_receive_loop
+
+isr_framing_error:		movfw	RCREG					; Discard the bad byte to clear FERR
+						bsf		rx_status, RX_FRAMING_ERROR
+						btfss	STATUS, Z				; A break, all zeros?
+						goto	isr_receive_loop		; No, noise at the right rate
+						bsf		rx_status, RX_BREAK
+						movlw	BAUD_DIVISOR_DEFAULT	; The host is at another rate
+						bsf		STATUS, RP0				; Page 1
+						movwf	SPBRG
+						bcf		STATUS, RP0				; Page 0
+						goto	isr_receive_loop
+
+						; Extend the run of the current sample if the pins haven't
+						; changed and it isn't full, otherwise start a new one.
+isr_logic_sample:		bcf		PIR1, TMR2IF
+						swapf	PORTA, w
+						andlw	0xf0					; Pins go in the high nibble
+						movwf	logic_sample
+						movfw	logic_next
+						movwf	FSR
+						movfw	INDF
+						andlw	0xf0
+						xorwf	logic_sample, w
+						btfss	STATUS, Z				; Pins changed?
+						goto	isr_logic_new
+
+						movfw	INDF
+						andlw	0x0f
+						xorlw	0x0f
+						btfsc	STATUS, Z				; Run full?
+						goto	isr_logic_new
+
+						incf	INDF, f
+						goto	isr_receive_loop
+
+isr_logic_new:			incf	logic_next, f
+						movfw	logic_next
+						xorlw	LOGIC_END
+						btfsc	STATUS, Z				; Buffer full?
+						goto	isr_logic_full
+
+						incf	FSR, f
+						movfw	logic_sample
+						movwf	INDF
+						goto	isr_receive_loop
+
+isr_logic_full:			decf	logic_next, f			; Keep the last sample
+						bcf		T2CON, TMR2ON			; Stop sampling
+						goto	isr_receive_loop
+
+						; Count a sample for the current phase
+isr_profile_sample:		bcf		PIR1, CCP1IF
+						movfw	profile_phase
+						addlw	LOW profile_counts + 1	; Low byte
+						movwf	FSR
+						incf	INDF, f
+						btfss	STATUS, Z				; Carry?
+						goto	isr_receive_loop
+						decf	FSR, f
+						incf	INDF, f
+						goto	isr_receive_loop
+
+isr_done:				movfw	fsr_save
+						movwf	FSR
+						swapf	status_save, w
+						movwf	STATUS
+						swapf	w_save, f				; Restore W without affecting flags
+						swapf	w_save, w
+						retfie
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Framing.  See the description of framed mode at the top of this file.
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+recv_from_frame:		movfw	frame_index
+						subwf	frame_length, w
+						btfss	STATUS, Z				; Payload used up?
+						goto	next_frame_byte
+
+						call	receive_frame			; Yes, get the next frame
+						goto	recv_from_frame
+
+next_frame_byte:		movfw	frame_index
+						addlw	frame_buffer + 2		; Skip sequence and length
+						movwf	FSR
+						incf	frame_index, f
+						movfw	INDF
+						return
+
+; Drop the rest of the current frame's payload.  In raw mode, drop whatever
+; the host has sent until the line has been idle for 10 ms, since anything it
+; sent ahead after an error would be misinterpreted.
+discard_host_input:		btfss	mode_flags, MODE_FRAMED
+						goto	drain_host_input
+
+						movfw	frame_length
+						movwf	frame_index
+						return
+
+drain_host_input:		movfw	rx_head
+						movwf	rx_tail					; Empty the ring
+						movlw	.200					; 200 * 50 us = 10 ms
+						call	delay
+						movfw	rx_head
+						xorwf	rx_tail, w
+						btfss	STATUS, Z				; Anything arrive?
+						goto	drain_host_input		; Yes, wait some more
+
+						clrf	rx_status
+						return
+
+; Append W to the response to the current frame.  If the response is full,
+; the byte is dropped.
+queue_response:			movwf	frame_temp
+						movfw	response_length
+						sublw	FRAME_MAX_PAYLOAD - 1	; C is clear if the buffer is full
+						btfss	STATUS, C
+						return
+
+						movfw	response_length
+						addlw	response_buffer
+						movwf	FSR
+						movfw	frame_temp
+						movwf	INDF
+						incf	response_length, f
+						return
+
+; Ack the current frame if that hasn't been done, then wait for the next
+; good frame from the host.
+receive_frame:			btfsc	mode_flags, MODE_RESPONSE_OWED
+						call	send_ack_frame
+
+frame_hunt:				bcf		error_flag, ERROR_FLAG_RECEIVE
+						call	uart_recv
+						xorlw	FRAME_START
+						btfss	STATUS, Z
+						goto	frame_hunt				; Skip anything between frames
+
+						movlw	frame_buffer
+						movwf	FSR
+						call	uart_recv				; Sequence number
+						movwf	INDF
+						incf	FSR, f
+						call	uart_recv				; Payload length
+						movwf	INDF
+						incf	FSR, f
+						movwf	frame_temp
+						sublw	FRAME_MAX_PAYLOAD		; C is clear if too long
+						btfss	STATUS, C
+						goto	frame_bad
+
+						movfw	frame_temp
+						addlw	2						; Payload and CRC
+						movwf	frame_count
+frame_byte_loop:		call	uart_recv
+						movwf	INDF
+						incf	FSR, f
+						decfsz	frame_count, f
+						goto	frame_byte_loop
+
+						btfsc	error_flag, ERROR_FLAG_RECEIVE
+						goto	frame_bad				; Lost a byte somewhere
+
+						; Check the CRC of sequence, length and payload
+						call	crc_init
+						movlw	frame_buffer
+						movwf	FSR
+						movfw	frame_temp
+						addlw	2
+						movwf	frame_count
+frame_crc_loop:			movfw	INDF
+						call	crc_update
+						incf	FSR, f
+						decfsz	frame_count, f
+						goto	frame_crc_loop
+
+						movfw	INDF					; FSR is at the received CRC
+						xorwf	crc_hi, w
+						btfss	STATUS, Z
+						goto	frame_bad
+						incf	FSR, f
+						movfw	INDF
+						xorwf	crc_lo, w
+						btfss	STATUS, Z
+						goto	frame_bad
+
+						; Good frame.  Check the sequence number.
+						movlw	frame_buffer
+						movwf	FSR
+						movfw	INDF
+						xorwf	frame_seq, w
+						btfsc	STATUS, Z
+						goto	frame_repeat			; Host missed our response
+
+						incf	frame_seq, w
+						xorwf	INDF, w
+						btfss	STATUS, Z
+						goto	frame_bad				; Out of sequence
+
+						incf	frame_seq, f
+						movfw	frame_temp
+						movwf	frame_length
+						clrf	frame_index
+						clrf	response_length
+						bsf		mode_flags, MODE_RESPONSE_OWED
+						return
+
+frame_repeat:			call	send_ack_frame			; Response is still in the buffer
+						goto	frame_hunt
+
+frame_bad:				call	send_nak_frame
+						goto	frame_hunt
+
+; Send the response to the last frame accepted
+send_ack_frame:			bcf		mode_flags, MODE_RESPONSE_OWED
+						call	crc_init
+						movlw	FRAME_START
+						call	uart_send
+						movlw	FRAME_ACK
+						call	send_frame_byte
+						movfw	frame_seq
+						call	send_frame_byte
+						movfw	response_length
+						call	send_frame_byte
+
+						movfw	response_length
+						movwf	frame_count
+						movlw	response_buffer
+						movwf	FSR
+ack_payload_loop:		movf	frame_count, f
+						btfsc	STATUS, Z
+						goto	send_frame_crc
+						movfw	INDF
+						call	send_frame_byte
+						incf	FSR, f
+						decf	frame_count, f
+						goto	ack_payload_loop
+
+; Ask the host to resend the next frame
+send_nak_frame:			call	crc_init
+						movlw	FRAME_START
+						call	uart_send
+						movlw	FRAME_NAK
+						call	send_frame_byte
+						incf	frame_seq, w
+						call	send_frame_byte
+						movlw	0						; No payload
+						call	send_frame_byte
+
+send_frame_crc:			movfw	crc_hi
+						call	uart_send
+						movfw	crc_lo
+						goto	uart_send
+
+; Send W over the UART and add it to the CRC
+send_frame_byte:		movwf	frame_temp
+						call	crc_update
+						movfw	frame_temp
+						goto	uart_send
+
+crc_init:				movlw	0xff
+						movwf	crc_hi
+						movwf	crc_lo
+						return
+
+; Add the byte in W to the CRC in crc_hi/crc_lo
+crc_update:				xorwf	crc_hi, f
+						movlw	8
+						movwf	crc_bit_count
+crc_bit_loop:			bcf		STATUS, C
+						rlf		crc_lo, f
+						rlf		crc_hi, f
+						btfss	STATUS, C				; Was the top bit set?
+						goto	crc_no_xor
+						movlw	CRC_POLY_HI
+						xorwf	crc_hi, f
+						movlw	CRC_POLY_LO
+						xorwf	crc_lo, f
+crc_no_xor:				decfsz	crc_bit_count, f
+						goto	crc_bit_loop
+						return
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Write a program word to flash and verify that it was written correctly.
+;; In MODE_DATA, the word is a data EEPROM byte shifted left one.
+;;
+;;   program_word_hi (in)       High 8 bits of program word to write
+;;   program_word_lo (in)       Low 8 bits of program word to write
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+write_program_word:		movlw	CMD_LOAD_DATA_PROGRAM
+						btfsc	mode_flags, MODE_DATA
+						movlw	CMD_LOAD_DATA_DATA
+						call	send_to_target6
+
+						nop		; Wait Tdly2
+
+						call	send_to_target16		; Write data
+
+						movlw	CMD_BEGIN_PROGRAM_ONLY_CYCLE	; Begin programming only cycle
+						call	send_to_target6
+
+						; Wait Tprog, or Tdprog for data EEPROM, which is the
+						; same as Tera on the parts that have it
+						movfw	tprog_hi
+						btfsc	mode_flags, MODE_DATA
+						movfw	tera_hi
+						movwf	delay_hi
+						movfw	tprog_lo
+						btfsc	mode_flags, MODE_DATA
+						movfw	tera_lo
+						movwf	delay_lo
+						call	delay_ticks
+
+						call	read_program_word
+						btfsc	mode_flags, MODE_GANG
+						goto	verify_gang
+
 						; Verify MSB
 						movfw	verify_word_hi
 						xorwf	program_word_hi, w	; Compare against low word
@@ -531,83 +1988,420 @@ write_program_word:		movlw	CMD_LOAD_DATA_PROGRAM
 						goto	wpw_error			; Did not equal
 
 						; Increment address
-						movlw	CMD_INCREMENT_ADDR
+wpw_next:				movlw	CMD_INCREMENT_ADDR
 						call	send_to_target6
 
 						nop		; Wait Tdly2
 						return
 
-wpw_error:				bsf		error_flag, 0
+wpw_error:				bsf		error_flag, ERROR_FLAG_VERIFY
 
 						return
 
+						; gang_sample has the PORTB data lines that didn't match.
+						; Add the RA3 target, then drop the targets that failed.
+verify_gang:			movlw	0xff ^ GANG_RESERVED
+						andwf	gang_sample, f			; Not data lines
+						movfw	verify_word_hi
+						xorwf	program_word_hi, w
+						btfss	STATUS, Z
+						bsf		gang_sample, GANG_PRIMARY
+						movfw	verify_word_lo
+						xorwf	program_word_lo, w
+						btfss	STATUS, Z
+						bsf		gang_sample, GANG_PRIMARY
+
+						movfw	gang_active
+						andwf	gang_sample, f			; Only ones still being checked
+						movfw	gang_sample
+						iorwf	gang_failed, f			; Reported with the next ack
+						xorwf	gang_active, f			; Stop checking them
+						btfsc	STATUS, Z				; Any left?
+						goto	wpw_error
+						goto	wpw_next
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Acknowledge a write.  In gang mode, if any targets have failed since the
+;; last ack, send 'G' and a bitmap of them instead of '+'.
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+send_write_ack:			movf	gang_failed, f
+						btfsc	STATUS, Z
+						goto	send_write_ok
+
+						movlw	'G'
+						call	send_to_host
+						movfw	gang_failed
+						clrf	gang_failed
+						goto	send_to_host
+
+send_write_ok:			movlw	'+'
+						goto	send_to_host
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Erase program memory (data EEPROM in MODE_DATA) and wait Tera
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+bulk_erase:				movlw	CMD_BULK_ERASE_PROGRAM
+						btfsc	mode_flags, MODE_DATA
+						movlw	CMD_BULK_ERASE_DATA
+						call	send_to_target6
+
+						movfw	tera_hi
+						movwf	delay_hi
+						movfw	tera_lo
+						movwf	delay_lo
+						goto	delay_ticks
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Add the byte in W to the running checksum, the same way 'W' does
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+add_to_checksum:		addwf	checksum_lo, f
+						movfw	checksum_lo
+						addwf	checksum_hi, f
+						return
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; PIC18 target helpers
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+; Set the target's table pointer to tblptr_u:tblptr_h:tblptr_l
+pic18_load_tblptr:		movfw	tblptr_u
+						call	pic18_movlw
+						PIC18_INSTRUCTION	0x6ef8		; MOVWF TBLPTRU
+						movfw	tblptr_h
+						call	pic18_movlw
+						PIC18_INSTRUCTION	0x6ef7		; MOVWF TBLPTRH
+						movfw	tblptr_l
+						call	pic18_movlw
+						PIC18_INSTRUCTION	0x6ef6		; MOVWF TBLPTRL
+						return
+
+; Execute MOVLW with W as the literal
+pic18_movlw:			movwf	program_word_lo
+						movlw	0x0e
+						movwf	program_word_hi
+
+; Execute the instruction in program_word_hi/program_word_lo
+pic18_core_instruction:	movlw	PIC18_CORE_INSTRUCTION
+						call	send_to_target4
+						goto	send_to_target16
+
+; Write the byte in W to both halves of the table latch, without programming
+pic18_table_write:		movwf	program_word_lo
+						movwf	program_word_hi
+						movlw	PIC18_TABLE_WRITE
+						call	send_to_target4
+						goto	send_to_target16
+
+; Programming starts on the fourth clock of the NOP after a
+; PIC18_TABLE_WRITE_START, which is held high for Tprog, then low for P10.
+pic18_program_wait:		clrf	word_shift_register
+						SEND_BIT	word_shift_register, 0
+						SEND_BIT	word_shift_register, 0
+						SEND_BIT	word_shift_register, 0
+						bsf		PORTA, PGM_CLOCK
+						movfw	tprog_hi
+						movwf	delay_hi
+						movfw	tprog_lo
+						movwf	delay_lo
+						call	delay_ticks
+						bcf		PORTA, PGM_CLOCK
+						clrf	delay_hi
+						movlw	PIC18_P10
+						movwf	delay_lo
+						call	delay_ticks
+						clrf	program_word_hi
+						clrf	program_word_lo
+						goto	send_to_target16
+
+; Read the byte at the table pointer into W and verify_word_lo, and advance
+; the table pointer.  The target ignores the first 8 data bits, then drives
+; the data line for the next 8.
+pic18_read_byte:		movlw	PIC18_TABLE_READ_INC
+						call	send_to_target4
+						clrf	program_word_hi
+						call	send_to_target8
+
+						bsf		STATUS, RP0				; Page 1
+						bsf		TRISA, PGM_DATA			; Data into an input
+						bcf		STATUS, RP0				; Page 0
+						clrf	verify_word_lo
+						RECV_BIT	verify_word_lo, 0
+						RECV_BIT	verify_word_lo, 1
+						RECV_BIT	verify_word_lo, 2
+						RECV_BIT	verify_word_lo, 3
+						RECV_BIT	verify_word_lo, 4
+						RECV_BIT	verify_word_lo, 5
+						RECV_BIT	verify_word_lo, 6
+						RECV_BIT	verify_word_lo, 7
+						bsf		STATUS, RP0				; Page 1
+						bcf		TRISA, PGM_DATA			; Back to an output
+						bcf		STATUS, RP0				; Page 0
+						movfw	verify_word_lo
+						return
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Load data for configuration memory
+;; Advances the PC to the start of configuration memory (0x2000-0x200F)
+;; and loads the data for the first ID location.  This overwrites
+;; program_word_hi and program_word_lo.
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+load_configuration:		movlw	CMD_LOAD_CONFIGURATION
+						call	send_to_target6
+
+						; 0x7ffe as data of command
+						movlw	0xfe
+						movwf	program_word_lo
+						movlw	0x7f
+						movwf	program_word_hi
+						call	send_to_target16
+						return
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Read the program word at the current address.  The address is not changed.
+;;
+;;   verify_word_hi (out)       High 8 bits of program word
+;;   verify_word_lo (out)       Low 8 bits of program word
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+read_program_word:		movlw	CMD_READ_PROGRAM_MEMORY
+						btfsc	mode_flags, MODE_DATA
+						movlw	CMD_READ_DATA_MEMORY
+						call	send_to_target6
+
+						; Turn the data lines into inputs so we can read back from
+						; the targets
+						bsf		STATUS, RP0		; Switch to page 1
+						bsf		TRISA, PGM_DATA	; Turn data into an input
+						movlw	0xff
+						movwf	TRISB			; Gang data lines too
+						bcf		STATUS, RP0		; Back to page 0
+
+						btfsc	mode_flags, MODE_GANG	; Also waits Tdly2
+						goto	read_gang
+						call	recv_from_target16
+						goto	read_done
+
+read_gang:				call	recv_from_target16_gang
+
+read_done:				bcf		verify_word_lo, 0	; Ignore low bit
+						bcf		verify_word_hi, 7	; Ignore high bit
+						movlw	0x01				; Data memory only has bits 1-8
+						btfsc	mode_flags, MODE_DATA
+						andwf	verify_word_hi, f
+
+						; Turn the data lines back into outputs
+						comf	gang_mask, w
+						bsf		STATUS, RP0		; Switch to page 1
+						bcf		TRISA, PGM_DATA	; Turn data back into an output
+						movwf	TRISB
+						bcf		STATUS, RP0		; Back to page 0
+						return
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Decrement the 16 bit count in program_size_hi/program_size_lo.  Z is set
+;; on return if the count was already zero (it is then left at zero).
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+decrement_program_size:	movfw	program_size_lo
+						iorwf	program_size_hi, w
+						btfsc	STATUS, Z				; Already zero?
+						return							; Yes, Z is set
+
+						movlw	1
+						subwf	program_size_lo, f
+						btfss	STATUS, C				; Borrow?
+						decf	program_size_hi, f		; Yes, decrement high byte
+						bcf		STATUS, Z
+						return
+
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;;
-;; Write 6 bits to target
+;; Write a 6 bit command in W to the target, LSb first
 ;; PGM_CLOCK is left low on exit
 ;;
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-send_to_target6:		movwf	word_shift_register
-						movlw	6
-						movwf	word_shift_count
-						goto	send_to_target_common
+send_to_target6:		bsf		profile_phase, PROFILE_TARGET
+						movwf	word_shift_register
+						btfsc	mode_flags, MODE_GANG
+						goto	send_to_target6_gang
+						SEND_BIT	word_shift_register, 0
+						SEND_BIT	word_shift_register, 1
+						SEND_BIT	word_shift_register, 2
+						SEND_BIT	word_shift_register, 3
+						SEND_BIT	word_shift_register, 4
+						SEND_BIT	word_shift_register, 5
+						bcf		profile_phase, PROFILE_TARGET
+						return
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;;
-;; Write 8 bits to target
+;; Write a 4 bit PIC18 command in W to the target, LSb first.  There is no
+;; gang mode version.
 ;; PGM_CLOCK is left low on exit
 ;;
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-send_to_target8:		movwf	word_shift_register
-						movlw	8
-						movwf	word_shift_count
-						goto	send_to_target_common
-
-; Common part of send_to_target6 and send_to_target8
-; Bit bang data to the target.  Data is latched on the falling edge of PGM_CLOCK.  Command
-; and data words are clocked in LSb first.
-send_to_target_common:	bsf		PORTA, PGM_CLOCK		; PGM_CLOCK goes high
-						btfss	word_shift_register, 0	; Is the next bit to shift a 1?
-						goto	not_on					; It's clear
-						bsf 	PORTA, PGM_DATA			; Set data bit
-						goto	bit_set_done
-not_on:					bcf		PORTA, PGM_DATA			; Clear data bit
-bit_set_done:			rrf		word_shift_register, f
-						bcf		PORTA, PGM_CLOCK			; PGM_CLOCK goes low
-						decfsz	word_shift_count, f		; Decrement loop count, drop out if done
-						goto	send_to_target_common   ; Next bit
+send_to_target4:		bsf		profile_phase, PROFILE_TARGET
+						movwf	word_shift_register
+						SEND_BIT	word_shift_register, 0
+						SEND_BIT	word_shift_register, 1
+						SEND_BIT	word_shift_register, 2
+						SEND_BIT	word_shift_register, 3
+						bcf		profile_phase, PROFILE_TARGET
 						return
 
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Write 16 bits of data to the target, LSb first
+;; PGM_CLOCK is left low on exit
+;;
+;;   program_word_hi (in)       High 8 bits of data
+;;   program_word_lo (in)       Low 8 bits of data
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+send_to_target16:		bsf		profile_phase, PROFILE_TARGET
+						btfsc	mode_flags, MODE_GANG
+						goto	send_to_target16_gang
+						SEND_BIT	program_word_lo, 0
+						SEND_BIT	program_word_lo, 1
+						SEND_BIT	program_word_lo, 2
+						SEND_BIT	program_word_lo, 3
+						SEND_BIT	program_word_lo, 4
+						SEND_BIT	program_word_lo, 5
+						SEND_BIT	program_word_lo, 6
+						SEND_BIT	program_word_lo, 7
+send_to_target8:		; Just the high 8 bits, for PIC18 targets
+						bsf		profile_phase, PROFILE_TARGET
+						SEND_BIT	program_word_hi, 0
+						SEND_BIT	program_word_hi, 1
+						SEND_BIT	program_word_hi, 2
+						SEND_BIT	program_word_hi, 3
+						SEND_BIT	program_word_hi, 4
+						SEND_BIT	program_word_hi, 5
+						SEND_BIT	program_word_hi, 6
+						SEND_BIT	program_word_hi, 7
+						bcf		profile_phase, PROFILE_TARGET
+						return
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;;
-;; Read 8 bits of data from the synchronous serial interface
+;; Read 16 bits of data from the synchronous serial interface, LSb first
 ;; The PGM_CLOCK must start out low on entry to this function.  It will be low on
-;; exit.  This modifies word_shift_count and word_shift_register.
-;; The received octet will be returned in W
-;; PGM_CLOCK is left low on exit
+;; exit.
 ;; It is expected that PGM_DATA will already be configured as an input when this
 ;; is called.
 ;;
+;;   verify_word_hi (out)       High 8 bits of data
+;;   verify_word_lo (out)       Low 8 bits of data
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+recv_from_target16:		bsf		profile_phase, PROFILE_TARGET
+						clrf	verify_word_lo
+						clrf	verify_word_hi
+						RECV_BIT	verify_word_lo, 0
+						RECV_BIT	verify_word_lo, 1
+						RECV_BIT	verify_word_lo, 2
+						RECV_BIT	verify_word_lo, 3
+						RECV_BIT	verify_word_lo, 4
+						RECV_BIT	verify_word_lo, 5
+						RECV_BIT	verify_word_lo, 6
+						RECV_BIT	verify_word_lo, 7
+						RECV_BIT	verify_word_hi, 0
+						RECV_BIT	verify_word_hi, 1
+						RECV_BIT	verify_word_hi, 2
+						RECV_BIT	verify_word_hi, 3
+						RECV_BIT	verify_word_hi, 4
+						RECV_BIT	verify_word_hi, 5
+						RECV_BIT	verify_word_hi, 6
+						RECV_BIT	verify_word_hi, 7
+						bcf		profile_phase, PROFILE_TARGET
+						return
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Gang mode versions of send_to_target6, send_to_target16 and
+;; recv_from_target16.  Data goes out on all of the data lines, and data read
+;; back from the PORTB lines is compared against program_word_hi/lo as it
+;; arrives, since there is no room to keep a word for each target.
+;;
+;;   gang_sample (out)          PORTB bits that didn't match (the UART's bits
+;;                              are meaningless)
+;;
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-recv_from_target8:		movlw	8						; Count of bits to read (8)
-						movwf	word_shift_count		; Stash in count register
-bit_loop:				bsf		PORTA, PGM_CLOCK		; PGM_CLOCK goes high
+send_to_target6_gang:
+						SEND_GANG_BIT	word_shift_register, 0
+						SEND_GANG_BIT	word_shift_register, 1
+						SEND_GANG_BIT	word_shift_register, 2
+						SEND_GANG_BIT	word_shift_register, 3
+						SEND_GANG_BIT	word_shift_register, 4
+						SEND_GANG_BIT	word_shift_register, 5
+						bcf		profile_phase, PROFILE_TARGET
+						return
 
-						; Need to wait Tdly3.  These two instructions are adequate delay...
-						bcf		STATUS, C				; Clear carry bit
-						rrf		word_shift_register, f	; Rotate bits
+send_to_target16_gang:
+						SEND_GANG_BIT	program_word_lo, 0
+						SEND_GANG_BIT	program_word_lo, 1
+						SEND_GANG_BIT	program_word_lo, 2
+						SEND_GANG_BIT	program_word_lo, 3
+						SEND_GANG_BIT	program_word_lo, 4
+						SEND_GANG_BIT	program_word_lo, 5
+						SEND_GANG_BIT	program_word_lo, 6
+						SEND_GANG_BIT	program_word_lo, 7
+						SEND_GANG_BIT	program_word_hi, 0
+						SEND_GANG_BIT	program_word_hi, 1
+						SEND_GANG_BIT	program_word_hi, 2
+						SEND_GANG_BIT	program_word_hi, 3
+						SEND_GANG_BIT	program_word_hi, 4
+						SEND_GANG_BIT	program_word_hi, 5
+						SEND_GANG_BIT	program_word_hi, 6
+						SEND_GANG_BIT	program_word_hi, 7
+						bcf		profile_phase, PROFILE_TARGET
+						return
 
-						btfsc	PORTA, PGM_DATA			; Skip next if data is clear
-						bsf		word_shift_register, 7	; Data is set, so set most significant bit
-						bcf		PORTA, PGM_CLOCK			; PGM_CLOCK goes low
-						decfsz	word_shift_count, f		; Decrement loop count, drop out if done
-						goto	bit_loop				; Do next bit
-						movfw	word_shift_register
+recv_from_target16_gang:	bsf		profile_phase, PROFILE_TARGET
+						clrf	verify_word_lo
+						clrf	verify_word_hi
+						clrf	gang_sample
+						RECV_BIT	verify_word_lo, 0		; Padding, not checked
+						RECV_GANG_BIT	verify_word_lo, 1, program_word_lo
+						RECV_GANG_BIT	verify_word_lo, 2, program_word_lo
+						RECV_GANG_BIT	verify_word_lo, 3, program_word_lo
+						RECV_GANG_BIT	verify_word_lo, 4, program_word_lo
+						RECV_GANG_BIT	verify_word_lo, 5, program_word_lo
+						RECV_GANG_BIT	verify_word_lo, 6, program_word_lo
+						RECV_GANG_BIT	verify_word_lo, 7, program_word_lo
+						RECV_GANG_BIT	verify_word_hi, 0, program_word_hi
+						RECV_GANG_BIT	verify_word_hi, 1, program_word_hi
+						RECV_GANG_BIT	verify_word_hi, 2, program_word_hi
+						RECV_GANG_BIT	verify_word_hi, 3, program_word_hi
+						RECV_GANG_BIT	verify_word_hi, 4, program_word_hi
+						RECV_GANG_BIT	verify_word_hi, 5, program_word_hi
+						RECV_GANG_BIT	verify_word_hi, 6, program_word_hi
+						RECV_BIT	verify_word_hi, 7		; Padding, not checked
+						bcf		profile_phase, PROFILE_TARGET
 						return
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
@@ -617,13 +2411,35 @@ bit_loop:				bsf		PORTA, PGM_CLOCK		; PGM_CLOCK goes high
 ;;
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-delay:					movwf	delay_interval
+delay:					bsf		profile_phase, PROFILE_DELAY
+						movwf	delay_interval
 delay_loop1:			movlw	.15						; 1 cycle
 						movwf	delay_sub_count			; 1 cycle
 delay_loop2:			decfsz	delay_sub_count, f		; 1 cycle
 						goto	delay_loop2				; 2 cycles
 						decfsz	delay_interval, f		; 1 cycle
 						goto	delay_loop1				; 2 cycles
+						bcf		profile_phase, PROFILE_DELAY
+						return
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;;
+;; Delay for delay_hi:delay_lo 10 uS ticks, which must not be zero.  Each pass
+;; through the loop is 10 cycles.  The call and the last pass add a few more,
+;; so the delay is never short.
+;;
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+delay_ticks:			bsf		profile_phase, PROFILE_DELAY	; 1 cycle
+						movlw	1						; 1 cycle
+						subwf	delay_lo, f				; 1 cycle
+						btfss	STATUS, C				; 2 cycles with the decf
+						decf	delay_hi, f
+						movfw	delay_lo				; 1 cycle
+						iorwf	delay_hi, w				; 1 cycle
+						btfss	STATUS, Z				; 1 cycle
+						goto	delay_ticks				; 2 cycles
+						bcf		profile_phase, PROFILE_DELAY
 						return
 
 						end